@@ -0,0 +1,28 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+# graph_parse.sh --- measure run.c parse time and memory on large graphs
+# Copyright (c) 2026 Jakob Kastelic
+#
+# Generates a graph of <edges> edges split over <parts> files that are
+# pulled in with include statements, each edge joining two of <nodes>
+# distinct commands, and reports what "run -n" measures for it.
+#
+# Usage: sh bench/graph_parse.sh [<edges> [<nodes> [<parts>]]]
+
+EDGES=${1:-10000}
+NODES=${2:-2000}
+PARTS=${3:-10}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v e="$EDGES" -v n="$NODES" -v p="$PARTS" -v dir="$TMP" 'BEGIN {
+	srand(1);
+	for (i = 0; i < p; i++)
+		printf "include \"part_%d.dot\";\n", i > (dir "/main.dot");
+	for (i = 0; i < e; i++) {
+		a = int(rand() * n); b = int(rand() * n);
+		printf "\"lua src/node.lua --id %d\" -> \"lua src/node.lua --id %d\";\n",
+			a, b > (dir "/part_" (i % p) ".dot");
+	}
+}'
+bin/run -n "$TMP/main.dot"
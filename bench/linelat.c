@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: MIT
+// linelat.c --- line latency probe for run.c transports
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     linelat is used in pairs inside a run.c graph to measure how long a
+ *     line takes to travel from one node's stdout to another node's stdin.
+ *     The source writes one CLOCK_MONOTONIC timestamp per line; the sink
+ *     subtracts it from its own clock on arrival.
+ *
+ * USAGE
+ *     linelat src <lines> <interval_us> [<pad>]
+ *         Emit <lines> timestamp lines, one every <interval_us>
+ *         microseconds, each padded with <pad> filler bytes. Then report
+ *         own CPU time on stderr and wait to be terminated.
+ *
+ *     linelat sink <lines>
+ *         Read <lines> lines, then report latency percentiles and own
+ *         CPU time on stderr and exit 0 (which ends the graph).
+ *
+ * OUTPUT (stderr)
+ *     src  cpu_ms=<user+sys>
+ *     sink lines=<n> p50_us=<x> p99_us=<x> max_us=<x> cpu_ms=<user+sys>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double cpu_ms(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void run_src(long lines, long interval_us, int pad)
+{
+	char fill[4096];
+	if (pad < 0 || pad >= (int)sizeof fill)
+		pad = 0;
+	memset(fill, 'x', (size_t)pad);
+	fill[pad] = '\0';
+
+	struct timespec gap = {interval_us / 1000000,
+			       (interval_us % 1000000) * 1000};
+	for (long i = 0; i < lines; i++) {
+		printf("%lld %s\n", (long long)now_ns(), fill);
+		fflush(stdout);
+		if (interval_us > 0)
+			nanosleep(&gap, NULL);
+	}
+	fprintf(stderr, "src  cpu_ms=%.1f\n", cpu_ms());
+}
+
+static int run_sink(long lines)
+{
+	int64_t *lat = malloc((size_t)lines * sizeof *lat);
+	char buf[8192];
+	long n = 0;
+	while (n < lines && fgets(buf, sizeof buf, stdin)) {
+		long long t;
+		if (sscanf(buf, "%lld", &t) == 1)
+			lat[n++] = now_ns() - t;
+	}
+	if (n == 0) {
+		fprintf(stderr, "sink no lines received\n");
+		return 1;
+	}
+	qsort(lat, (size_t)n, sizeof *lat, cmp_i64);
+	fprintf(stderr,
+		"sink lines=%ld p50_us=%.1f p99_us=%.1f max_us=%.1f "
+		"cpu_ms=%.1f\n",
+		n, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3,
+		cpu_ms());
+	free(lat);
+	/* Let the source report its own CPU time before the graph ends */
+	struct timespec grace = {0, 200000000L};
+	nanosleep(&grace, NULL);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && strcmp(argv[1], "src") == 0) {
+		run_src(atol(argv[2]), atol(argv[3]),
+			argc > 4 ? atoi(argv[4]) : 0);
+		for (;;) /* exiting would end the graph before the sink */
+			pause();
+	}
+	if (argc == 3 && strcmp(argv[1], "sink") == 0)
+		return run_sink(atol(argv[2]));
+	fprintf(stderr,
+		"Usage: %s src <lines> <interval_us> [<pad>]\n"
+		"       %s sink <lines>\n",
+		argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,1009 @@
+// SPDX-License-Identifier: MIT
+// midi.c --- drive src/midi.c through the mock RtMidi backend
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     Builds src/midi.c into this program (its main() renamed midi_main)
+ *     together with bench/mock/rtmidi_mock.c, runs it in a thread with
+ *     stdin and stdout connected to pipes, opens mock port 0 as input and
+ *     injects note-on/note-off messages into it from this thread, which
+ *     plays the part of RtMidi's backend thread. A reader thread consumes
+ *     midi's stdout, optionally sleeping after each line to model a slow
+ *     consumer (a congested PTY or a busy downstream node).
+ *
+ *     The program runs in a fresh temporary directory so that midi does
+ *     not touch the real log/midi.log, and removes it on exit.
+ *
+ * USAGE
+ *     bench_midi wcet [<events> [<interval_us> [<consumer_us>]]]
+ *         Inject <events> messages, one every <interval_us>, and report
+ *         the execution time of midi's input callback.
+ *
+ *     bench_midi jitter [<events> [<interval_us> [<delay_us> [<log>]]]]
+ *         Inject <events> note-ons, one every <interval_us> or, if <log>
+ *         is given, at the onset times of its NOTE_ON ... TIME:<ms> lines
+ *         (a recorded session such as log/midi_notes.log). Each message
+ *         carries its true driver time stamp but is delivered up to
+ *         <delay_us> late, uniformly at random, as when the backend
+ *         thread is not scheduled promptly. Compares how far the TIME
+ *         and MONO_US fields deviate from the true onset times.
+ *
+ *     bench_midi clock [<seconds> [<bpm>]]
+ *         Model a keyboard that streams timing clock (24 per beat) and
+ *         active sensing (every 300 ms) around one note per beat. Runs
+ *         for <seconds> with MIDI FILTER NONE, then with the default
+ *         filter, and reports callback and main-loop wakeups per second.
+ *
+ *     bench_midi merge [<events> [<interval_us>]]
+ *         Inject <events> note-ons, one every <interval_us>, first all
+ *         into port 0, then alternately into ports 0 and 1 (opened with
+ *         MIDI IN ADD) from two threads, each standing in for the backend
+ *         thread of its port. Reports the delay from MONO_US to the line
+ *         reaching the reader, and how many lines left the merge out of
+ *         MONO_US order.
+ *
+ *     bench_midi hotplug [<seconds>]
+ *         Open mock ports 0 and 1 as input and output, leave midi idle
+ *         for <seconds> and count the context switches of its main
+ *         thread, then unplug and replug both ports through the mock's
+ *         fake uevents. Reports how long it took to notice the loss and
+ *         to reopen the saved devices.
+ *
+ *     bench_midi schedule [<events> [<interval_us>]]
+ *         Play <events> notes, one every <interval_us>, to mock output
+ *         port 1 in two ways: by writing MIDI NOTE_ON when each note is
+ *         due (as bin/karaoke does), and by queueing all of them ahead
+ *         with MIDI SCHEDULE. Reports how late each reached the port.
+ *
+ *     bench_midi output [<notes> [<forwards>]]
+ *         With MIDI FORWARD ON, write <notes> MIDI NOTE_ON commands at
+ *         once, then inject <forwards> note-ons into input port 0, one
+ *         every 2 ms, while the play queue is still backed up. Runs with
+ *         the default MIDI RATE and then with the rate unlimited, and
+ *         reports the byte rate at the output port and how long the
+ *         forwarded notes took to reach it.
+ *
+ *     bench_midi latency [<bursts> [<burst_len> [<gap_us> [<json>]]]]
+ *         With MIDI FORWARD ON and the default MIDI RATE, inject
+ *         <bursts> bursts of <burst_len> back-to-back note-ons into input
+ *         port 0, one burst every <gap_us>, each followed by its
+ *         note-offs half a gap later. Then write the same bursts as MIDI
+ *         NOTE_ON commands, one write() per burst. Measures three paths:
+ *             callback_to_stdout  injection to the NOTE_ON line
+ *                                 reaching the reader
+ *             forward             injection to the forwarded note-on
+ *                                 reaching output port 1
+ *             command             write() of the command to the note-on
+ *                                 reaching output port 1
+ *         and writes their distributions to <json> (default: stdout) as
+ *             {"bursts": <n>, "burst_len": <n>, "gap_us": <n>,
+ *              "paths": {"<path>": {"n": <n>, "p50_us": <x>,
+ *                        "p99_us": <x>, "max_us": <x>,
+ *                        "hist_us": [[<le>, <count>], ...]}, ...}}
+ *         where hist_us counts the samples up to each power-of-two bound
+ *         <le> that is not already counted by the previous bound, leaving
+ *         out empty bins. "make bench-midi" runs this mode.
+ *
+ * OUTPUT (stderr)
+ *     wcet events=<n> lines=<n> cb_p50_us=<x> cb_p99_us=<x> cb_max_us=<x>
+ *     jitter events=<n> field=<TIME|MONO_US> ioi_sd_us=<x> err_p99_us=<x>
+ *         err_max_us=<x>
+ *         (ioi_sd_us: standard deviation of the inter-onset interval
+ *         error; err: absolute onset error after removing the median
+ *         offset between measured and true onsets)
+ *     clock filter=<types> callbacks_per_s=<x> wakeups_per_s=<x>
+ *         notes=<n> clock=<n> sense=<n>
+ *     merge inputs=<n> events=<n> lat_p50_us=<x> lat_p99_us=<x>
+ *         lat_max_us=<x> out_of_order=<n> dev0=<n> dev1=<n>
+ *     hotplug idle_wakeups_per_s=<x> lost_ms=<x> reopened_ms=<x>
+ *     schedule mode=<direct|schedule> events=<n> late_p50_us=<x>
+ *         late_p99_us=<x> late_max_us=<x>
+ *     output rate=<bytes_per_s> bytes=<n> bytes_per_s=<x> fwd=<n>
+ *         fwd_p50_us=<x> fwd_max_us=<x>
+ *     latency path=<path> n=<n> p50_us=<x> p99_us=<x> max_us=<x>
+ */
+
+#define main midi_main
+#define HOTPLUG_OPEN mock_hotplug_fd
+#include "../src/midi.c"
+#undef main
+
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static int cmd_fd; /* write end of midi's stdin */
+static char tmp_dir[] = "/tmp/bench_midi.XXXXXX";
+
+static pthread_mutex_t rd_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rd_cv = PTHREAD_COND_INITIALIZER;
+static long n_lines;
+static int n_open; /* inputs opened so far */
+static long consumer_us;
+
+/* Onset times parsed from NOTE_ON lines, for the jitter benchmark, and
+   arrival time and DEV tag, for the merge benchmark */
+static int64_t *seen_ms, *seen_us, *seen_rx;
+static int *seen_dev;
+static long n_seen, max_seen;
+
+/* Send times at the mock output, for the schedule benchmark */
+static int64_t *sent_ns;
+static long n_sent, max_sent;
+
+/* Output bytes, forwarded note-ons and, if cmd_ns is set, note-ons
+   played by command at the mock output, for the output and latency
+   benchmarks */
+static long out_bytes;
+static int64_t out_first_ns, out_last_ns, *fwd_ns, *cmd_ns;
+static long n_fwd, max_fwd, n_cmd, max_cmd;
+
+/* Arrival of the first line starting with want, for the hotplug
+   benchmark */
+static char want[64];
+static int64_t want_ns;
+
+/* /proc/<pid>/task/<tid>/status of midi's main loop */
+static char midi_task[64];
+
+/* Last "STATUS MIDI received" line */
+static char received[1024];
+static long n_received;
+
+static void sleep_us(long us)
+{
+	struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+	nanosleep(&ts, NULL);
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int64_t mono_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *thr_midi(void *arg)
+{
+	(void)arg;
+	char task[48] = "";
+	if (readlink("/proc/thread-self", task, sizeof task - 1) > 0) {
+		pthread_mutex_lock(&rd_mu);
+		snprintf(midi_task, sizeof midi_task, "/proc/%s/status", task);
+		pthread_mutex_unlock(&rd_mu);
+	}
+	midi_main();
+	return NULL;
+}
+
+static void *thr_reader(void *arg)
+{
+	FILE *f = fdopen((int)(intptr_t)arg, "r");
+	char line[1024];
+	while (fgets(line, sizeof line, f)) {
+		pthread_mutex_lock(&rd_mu);
+		n_lines++;
+		if (strncmp(line, "STATUS MIDI input opened", 24) == 0)
+			n_open++;
+		if (want[0] && !want_ns &&
+		    strncmp(line, want, strlen(want)) == 0)
+			want_ns = mono_ns();
+		if (strncmp(line, "STATUS MIDI received:", 21) == 0) {
+			strcpy(received, line);
+			n_received++;
+		}
+		const char *tm = strstr(line, "TIME:");
+		const char *tu = strstr(line, "MONO_US:");
+		if (strncmp(line, "NOTE_ON ", 8) == 0 && tm && tu &&
+		    n_seen < max_seen) {
+			seen_ms[n_seen] = strtoll(tm + 5, NULL, 10);
+			seen_us[n_seen] = strtoll(tu + 8, NULL, 10);
+			const char *dv = strstr(line, "DEV:");
+			if (seen_rx)
+				seen_rx[n_seen] = mono_ns() / 1000;
+			if (seen_dev)
+				seen_dev[n_seen] = dv ? atoi(dv + 4) : -1;
+			n_seen++;
+		}
+		pthread_cond_broadcast(&rd_cv);
+		pthread_mutex_unlock(&rd_mu);
+		if (consumer_us > 0)
+			sleep_us(consumer_us);
+	}
+	return NULL;
+}
+
+static void command(const char *line)
+{
+	(void)write(cmd_fd, line, strlen(line));
+}
+
+/* Remove the temporary directory and the logs midi wrote into it; runs
+   at exit, while midi_main may still hold them open */
+static void remove_tmp_dir(void)
+{
+	char path[sizeof tmp_dir + 300];
+	snprintf(path, sizeof path, "%s/log", tmp_dir);
+	DIR *d = opendir(path);
+	if (d) {
+		struct dirent *e;
+		while ((e = readdir(d))) {
+			if (e->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof path, "%s/log/%s", tmp_dir,
+				 e->d_name);
+			unlink(path);
+		}
+		closedir(d);
+		snprintf(path, sizeof path, "%s/log", tmp_dir);
+		rmdir(path);
+	}
+	rmdir(tmp_dir);
+}
+
+/* Start midi_main with piped stdio and open mock port 0 as input */
+static void start_midi(void)
+{
+	if (!mkdtemp(tmp_dir)) {
+		perror("bench_midi: temp dir");
+		exit(1);
+	}
+	atexit(remove_tmp_dir);
+	if (chdir(tmp_dir) != 0 || mkdir("log", 0755) != 0) {
+		perror("bench_midi: temp dir");
+		exit(1);
+	}
+
+	int in[2], out[2];
+	if (pipe(in) != 0 || pipe(out) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	dup2(in[0], STDIN_FILENO);
+	dup2(out[1], STDOUT_FILENO);
+	close(in[0]);
+	close(out[1]);
+	cmd_fd = in[1];
+
+	pthread_t th;
+	pthread_create(&th, NULL, thr_reader, (void *)(intptr_t)out[0]);
+	pthread_detach(th);
+	pthread_create(&th, NULL, thr_midi, NULL);
+	pthread_detach(th);
+
+	command("MIDI IN 0\n");
+	pthread_mutex_lock(&rd_mu);
+	while (!n_open)
+		pthread_cond_wait(&rd_cv, &rd_mu);
+	pthread_mutex_unlock(&rd_mu);
+}
+
+/* Alternate note-on/note-off over one octave */
+static void inject_notes(long events, long interval_us)
+{
+	for (long i = 0; i < events; i++) {
+		unsigned char note = (unsigned char)(60 + (i / 2) % 12);
+		unsigned char msg[3] = {i % 2 ? 0x80 : 0x90, note,
+					i % 2 ? 0 : 100};
+		mock_in_send(0, msg, 3);
+		if (interval_us > 0)
+			sleep_us(interval_us);
+	}
+}
+
+static void wait_lines(long n, int timeout_ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&rd_mu);
+	while (n_lines < n &&
+	       pthread_cond_timedwait(&rd_cv, &rd_mu, &ts) == 0)
+		;
+	pthread_mutex_unlock(&rd_mu);
+}
+
+static int bench_wcet(long events, long interval_us)
+{
+	start_midi();
+	pthread_mutex_lock(&rd_mu);
+	long base = n_lines;
+	pthread_mutex_unlock(&rd_mu);
+
+	mock_cb_reset();
+	inject_notes(events, interval_us);
+	wait_lines(base + events, 60000);
+
+	size_t n;
+	const int64_t *t = mock_cb_times(&n);
+	if (n == 0) {
+		fprintf(stderr, "wcet no callbacks\n");
+		return 1;
+	}
+	int64_t *sorted = malloc(n * sizeof *sorted);
+	memcpy(sorted, t, n * sizeof *sorted);
+	qsort(sorted, n, sizeof *sorted, cmp_i64);
+	pthread_mutex_lock(&rd_mu);
+	long lines = n_lines - base;
+	pthread_mutex_unlock(&rd_mu);
+	fprintf(stderr,
+		"wcet events=%zu lines=%ld cb_p50_us=%.2f cb_p99_us=%.2f "
+		"cb_max_us=%.2f\n",
+		n, lines, sorted[n / 2] / 1e3, sorted[n * 99 / 100] / 1e3,
+		sorted[n - 1] / 1e3);
+	free(sorted);
+	return 0;
+}
+
+static void sleep_until_ns(int64_t t)
+{
+	struct timespec ts = {(time_t)(t / 1000000000), (long)(t % 1000000000)};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/* Onset offsets in us: from NOTE_ON lines of a log, or an even grid */
+static long load_onsets(int64_t *off, long events, long interval_us,
+			const char *log)
+{
+	if (!log) {
+		for (long i = 0; i < events; i++)
+			off[i] = i * interval_us;
+		return events;
+	}
+	FILE *f = fopen(log, "r");
+	if (!f) {
+		perror(log);
+		exit(1);
+	}
+	char line[1024];
+	long n = 0;
+	int64_t t0 = 0;
+	while (n < events && fgets(line, sizeof line, f)) {
+		const char *tm = strstr(line, "TIME:");
+		if (strncmp(line, "NOTE_ON ", 8) != 0 || !tm)
+			continue;
+		int64_t t = strtoll(tm + 5, NULL, 10);
+		if (n == 0)
+			t0 = t;
+		off[n++] = (t - t0) * 1000;
+	}
+	fclose(f);
+	return n;
+}
+
+static void report_err(const char *field, const int64_t *t, double scale,
+		       const int64_t *off, long n)
+{
+	double sum = 0, sum2 = 0;
+	int64_t *err = malloc((size_t)n * sizeof *err);
+	for (long i = 0; i < n; i++)
+		err[i] = (int64_t)((t[i] - t[0]) * scale) - (off[i] - off[0]);
+	qsort(err, (size_t)n, sizeof *err, cmp_i64);
+	int64_t median = err[n / 2];
+	for (long i = 0; i < n; i++) {
+		int64_t e = (int64_t)((t[i] - t[0]) * scale) -
+			    (off[i] - off[0]) - median;
+		err[i] = e < 0 ? -e : e;
+		if (i > 0) {
+			double d = (double)((t[i] - t[i - 1]) * scale) -
+				   (double)(off[i] - off[i - 1]);
+			sum += d;
+			sum2 += d * d;
+		}
+	}
+	double mean = n > 1 ? sum / (double)(n - 1) : 0;
+	double sd = n > 1 ? sqrt(sum2 / (double)(n - 1) - mean * mean) : 0;
+	qsort(err, (size_t)n, sizeof *err, cmp_i64);
+	fprintf(stderr,
+		"jitter events=%ld field=%s ioi_sd_us=%.1f err_p99_us=%lld "
+		"err_max_us=%lld\n",
+		n, field, sd, (long long)err[n * 99 / 100],
+		(long long)err[n - 1]);
+	free(err);
+}
+
+static int bench_jitter(long events, long interval_us, long delay_us,
+			const char *log)
+{
+	int64_t *off = malloc((size_t)events * sizeof *off);
+	events = load_onsets(off, events, interval_us, log);
+	if (events < 2) {
+		fprintf(stderr, "jitter need at least 2 onsets\n");
+		return 1;
+	}
+	seen_ms = malloc((size_t)events * sizeof *seen_ms);
+	seen_us = malloc((size_t)events * sizeof *seen_us);
+	max_seen = events;
+
+	start_midi();
+	srand(1);
+	int64_t start = mono_ns() + 10000000;
+	for (long i = 0; i < events; i++) {
+		int64_t t = start + off[i] * 1000;
+		long delay = delay_us > 0 ? rand() % (delay_us + 1) : 0;
+		sleep_until_ns(t + (int64_t)delay * 1000);
+		unsigned char msg[3] = {0x90, (unsigned char)(48 + i % 24), 80};
+		mock_in_send_at(0, msg, 3, t);
+	}
+	for (int i = 0; i < 100 && __atomic_load_n(&n_seen, __ATOMIC_RELAXED) <
+					    events;
+	     i++)
+		sleep_us(10000);
+
+	pthread_mutex_lock(&rd_mu);
+	long n = n_seen;
+	pthread_mutex_unlock(&rd_mu);
+	if (n != events) {
+		fprintf(stderr, "jitter only %ld of %ld note-ons seen\n", n,
+			events);
+		return 1;
+	}
+	report_err("TIME", seen_ms, 1000.0, off, n);
+	report_err("MONO_US", seen_us, 1.0, off, n);
+	return 0;
+}
+
+static unsigned long received_count(const char *name)
+{
+	char key[32];
+	snprintf(key, sizeof key, " %s=", name);
+	const char *p = strstr(received, key);
+	return p ? strtoul(p + strlen(key), NULL, 10) : 0;
+}
+
+/* Send a MIDI FILTER command and wait for its counter line */
+static void query_filter(const char *cmd)
+{
+	pthread_mutex_lock(&rd_mu);
+	long n = n_received;
+	pthread_mutex_unlock(&rd_mu);
+	command(cmd);
+	pthread_mutex_lock(&rd_mu);
+	while (n_received == n)
+		pthread_cond_wait(&rd_cv, &rd_mu);
+	pthread_mutex_unlock(&rd_mu);
+}
+
+static void stream_clock(double seconds, double bpm)
+{
+	int64_t tick = (int64_t)(60e9 / bpm / 24), sense = 300000000;
+	int64_t start = mono_ns(), end = start + (int64_t)(seconds * 1e9);
+	int64_t next_tick = start, next_sense = start;
+	for (long i = 0;;) {
+		int64_t t = next_tick < next_sense ? next_tick : next_sense;
+		if (t >= end)
+			break;
+		sleep_until_ns(t);
+		if (t == next_sense) {
+			unsigned char fe = 0xFE;
+			mock_in_send(0, &fe, 1);
+			next_sense += sense;
+		}
+		if (t == next_tick) {
+			unsigned char f8 = 0xF8;
+			mock_in_send(0, &f8, 1);
+			if (i % 24 == 0 || i % 24 == 12) {
+				unsigned char note[3] = {
+				    i % 24 ? 0x80 : 0x90, 60,
+				    i % 24 ? 0 : 100};
+				mock_in_send(0, note, 3);
+			}
+			i++;
+			next_tick += tick;
+		}
+	}
+}
+
+static void bench_clock_pass(const char *filter, double seconds, double bpm)
+{
+	char cmd[64];
+	snprintf(cmd, sizeof cmd, "MIDI FILTER %s\n", filter);
+	query_filter(cmd);
+	unsigned long w0 = received_count("wakeups");
+	size_t cb0, cb1;
+	mock_cb_times(&cb0);
+
+	stream_clock(seconds, bpm);
+	sleep_us(50000);
+
+	query_filter("MIDI FILTER\n");
+	mock_cb_times(&cb1);
+	fprintf(stderr,
+		"clock filter=%s callbacks_per_s=%.1f wakeups_per_s=%.1f "
+		"notes=%lu clock=%lu sense=%lu\n",
+		filter, (double)(cb1 - cb0) / seconds,
+		(double)(received_count("wakeups") - w0) / seconds,
+		received_count("note"), received_count("clock"),
+		received_count("sense"));
+}
+
+static int bench_clock(double seconds, double bpm)
+{
+	start_midi();
+	bench_clock_pass("NONE", seconds, bpm);
+	bench_clock_pass("CLOCK SENSE", seconds, bpm);
+	return 0;
+}
+
+/* Stand-in for the backend thread of one input port */
+typedef struct {
+	unsigned int port;
+	long events;
+	long interval_us;
+	int64_t start;
+} Feed;
+
+static void *thr_feed(void *arg)
+{
+	const Feed *f = arg;
+	for (long i = 0; i < f->events; i++) {
+		sleep_until_ns(f->start + i * f->interval_us * 1000);
+		unsigned char msg[3] = {0x90, (unsigned char)(48 + i % 24), 80};
+		mock_in_send(f->port, msg, 3);
+	}
+	return NULL;
+}
+
+static void merge_pass(int inputs, long events, long interval_us)
+{
+	pthread_mutex_lock(&rd_mu);
+	n_seen = 0;
+	pthread_mutex_unlock(&rd_mu);
+
+	Feed feed[2];
+	pthread_t th[2];
+	int64_t start = mono_ns() + 10000000;
+	for (int k = 0; k < inputs; k++) {
+		feed[k].port = (unsigned int)k;
+		feed[k].events = events / inputs;
+		feed[k].interval_us = interval_us * inputs;
+		feed[k].start = start + (int64_t)k * interval_us * 1000;
+		pthread_create(&th[k], NULL, thr_feed, &feed[k]);
+	}
+	for (int k = 0; k < inputs; k++)
+		pthread_join(th[k], NULL);
+	for (int i = 0; i < 100 && __atomic_load_n(&n_seen, __ATOMIC_RELAXED) <
+					    events;
+	     i++)
+		sleep_us(10000);
+
+	pthread_mutex_lock(&rd_mu);
+	long n = n_seen, disorder = 0, dev[2] = {0, 0};
+	int64_t *lat = malloc((size_t)(n > 0 ? n : 1) * sizeof *lat);
+	for (long i = 0; i < n; i++) {
+		lat[i] = seen_rx[i] - seen_us[i];
+		if (i > 0 && seen_us[i] < seen_us[i - 1])
+			disorder++;
+		if (seen_dev[i] == 0 || seen_dev[i] == 1)
+			dev[seen_dev[i]]++;
+	}
+	pthread_mutex_unlock(&rd_mu);
+	if (n == 0) {
+		fprintf(stderr, "merge inputs=%d no note-ons seen\n", inputs);
+		free(lat);
+		return;
+	}
+	qsort(lat, (size_t)n, sizeof *lat, cmp_i64);
+	fprintf(stderr,
+		"merge inputs=%d events=%ld lat_p50_us=%lld lat_p99_us=%lld "
+		"lat_max_us=%lld out_of_order=%ld dev0=%ld dev1=%ld\n",
+		inputs, n, (long long)lat[n / 2], (long long)lat[n * 99 / 100],
+		(long long)lat[n - 1], disorder, dev[0], dev[1]);
+	free(lat);
+}
+
+static int bench_merge(long events, long interval_us)
+{
+	seen_ms = malloc((size_t)events * sizeof *seen_ms);
+	seen_us = malloc((size_t)events * sizeof *seen_us);
+	seen_rx = malloc((size_t)events * sizeof *seen_rx);
+	seen_dev = malloc((size_t)events * sizeof *seen_dev);
+	max_seen = events;
+
+	start_midi();
+	merge_pass(1, events, interval_us);
+	command("MIDI IN ADD 1\n");
+	pthread_mutex_lock(&rd_mu);
+	while (n_open < 2)
+		pthread_cond_wait(&rd_cv, &rd_mu);
+	pthread_mutex_unlock(&rd_mu);
+	merge_pass(2, events, interval_us);
+	return 0;
+}
+
+/* Voluntary context switches of midi's main thread so far */
+static long midi_switches(void)
+{
+	char line[128];
+	pthread_mutex_lock(&rd_mu);
+	FILE *f = fopen(midi_task, "r");
+	pthread_mutex_unlock(&rd_mu);
+	long n = -1;
+	while (f && fgets(line, sizeof line, f))
+		if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1)
+			break;
+	if (f)
+		fclose(f);
+	return n;
+}
+
+/* Ms from now until a line starting with prefix arrives, after calling
+   fn(port); -1 on timeout */
+static double time_to_line(const char *prefix, void (*fn)(unsigned int),
+			   unsigned int port)
+{
+	pthread_mutex_lock(&rd_mu);
+	snprintf(want, sizeof want, "%s", prefix);
+	want_ns = 0;
+	pthread_mutex_unlock(&rd_mu);
+	int64_t t0 = mono_ns();
+	fn(port);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 5;
+	pthread_mutex_lock(&rd_mu);
+	while (!want_ns && pthread_cond_timedwait(&rd_cv, &rd_mu, &ts) == 0)
+		;
+	int64_t t = want_ns;
+	want[0] = '\0';
+	pthread_mutex_unlock(&rd_mu);
+	return t ? (double)(t - t0) / 1e6 : -1.0;
+}
+
+static int bench_hotplug(double seconds)
+{
+	start_midi();
+	command("MIDI OUT 1\n");
+	sleep_us(100000);
+
+	long w0 = midi_switches();
+	sleep_us((long)(seconds * 1e6));
+	long w1 = midi_switches();
+
+	double lost = time_to_line("STATUS MIDI input lost", mock_unplug, 0);
+	mock_unplug(1);
+	sleep_us(500000);
+	mock_plug(1);
+	double back = time_to_line("STATUS MIDI input opened", mock_plug, 0);
+	fprintf(stderr,
+		"hotplug idle_wakeups_per_s=%.1f lost_ms=%.1f "
+		"reopened_ms=%.1f\n",
+		(double)(w1 - w0) / seconds, lost, back);
+	return lost < 0 || back < 0;
+}
+
+static void on_out(unsigned int port, const unsigned char *msg, size_t len)
+{
+	(void)port;
+	(void)len;
+	long i = __atomic_load_n(&n_sent, __ATOMIC_RELAXED);
+	if ((msg[0] & 0xF0) == 0x90 && i < max_sent) {
+		sent_ns[i] = mono_ns();
+		__atomic_store_n(&n_sent, i + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void schedule_pass(const char *mode, long events, long interval_us)
+{
+	int64_t *due = malloc((size_t)events * sizeof *due);
+	int64_t start = mono_ns() + 100000000;
+	for (long i = 0; i < events; i++)
+		due[i] = start + (int64_t)i * interval_us * 1000;
+	__atomic_store_n(&n_sent, 0, __ATOMIC_RELEASE);
+
+	char line[128];
+	for (long i = 0; i < events; i++) {
+		if (strcmp(mode, "direct") == 0) {
+			sleep_until_ns(due[i]);
+			snprintf(line, sizeof line,
+				 "MIDI NOTE_ON c' VELOCITY:80\n");
+		} else {
+			snprintf(line, sizeof line,
+				 "MIDI SCHEDULE %lld NOTE_ON c' VELOCITY:80\n",
+				 (long long)(due[i] / 1000));
+		}
+		command(line);
+	}
+	sleep_until_ns(due[events - 1] + 200000000);
+
+	long n = __atomic_load_n(&n_sent, __ATOMIC_ACQUIRE);
+	if (n == 0) {
+		fprintf(stderr, "schedule mode=%s nothing sent\n", mode);
+		free(due);
+		return;
+	}
+	for (long i = 0; i < n; i++)
+		due[i] = sent_ns[i] - due[i];
+	qsort(due, (size_t)n, sizeof *due, cmp_i64);
+	fprintf(stderr,
+		"schedule mode=%s events=%ld late_p50_us=%.1f "
+		"late_p99_us=%.1f late_max_us=%.1f\n",
+		mode, n, due[n / 2] / 1e3, due[n * 99 / 100] / 1e3,
+		due[n - 1] / 1e3);
+	free(due);
+}
+
+static int bench_schedule(long events, long interval_us)
+{
+	sent_ns = malloc((size_t)events * sizeof *sent_ns);
+	max_sent = events;
+	mock_set_out_hook(on_out);
+	start_midi();
+	command("MIDI OUT 1\n");
+	schedule_pass("direct", events, interval_us);
+	schedule_pass("schedule", events, interval_us);
+	return 0;
+}
+
+/* Play notes are c,, (24); anything else was forwarded */
+static void on_out_rate(unsigned int port, const unsigned char *msg,
+			size_t len)
+{
+	(void)port;
+	int64_t t = mono_ns();
+	if (!out_first_ns)
+		out_first_ns = t;
+	out_last_ns = t;
+	out_bytes += (long)len;
+	if ((msg[0] & 0xF0) != 0x90)
+		return;
+	if (msg[1] != 24 && n_fwd < max_fwd)
+		fwd_ns[n_fwd++] = t;
+	else if (msg[1] == 24 && cmd_ns && n_cmd < max_cmd)
+		cmd_ns[n_cmd++] = t;
+}
+
+static void output_pass(int rate, long notes, long forwards)
+{
+	char line[64];
+	snprintf(line, sizeof line, "MIDI RATE %d\n", rate);
+	command(line);
+	sleep_us(100000);
+
+	/* The hook runs on midi's output thread only */
+	out_bytes = 0;
+	out_first_ns = out_last_ns = 0;
+	n_fwd = 0;
+	for (long i = 0; i < notes; i++)
+		command("MIDI NOTE_ON c,, VELOCITY:80\n");
+	sleep_us(10000);
+
+	int64_t *inj = malloc((size_t)forwards * sizeof *inj);
+	unsigned char msg[3] = {0x90, 60, 100};
+	for (long i = 0; i < forwards; i++) {
+		inj[i] = mono_ns();
+		mock_in_send(0, msg, 3);
+		sleep_us(2000);
+	}
+	sleep_us(500000 + notes * 3 * 1000000L / OUT_RATE);
+
+	long n = n_fwd;
+	for (long i = 0; i < n; i++)
+		inj[i] = fwd_ns[i] - inj[i];
+	qsort(inj, (size_t)n, sizeof *inj, cmp_i64);
+	double span = (double)(out_last_ns - out_first_ns) / 1e9;
+	fprintf(stderr,
+		"output rate=%d bytes=%ld bytes_per_s=%.0f fwd=%ld "
+		"fwd_p50_us=%.1f fwd_max_us=%.1f\n",
+		rate, out_bytes, span > 0 ? (double)out_bytes / span : 0.0, n,
+		n ? inj[n / 2] / 1e3 : 0.0, n ? inj[n - 1] / 1e3 : 0.0);
+	free(inj);
+}
+
+static int bench_output(long notes, long forwards)
+{
+	fwd_ns = malloc((size_t)forwards * sizeof *fwd_ns);
+	max_fwd = forwards;
+	mock_set_out_hook(on_out_rate);
+	start_midi();
+	command("MIDI OUT 1\nMIDI FORWARD ON\n");
+	output_pass(OUT_RATE, notes, forwards);
+	output_pass(0, notes, forwards);
+	return 0;
+}
+
+/* Report one path of the latency benchmark on stderr and as a member
+   of the "paths" object in f; lat is in ns and gets sorted */
+static void json_path(FILE *f, const char *name, int64_t *lat, long n,
+		      int last)
+{
+	qsort(lat, (size_t)n, sizeof *lat, cmp_i64);
+	double p50 = n ? lat[n / 2] / 1e3 : 0.0;
+	double p99 = n ? lat[n * 99 / 100] / 1e3 : 0.0;
+	double max = n ? lat[n - 1] / 1e3 : 0.0;
+	fprintf(stderr, "latency path=%s n=%ld p50_us=%.1f p99_us=%.1f "
+			"max_us=%.1f\n",
+		name, n, p50, p99, max);
+
+	fprintf(f,
+		"    \"%s\": {\"n\": %ld, \"p50_us\": %.1f, "
+		"\"p99_us\": %.1f, \"max_us\": %.1f,\n"
+		"      \"hist_us\": [",
+		name, n, p50, p99, max);
+	const char *sep = "";
+	long i = 0;
+	for (int64_t le = 1; i < n; le *= 2) {
+		long c = 0;
+		while (i < n && lat[i] <= le * 1000) {
+			c++;
+			i++;
+		}
+		if (c) {
+			fprintf(f, "%s[%lld, %ld]", sep, (long long)le, c);
+			sep = ", ";
+		}
+	}
+	fprintf(f, "]}%s\n", last ? "" : ",");
+}
+
+/* Send burst b of the latency benchmark at start + b * gap_us, and its
+   releases half a gap later; t gets the send time of each note-on */
+static void latency_burst(int64_t start, long b, long burst_len,
+			  long gap_us, const char *on, const char *off,
+			  int64_t *t)
+{
+	int64_t due = start + (int64_t)b * gap_us * 1000;
+	sleep_until_ns(due);
+	if (on) {
+		int64_t now = mono_ns();
+		command(on);
+		for (long k = 0; k < burst_len; k++)
+			t[k] = now;
+	} else {
+		for (long k = 0; k < burst_len; k++) {
+			unsigned char note = (unsigned char)(60 + k % 12);
+			unsigned char msg[3] = {0x90, note, 100};
+			t[k] = mono_ns();
+			mock_in_send(0, msg, 3);
+		}
+	}
+	sleep_until_ns(due + (int64_t)gap_us * 500);
+	if (off) {
+		command(off);
+	} else {
+		for (long k = 0; k < burst_len; k++) {
+			unsigned char note = (unsigned char)(60 + k % 12);
+			unsigned char msg[3] = {0x80, note, 0};
+			mock_in_send(0, msg, 3);
+		}
+	}
+}
+
+static int bench_latency(long bursts, long burst_len, long gap_us,
+			 const char *path)
+{
+	/* Open before start_midi() moves to a temporary directory and
+	   takes over stdout */
+	FILE *f = path ? fopen(path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+	if (!f) {
+		perror(path ? path : "stdout");
+		return 1;
+	}
+	long events = bursts * burst_len;
+	seen_ms = malloc((size_t)events * sizeof *seen_ms);
+	seen_us = malloc((size_t)events * sizeof *seen_us);
+	seen_rx = malloc((size_t)events * sizeof *seen_rx);
+	max_seen = events;
+	fwd_ns = malloc((size_t)events * sizeof *fwd_ns);
+	max_fwd = events;
+	cmd_ns = malloc((size_t)events * sizeof *cmd_ns);
+	max_cmd = events;
+	int64_t *sent = malloc((size_t)events * sizeof *sent);
+	int64_t *lat = malloc((size_t)events * sizeof *lat);
+
+	mock_set_out_hook(on_out_rate);
+	start_midi();
+	command("MIDI OUT 1\nMIDI FORWARD ON\n");
+	sleep_us(100000);
+
+	int64_t start = mono_ns() + 10000000;
+	for (long b = 0; b < bursts; b++)
+		latency_burst(start, b, burst_len, gap_us, NULL, NULL,
+			      sent + b * burst_len);
+	sleep_us(500000);
+
+	char *on = malloc((size_t)burst_len * 32 + 1);
+	char *off = malloc((size_t)burst_len * 32 + 1);
+	on[0] = off[0] = '\0';
+	for (long k = 0; k < burst_len; k++) {
+		strcat(on, "MIDI NOTE_ON c,, VELOCITY:80\n");
+		strcat(off, "MIDI NOTE_OFF c,,\n");
+	}
+	int64_t *cmd_sent = malloc((size_t)events * sizeof *cmd_sent);
+	start = mono_ns() + 10000000;
+	for (long b = 0; b < bursts; b++)
+		latency_burst(start, b, burst_len, gap_us, on, off,
+			      cmd_sent + b * burst_len);
+	sleep_us(500000);
+
+	fprintf(f,
+		"{\"bursts\": %ld, \"burst_len\": %ld, \"gap_us\": %ld,\n"
+		"  \"paths\": {\n",
+		bursts, burst_len, gap_us);
+
+	pthread_mutex_lock(&rd_mu);
+	long n = n_seen;
+	for (long i = 0; i < n; i++)
+		lat[i] = seen_rx[i] * 1000 - sent[i];
+	pthread_mutex_unlock(&rd_mu);
+	json_path(f, "callback_to_stdout", lat, n, 0);
+
+	n = __atomic_load_n(&n_fwd, __ATOMIC_ACQUIRE);
+	for (long i = 0; i < n; i++)
+		lat[i] = fwd_ns[i] - sent[i];
+	json_path(f, "forward", lat, n, 0);
+
+	n = __atomic_load_n(&n_cmd, __ATOMIC_ACQUIRE);
+	for (long i = 0; i < n; i++)
+		lat[i] = cmd_ns[i] - cmd_sent[i];
+	json_path(f, "command", lat, n, 1);
+
+	fprintf(f, "  }}\n");
+	fclose(f);
+	return n_seen < events || n_fwd < events || n_cmd < events;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "wcet") == 0) {
+		long events = argc > 2 ? atol(argv[2]) : 20000;
+		long interval_us = argc > 3 ? atol(argv[3]) : 100;
+		consumer_us = argc > 4 ? atol(argv[4]) : 0;
+		exit(bench_wcet(events, interval_us));
+	}
+	if (argc >= 2 && strcmp(argv[1], "jitter") == 0) {
+		long events = argc > 2 ? atol(argv[2]) : 2000;
+		long interval_us = argc > 3 ? atol(argv[3]) : 5000;
+		long delay_us = argc > 4 ? atol(argv[4]) : 2000;
+		exit(bench_jitter(events, interval_us, delay_us,
+				  argc > 5 ? argv[5] : NULL));
+	}
+	if (argc >= 2 && strcmp(argv[1], "clock") == 0)
+		exit(bench_clock(argc > 2 ? atof(argv[2]) : 5.0,
+				 argc > 3 ? atof(argv[3]) : 120.0));
+	if (argc >= 2 && strcmp(argv[1], "merge") == 0)
+		exit(bench_merge(argc > 2 ? atol(argv[2]) : 4000,
+				 argc > 3 ? atol(argv[3]) : 500));
+	if (argc >= 2 && strcmp(argv[1], "hotplug") == 0)
+		exit(bench_hotplug(argc > 2 ? atof(argv[2]) : 2.0));
+	if (argc >= 2 && strcmp(argv[1], "schedule") == 0)
+		exit(bench_schedule(argc > 2 ? atol(argv[2]) : 500,
+				    argc > 3 ? atol(argv[3]) : 10000));
+	if (argc >= 2 && strcmp(argv[1], "output") == 0)
+		exit(bench_output(argc > 2 ? atol(argv[2]) : 250,
+				  argc > 3 ? atol(argv[3]) : 50));
+	if (argc >= 2 && strcmp(argv[1], "latency") == 0)
+		exit(bench_latency(argc > 2 ? atol(argv[2]) : 200,
+				   argc > 3 ? atol(argv[3]) : 8,
+				   argc > 4 ? atol(argv[4]) : 20000,
+				   argc > 5 ? argv[5] : NULL));
+	fprintf(stderr,
+		"Usage: %s wcet [<events> [<interval_us> [<consumer_us>]]]\n"
+		"       %s jitter [<events> [<interval_us> [<delay_us> "
+		"[<log>]]]]\n"
+		"       %s clock [<seconds> [<bpm>]]\n"
+		"       %s merge [<events> [<interval_us>]]\n"
+		"       %s hotplug [<seconds>]\n"
+		"       %s schedule [<events> [<interval_us>]]\n"
+		"       %s output [<notes> [<forwards>]]\n"
+		"       %s latency [<bursts> [<burst_len> [<gap_us> "
+		"[<json>]]]]\n",
+		argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+		argv[0]);
+	return 1;
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+// rtmidi_c.h --- in-process mock of the RtMidi C API for benchmarks
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     Drop-in replacement for <rtmidi/rtmidi_c.h> covering the subset of
+ *     the API used by src/midi.c. Compile with -Ibench/mock and link
+ *     bench/mock/rtmidi_mock.c instead of -lrtmidi.
+ *
+ *     The mock exposes MOCK_PORTS ports, named "Mock Port <n>", that
+ *     exist for both input and output. Nothing is delivered on its own:
+ *     the benchmark injects messages with mock_in_send(), which runs the
+ *     callbacks of every input open on that port in the calling thread,
+ *     exactly as RtMidi's backend thread would, with the same delta time
+ *     stamps and ignore_types() filtering. mock_in_send_at() lets the
+ *     driver time stamp differ from the delivery time. Messages sent to an output
+ *     port are passed to the hook set with mock_set_out_hook().
+ *
+ *     Each callback invocation is timed; mock_cb_times() returns the
+ *     durations recorded so far.
+ *
+ *     mock_unplug() and mock_plug() remove a port from the enumeration
+ *     and bring it back, renumbering the remaining ports as a backend
+ *     would; ports open on an unplugged port stop receiving. Each change
+ *     writes a kernel-style uevent (SUBSYSTEM=sound) to the pipe
+ *     returned by mock_hotplug_fd(), which stands in for the uevent
+ *     netlink socket.
+ */
+
+#ifndef RTMIDI_C_H
+#define RTMIDI_C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct RtMidiWrapper {
+	void *ptr;
+	void *data;
+	bool ok;
+	const char *msg;
+};
+
+typedef struct RtMidiWrapper *RtMidiPtr;
+typedef struct RtMidiWrapper *RtMidiInPtr;
+typedef struct RtMidiWrapper *RtMidiOutPtr;
+
+typedef void (*RtMidiCCallback)(double timeStamp, const unsigned char *message,
+				size_t messageSize, void *userData);
+
+RtMidiInPtr rtmidi_in_create_default(void);
+RtMidiOutPtr rtmidi_out_create_default(void);
+void rtmidi_in_free(RtMidiInPtr device);
+void rtmidi_out_free(RtMidiOutPtr device);
+unsigned int rtmidi_get_port_count(RtMidiPtr device);
+int rtmidi_get_port_name(RtMidiPtr device, unsigned int portNumber,
+			 char *bufOut, int *bufLen);
+void rtmidi_open_port(RtMidiPtr device, unsigned int portNumber,
+		      const char *portName);
+void rtmidi_close_port(RtMidiPtr device);
+void rtmidi_in_set_callback(RtMidiInPtr device, RtMidiCCallback callback,
+			    void *userData);
+void rtmidi_in_cancel_callback(RtMidiInPtr device);
+void rtmidi_in_ignore_types(RtMidiInPtr device, bool midiSysex, bool midiTime,
+			    bool midiSense);
+int rtmidi_out_send_message(RtMidiOutPtr device, const unsigned char *message,
+			    int length);
+
+/* ------------------------------------------------------------------ */
+/* Mock control                                                        */
+/* ------------------------------------------------------------------ */
+
+#define MOCK_PORTS 4
+
+/* Deliver msg to every input open on port; returns number of callbacks */
+int mock_in_send(unsigned int port, const unsigned char *msg, size_t len);
+
+/* Same, but the driver time stamp (CLOCK_MONOTONIC ns) is t_ns instead
+ * of the delivery time, as when the backend thread runs late */
+int mock_in_send_at(unsigned int port, const unsigned char *msg, size_t len,
+		    int64_t t_ns);
+
+/* Called for every rtmidi_out_send_message() on an open output */
+typedef void (*MockOutHook)(unsigned int port, const unsigned char *msg,
+			    size_t len);
+void mock_set_out_hook(MockOutHook hook);
+
+/* Callback durations in ns, in call order; *n receives the count */
+const int64_t *mock_cb_times(size_t *n);
+void mock_cb_reset(void);
+
+/* Remove port from / return it to the enumeration (by its number in
+ * "Mock Port <n>", not its current index) and emit a uevent */
+void mock_unplug(unsigned int port);
+void mock_plug(unsigned int port);
+
+/* Read end of the uevent pipe, non-blocking; created on first call */
+int mock_hotplug_fd(void);
+
+#endif /* RTMIDI_C_H */
@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: MIT
+// rtmidi_mock.c --- in-process mock of the RtMidi C API for benchmarks
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     Implementation of bench/mock/rtmidi/rtmidi_c.h. See there for the
+ *     behaviour; this file only adds the bookkeeping.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rtmidi/rtmidi_c.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_OPEN 16
+#define MAX_CB_TIMES (1 << 20)
+#define ALL_PORTS ((1U << MOCK_PORTS) - 1)
+
+typedef struct {
+	int is_in;
+	int port; /* -1 = closed */
+	RtMidiCCallback cb;
+	void *ud;
+	int ignore_sysex, ignore_time, ignore_sense;
+	int64_t last_ns; /* previous delivery, 0 = none */
+} MockDev;
+
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static MockDev *open_devs[MAX_OPEN];
+static MockOutHook out_hook;
+static int64_t cb_times[MAX_CB_TIMES];
+static size_t n_cb_times;
+static unsigned int present = ALL_PORTS; /* bit per plugged-in port */
+static int hp_pipe[2] = {-1, -1};
+
+static int64_t mono_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static RtMidiPtr create(int is_in)
+{
+	RtMidiPtr w = calloc(1, sizeof *w);
+	MockDev *d = calloc(1, sizeof *d);
+	d->is_in = is_in;
+	d->port = -1;
+	d->ignore_sysex = d->ignore_time = d->ignore_sense = 1;
+	w->ptr = d;
+	w->ok = true;
+	w->msg = "";
+	return w;
+}
+
+RtMidiInPtr rtmidi_in_create_default(void)
+{
+	return create(1);
+}
+
+RtMidiOutPtr rtmidi_out_create_default(void)
+{
+	return create(0);
+}
+
+static void dev_free(RtMidiPtr w)
+{
+	if (!w)
+		return;
+	rtmidi_close_port(w);
+	free(w->ptr);
+	free(w);
+}
+
+void rtmidi_in_free(RtMidiInPtr device)
+{
+	dev_free(device);
+}
+
+void rtmidi_out_free(RtMidiOutPtr device)
+{
+	dev_free(device);
+}
+
+unsigned int rtmidi_get_port_count(RtMidiPtr device)
+{
+	(void)device;
+	return (unsigned int)__builtin_popcount(
+	    __atomic_load_n(&present, __ATOMIC_ACQUIRE));
+}
+
+/* Port behind enumeration index idx, or -1 */
+static int port_at(unsigned int idx)
+{
+	unsigned int mask = __atomic_load_n(&present, __ATOMIC_ACQUIRE);
+	for (int p = 0; p < MOCK_PORTS; p++)
+		if ((mask >> p & 1) && idx-- == 0)
+			return p;
+	return -1;
+}
+
+int rtmidi_get_port_name(RtMidiPtr device, unsigned int portNumber,
+			 char *bufOut, int *bufLen)
+{
+	(void)device;
+	int port = port_at(portNumber);
+	if (port < 0)
+		return -1;
+	int n = snprintf(bufOut, bufOut ? (size_t)*bufLen : 0, "Mock Port %d",
+			 port);
+	*bufLen = n + 1;
+	return n + 1;
+}
+
+void rtmidi_open_port(RtMidiPtr device, unsigned int portNumber,
+		      const char *portName)
+{
+	(void)portName;
+	MockDev *d = device->ptr;
+	int port = port_at(portNumber);
+	if (port < 0) {
+		device->ok = false;
+		device->msg = "invalid port";
+		return;
+	}
+	pthread_mutex_lock(&mu);
+	for (int i = 0; i < MAX_OPEN; i++)
+		if (!open_devs[i]) {
+			open_devs[i] = d;
+			d->port = port;
+			d->last_ns = 0;
+			break;
+		}
+	pthread_mutex_unlock(&mu);
+	if (d->port < 0) {
+		device->ok = false;
+		device->msg = "too many open ports";
+	}
+}
+
+void rtmidi_close_port(RtMidiPtr device)
+{
+	MockDev *d = device->ptr;
+	pthread_mutex_lock(&mu);
+	for (int i = 0; i < MAX_OPEN; i++)
+		if (open_devs[i] == d)
+			open_devs[i] = NULL;
+	d->port = -1;
+	pthread_mutex_unlock(&mu);
+}
+
+void rtmidi_in_set_callback(RtMidiInPtr device, RtMidiCCallback callback,
+			    void *userData)
+{
+	MockDev *d = device->ptr;
+	pthread_mutex_lock(&mu);
+	d->cb = callback;
+	d->ud = userData;
+	pthread_mutex_unlock(&mu);
+}
+
+void rtmidi_in_cancel_callback(RtMidiInPtr device)
+{
+	rtmidi_in_set_callback(device, NULL, NULL);
+}
+
+void rtmidi_in_ignore_types(RtMidiInPtr device, bool midiSysex, bool midiTime,
+			    bool midiSense)
+{
+	MockDev *d = device->ptr;
+	pthread_mutex_lock(&mu);
+	d->ignore_sysex = midiSysex;
+	d->ignore_time = midiTime;
+	d->ignore_sense = midiSense;
+	pthread_mutex_unlock(&mu);
+}
+
+int rtmidi_out_send_message(RtMidiOutPtr device, const unsigned char *message,
+			    int length)
+{
+	MockDev *d = device->ptr;
+	if (d->port < 0 || length <= 0)
+		return -1;
+	MockOutHook hook = __atomic_load_n(&out_hook, __ATOMIC_ACQUIRE);
+	if (hook)
+		hook((unsigned int)d->port, message, (size_t)length);
+	return 0;
+}
+
+/* Same rules as RtMidi's MidiInApi filtering */
+static int ignored(const MockDev *d, const unsigned char *msg)
+{
+	return (d->ignore_sysex && msg[0] == 0xF0) ||
+	       (d->ignore_time && (msg[0] == 0xF1 || msg[0] == 0xF8)) ||
+	       (d->ignore_sense && msg[0] == 0xFE);
+}
+
+/* The lock is held across the callback, so rtmidi_close_port() waits
+ * for a running callback to return, as with the real backends. */
+int mock_in_send_at(unsigned int port, const unsigned char *msg, size_t len,
+		    int64_t t_ns)
+{
+	int n = 0;
+	pthread_mutex_lock(&mu);
+	for (int i = 0; i < MAX_OPEN; i++) {
+		MockDev *d = open_devs[i];
+		if (!d || !d->is_in || d->port != (int)port || !d->cb ||
+		    !(present >> port & 1) || ignored(d, msg))
+			continue;
+		double stamp = d->last_ns ? (t_ns - d->last_ns) / 1e9 : 0.0;
+		d->last_ns = t_ns;
+		int64_t t0 = mono_ns();
+		d->cb(stamp, msg, len, d->ud);
+		if (n_cb_times < MAX_CB_TIMES)
+			cb_times[n_cb_times++] = mono_ns() - t0;
+		n++;
+	}
+	pthread_mutex_unlock(&mu);
+	return n;
+}
+
+int mock_in_send(unsigned int port, const unsigned char *msg, size_t len)
+{
+	return mock_in_send_at(port, msg, len, mono_ns());
+}
+
+void mock_set_out_hook(MockOutHook hook)
+{
+	__atomic_store_n(&out_hook, hook, __ATOMIC_RELEASE);
+}
+
+const int64_t *mock_cb_times(size_t *n)
+{
+	pthread_mutex_lock(&mu);
+	*n = n_cb_times;
+	pthread_mutex_unlock(&mu);
+	return cb_times;
+}
+
+void mock_cb_reset(void)
+{
+	pthread_mutex_lock(&mu);
+	n_cb_times = 0;
+	pthread_mutex_unlock(&mu);
+}
+
+int mock_hotplug_fd(void)
+{
+	pthread_mutex_lock(&mu);
+	if (hp_pipe[0] < 0 && pipe(hp_pipe) == 0)
+		for (int i = 0; i < 2; i++)
+			fcntl(hp_pipe[i], F_SETFL,
+			      fcntl(hp_pipe[i], F_GETFL) | O_NONBLOCK);
+	pthread_mutex_unlock(&mu);
+	return hp_pipe[0];
+}
+
+/* One uevent per write, like one datagram from the netlink socket */
+static void uevent(const char *action, unsigned int port)
+{
+	char ev[128];
+	int n = snprintf(ev, sizeof ev, "%s@/devices/mock/sound/card%u", action,
+			 port);
+	n += 1 + snprintf(ev + n + 1, sizeof ev - (size_t)n - 1,
+			  "ACTION=%s", action);
+	n += 1 + snprintf(ev + n + 1, sizeof ev - (size_t)n - 1,
+			  "SUBSYSTEM=sound");
+	if (mock_hotplug_fd() >= 0)
+		(void)write(hp_pipe[1], ev, (size_t)n + 1);
+}
+
+void mock_unplug(unsigned int port)
+{
+	__atomic_fetch_and(&present, ~(1U << port), __ATOMIC_RELEASE);
+	uevent("remove", port);
+}
+
+void mock_plug(unsigned int port)
+{
+	__atomic_fetch_or(&present, 1U << port, __ATOMIC_RELEASE);
+	uevent("add", port);
+}
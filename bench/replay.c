@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: MIT
+// replay.c --- re-emit recorded session logs at their original times
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     replay merges one or more recorded logs (e.g. log/all.log and
+ *     log/midi_notes.log) and writes their lines to stdout at the wall
+ *     clock time given by each line's TIME:<ms> field. Lines without a
+ *     TIME field inherit the time of the previous line of the same file,
+ *     so a lesson header is emitted just before the notes that follow it.
+ *
+ *     Waiting is done with clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME),
+ *     which warp.so maps onto its virtual clock. Under "run -w" with the
+ *     epoch set to the start of the recording, the session is therefore
+ *     replayed at the same virtual times it was played, only faster.
+ *     Lines whose time has already passed are written immediately.
+ *
+ *     After the last line, replay waits <linger_ms> of real time (poll()
+ *     is not warped) so downstream nodes can drain, then exits 0, which
+ *     ends the graph.
+ *
+ * USAGE
+ *     replay [-l <linger_ms>] <log>...
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_MAX_LEN 4096
+
+typedef struct {
+	FILE *f;
+	char line[LINE_MAX_LEN];
+	int64_t t_ms; /* time of buffered line; INT64_MIN before any TIME */
+	int have;
+} Source;
+
+static int64_t line_time(const char *line, int64_t prev)
+{
+	const char *p = strstr(line, "TIME:");
+	return p ? strtoll(p + 5, NULL, 10) : prev;
+}
+
+static void advance(Source *s)
+{
+	s->have = fgets(s->line, sizeof s->line, s->f) != NULL;
+	if (s->have)
+		s->t_ms = line_time(s->line, s->t_ms);
+}
+
+static void wait_until(int64_t t_ms)
+{
+	struct timespec ts = {(time_t)(t_ms / 1000),
+			      (long)(t_ms % 1000) * 1000000L};
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+int main(int argc, char *argv[])
+{
+	int linger_ms = 2000;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		if (opt != 'l') {
+			fprintf(stderr, "Usage: %s [-l <linger_ms>] <log>...\n",
+				argv[0]);
+			return 1;
+		}
+		linger_ms = atoi(optarg);
+	}
+	int n = argc - optind;
+	if (n < 1) {
+		fprintf(stderr, "Usage: %s [-l <linger_ms>] <log>...\n",
+			argv[0]);
+		return 1;
+	}
+
+	Source *src = calloc((size_t)n, sizeof *src);
+	for (int i = 0; i < n; i++) {
+		src[i].f = fopen(argv[optind + i], "r");
+		if (!src[i].f) {
+			perror(argv[optind + i]);
+			return 1;
+		}
+		src[i].t_ms = INT64_MIN;
+		advance(&src[i]);
+	}
+
+	for (;;) {
+		int best = -1;
+		for (int i = 0; i < n; i++)
+			if (src[i].have &&
+			    (best < 0 || src[i].t_ms < src[best].t_ms))
+				best = i;
+		if (best < 0)
+			break;
+		if (src[best].t_ms != INT64_MIN)
+			wait_until(src[best].t_ms);
+		fputs(src[best].line, stdout);
+		fflush(stdout);
+		advance(&src[best]);
+	}
+
+	poll(NULL, 0, linger_ms);
+	for (int i = 0; i < n; i++)
+		fclose(src[i].f);
+	free(src);
+	return 0;
+}
@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: MIT
+// synth.c --- measure the cost of src/synth.c's audio callback
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     Builds src/synth.c into this program (its main() renamed
+ *     synth_main, MAX_POLYPHONY set to BENCH_POLYPHONY) and calls its
+ *     data_callback directly, as miniaudio's device thread would, without
+ *     opening an audio device.
+ *
+ *     BENCH_POLYPHONY is 256 unless set with -D.  Code whose cost grows
+ *     with the number of voice slots should also be timed with
+ *     -DBENCH_POLYPHONY=16, as shipped.
+ *
+ * USAGE
+ *     bench_synth callback [<callbacks> [<voices>...]]
+ *         For each <voices> (default 16 64 256, up to BENCH_POLYPHONY),
+ *         start that many notes spread over five octaves, let them reach
+ *         sustain, then time <callbacks> calls of BUFFER_SIZE frames each
+ *         (default 20000) with CLOCK_MONOTONIC. The load is the mean call
+ *         time as a share of the BUFFER_SIZE / SAMPLE_RATE period.
+ *
+ *     bench_synth alias [<midi_note>...]
+ *         For each note (default 60 84 96 108), render ALIAS_N samples of
+ *         oscillator 1 alone, unfiltered, in sustain, and take the
+ *         spectrum with a Hann window. Energy within ALIAS_GUARD bins of
+ *         a harmonic of the note counts as signal, everything else above
+ *         DC as aliasing. The note is rounded to a frequency that puts
+ *         its harmonics on exact bins.
+ *
+ *     bench_synth stress [<seconds> [<stall_ms>]]
+ *         Run a device thread that calls data_callback every BUFFER_SIZE
+ *         frames of real time while the main thread, as synth_main would,
+ *         queues random NOTE_ON, NOTE_OFF and SET commands as fast as
+ *         every STRESS_GAP_US, for <seconds> (default 5). Built with
+ *         -fsanitize=thread (make bin/bench_synth_tsan), this checks the
+ *         command ring for data races. Latency is from queueing a command
+ *         to the start of the block that applies it. Once a second, the
+ *         device thread oversleeps by <stall_ms> (default 0), then
+ *         catches up; with a device buffer of STRESS_PERIODS periods,
+ *         a stall longer than that is an xrun. At the end, the STATUS
+ *         line of the whole run is printed as synth_main would.
+ *
+ *     bench_synth render [<seconds>]
+ *         Render a score of <seconds> (default 60) with render(), as
+ *         synth --render does, to /dev/null: a chord of RENDER_CHORD
+ *         random notes every quarter second, each held for a second, so
+ *         up to 4 * RENDER_CHORD voices sound at once.
+ *
+ * OUTPUT (stderr)
+ *     callback voices=<n> frames=<n> mean_us=<x> p99_us=<x> max_us=<x>
+ *         load_pct=<x> ns_per_voice_sample=<x>
+ *     alias note=<n> freq_hz=<x> alias_db=<x>
+ *         (alias_db: aliasing energy relative to the signal energy)
+ *     stress cmds=<n> applied=<n> dropped=<n> lat_mean_frames=<x>
+ *         lat_max_frames=<x> voices=<n>
+ *     synth: rendered <s> s in <s> s, realtime factor <x>
+ *
+ * OUTPUT (stdout)
+ *     STATUS SYNTH load=<pct> p99=<us> xruns=<n>     (stress only)
+ */
+
+#ifndef BENCH_POLYPHONY
+#define BENCH_POLYPHONY 256
+#endif
+#define MAX_POLYPHONY BENCH_POLYPHONY
+#define main synth_main
+#include "../src/synth.c"
+#undef main
+
+#include <pthread.h>
+#include <time.h>
+
+#define ALIAS_N 65536 /* FFT size, a power of two */
+#define ALIAS_GUARD 2
+#define STRESS_GAP_US 200 /* longest pause between stress commands */
+#define STRESS_PERIODS 3  /* device buffer assumed for the xrun check */
+#define RENDER_CHORD 8
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static ma_device dev;
+static Synth synth;
+static float out[BUFFER_SIZE * 2];
+static int stop;
+static int64_t stall_ns;
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void init_synth(void)
+{
+	memset(&synth, 0, sizeof synth);
+	synth.p = (Params){.osc1_gain = 0.8f,
+			   .osc2_gain = 0.5f,
+			   .osc1_cutoff = 0.15f,
+			   .osc2_cutoff = 0.08f,
+			   .osc1_detune = 1.0f,
+			   .osc2_detune = 1.004f,
+			   .osc1_oct = 0,
+			   .osc2_oct = -1,
+			   .attack = 0.01f,
+			   .decay = 0.1f,
+			   .sustain = 0.7f,
+			   .release = 0.05f,
+			   .master_gain = 0.3f};
+	set_env_rates(&synth);
+	dev.pUserData = &synth;
+}
+
+/* Start n voices from C2 upwards, wrapping after five octaves; past
+   that, a note sounds on several voices, which note_on() would refuse */
+static void start_notes(int n)
+{
+	for (int i = 0; i < n; i++)
+		start_voice(&synth, synth.v.n++, 36 + i % 60);
+}
+
+static void run(ma_uint32 frames, long calls)
+{
+	for (long i = 0; i < calls; i++)
+		data_callback(&dev, out, NULL, frames);
+}
+
+static void bench_callback(long calls, int voices)
+{
+	init_synth();
+	start_notes(voices);
+	run(BUFFER_SIZE, SAMPLE_RATE / 2 / BUFFER_SIZE); /* into sustain */
+
+	int64_t *t = malloc((size_t)calls * sizeof *t);
+	for (long i = 0; i < calls; i++) {
+		int64_t t0 = now_ns();
+		data_callback(&dev, out, NULL, BUFFER_SIZE);
+		t[i] = now_ns() - t0;
+	}
+	double sum = 0.0;
+	for (long i = 0; i < calls; i++)
+		sum += (double)t[i];
+	qsort(t, (size_t)calls, sizeof *t, cmp_i64);
+	double mean = sum / (double)calls;
+	double period_ns = 1e9 * BUFFER_SIZE / SAMPLE_RATE;
+	fprintf(stderr,
+		"callback voices=%d frames=%d mean_us=%.2f p99_us=%.2f "
+		"max_us=%.2f load_pct=%.1f ns_per_voice_sample=%.2f\n",
+		voices, BUFFER_SIZE, mean / 1e3, t[calls * 99 / 100] / 1e3,
+		t[calls - 1] / 1e3, 100.0 * mean / period_ns,
+		mean / ((double)voices * BUFFER_SIZE));
+	free(t);
+}
+
+/* In-place radix-2 FFT of n points */
+static void fft(double *re, double *im, long n)
+{
+	for (long i = 1, j = 0; i < n; i++) {
+		long bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+	for (long len = 2; len <= n; len <<= 1) {
+		double a = -2.0 * M_PI / (double)len;
+		for (long i = 0; i < n; i += len) {
+			for (long k = 0; k < len / 2; k++) {
+				double wr = cos(a * (double)k);
+				double wi = sin(a * (double)k);
+				long u = i + k, v = i + k + len / 2;
+				double xr = re[v] * wr - im[v] * wi;
+				double xi = re[v] * wi + im[v] * wr;
+				re[v] = re[u] - xr;
+				im[v] = im[u] - xi;
+				re[u] += xr;
+				im[u] += xi;
+			}
+		}
+	}
+}
+
+static void bench_alias(int note)
+{
+	init_synth();
+	synth.p.osc2_gain = 0.0f;
+	synth.p.osc1_cutoff = 1.0f;
+	synth.p.attack = 0.001f;
+	synth.p.sustain = 1.0f;
+	synth.p.master_gain = 1.0f;
+	set_env_rates(&synth);
+
+	double f = 440.0 * pow(2.0, (note - 69) / 12.0);
+	long k0 = lround(f * ALIAS_N / SAMPLE_RATE);
+	f = (double)k0 * SAMPLE_RATE / ALIAS_N;
+	start_voice(&synth, synth.v.n++, note);
+	synth.v.freq[0] = (float)f;
+	set_voice_freq(&synth, 0);
+	run(BUFFER_SIZE, SAMPLE_RATE / 10 / BUFFER_SIZE);
+
+	double *re = malloc(ALIAS_N * sizeof *re);
+	double *im = calloc(ALIAS_N, sizeof *im);
+	for (long i = 0; i < ALIAS_N; i += BUFFER_SIZE) {
+		data_callback(&dev, out, NULL, BUFFER_SIZE);
+		for (long j = 0; j < BUFFER_SIZE; j++) {
+			double x = (double)(i + j) / ALIAS_N;
+			double w = 0.5 - 0.5 * cos(2.0 * M_PI * x);
+			re[i + j] = out[j * 2] * w;
+		}
+	}
+	fft(re, im, ALIAS_N);
+
+	double sig = 0.0, alias = 0.0;
+	for (long k = 1; k <= ALIAS_N / 2; k++) {
+		double e = re[k] * re[k] + im[k] * im[k];
+		long d = k % k0 < k0 - k % k0 ? k % k0 : k0 - k % k0;
+		if (d <= ALIAS_GUARD && k >= k0 - ALIAS_GUARD)
+			sig += e;
+		else
+			alias += e;
+	}
+	fprintf(stderr, "alias note=%d freq_hz=%.1f alias_db=%.1f\n", note,
+		f, 10.0 * log10(alias / sig));
+	free(re);
+	free(im);
+}
+
+/* Stand-in for miniaudio's device thread */
+static void *device_thread(void *arg)
+{
+	(void)arg;
+	int64_t period = (int64_t)1000000000 * BUFFER_SIZE / SAMPLE_RATE;
+	int64_t t = now_ns();
+	for (long i = 1; !__atomic_load_n(&stop, __ATOMIC_ACQUIRE); i++) {
+		t += period;
+		int64_t wake = t;
+		if (i % (SAMPLE_RATE / BUFFER_SIZE) == 0)
+			wake += stall_ns;
+		struct timespec ts = {(time_t)(wake / 1000000000),
+				      (long)(wake % 1000000000)};
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		data_callback(&dev, out, NULL, BUFFER_SIZE);
+	}
+	return NULL;
+}
+
+static void bench_stress(double seconds, double stall_ms)
+{
+	init_synth();
+	synth.cb_buf_ns =
+	    (int64_t)STRESS_PERIODS * 1000000000 * BUFFER_SIZE / SAMPLE_RATE;
+	stall_ns = (int64_t)(stall_ms * 1e6);
+	unsigned long prev[HIST_N] = {0};
+	uint64_t prev_busy = 0;
+	int64_t prev_t = now_ns();
+	pthread_t thr;
+	pthread_create(&thr, NULL, device_thread, NULL);
+
+	unsigned int seed = 1;
+	long cmds = 0;
+	int64_t end = now_ns() + (int64_t)(seconds * 1e9);
+	while (now_ns() < end) {
+		int note = 36 + rand_r(&seed) % 60;
+		int r = rand_r(&seed) % 8;
+		if (r < 4)
+			push_cmd(&synth, CMD_NOTE_ON, note, 0.0f);
+		else if (r < 7)
+			push_cmd(&synth, CMD_NOTE_OFF, note, 0.0f);
+		else
+			push_cmd(&synth, CMD_SET, PARAM_OSC2_DETUNE,
+				 1.0f + (float)(rand_r(&seed) % 10) * 1e-3f);
+		cmds++;
+		struct timespec gap = {
+		    0, (long)(rand_r(&seed) % (STRESS_GAP_US + 1)) * 1000};
+		nanosleep(&gap, NULL);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thr, NULL);
+	drain_cmds(&synth);
+	fprintf(stderr,
+		"stress cmds=%ld applied=%lu dropped=%lu lat_mean_frames=%.1f "
+		"lat_max_frames=%.1f voices=%d\n",
+		cmds, synth.cmd_applied, synth.cmd_dropped,
+		synth.cmd_applied ? synth.cmd_lat_sum / synth.cmd_applied : 0.0,
+		synth.cmd_lat_max, synth.v.n);
+	report_status(&synth, prev, &prev_busy, &prev_t);
+}
+
+/* LilyPond pitch of a MIDI note, as lily_to_midi() reads it */
+static void midi_to_lily(int note, char *buf)
+{
+	static const char *const name[12] = {"c",	"cis", "d",   "dis",
+					     "e",	"f",   "fis", "g",
+					     "gis", "a",   "ais", "b"};
+	int oct = note / 12 - 4;
+	strcpy(buf, name[note % 12]);
+	for (; oct > 0; oct--)
+		strcat(buf, "'");
+	for (; oct < 0; oct++)
+		strcat(buf, ",");
+}
+
+static void bench_render(double seconds)
+{
+	int held[4][RENDER_CHORD] = {{0}}; /* notes of the last 4 chords */
+	char lily[16];
+
+	init_synth();
+	FILE *score = tmpfile();
+	unsigned int seed = 1;
+	long t = 0;
+	for (; t < (long)(seconds * 1000); t += 250) {
+		int *chord = held[t / 250 % 4];
+		for (int k = 0; t >= 1000 && k < RENDER_CHORD; k++) {
+			midi_to_lily(chord[k], lily);
+			fprintf(score, "AT %ld NOTE_OFF %s\n", t, lily);
+		}
+		for (int k = 0; k < RENDER_CHORD; k++) {
+			chord[k] = 36 + rand_r(&seed) % 60;
+			midi_to_lily(chord[k], lily);
+			fprintf(score, "AT %ld NOTE_ON %s\n", t, lily);
+		}
+	}
+	for (int c = 0; c < 4; c++) {
+		for (int k = 0; k < RENDER_CHORD; k++) {
+			midi_to_lily(held[c][k], lily);
+			fprintf(score, "AT %ld NOTE_OFF %s\n", t, lily);
+		}
+	}
+	rewind(score);
+	render(&synth, score, "/dev/null");
+	fclose(score);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "callback") == 0) {
+		long calls = argc > 2 ? atol(argv[2]) : 20000;
+		for (int v = 16; argc <= 3 && v <= 256; v *= 4)
+			if (v <= BENCH_POLYPHONY)
+				bench_callback(calls, v);
+		for (int i = 3; i < argc; i++) {
+			int voices = atoi(argv[i]);
+			if (voices < 1 || voices > BENCH_POLYPHONY) {
+				fprintf(stderr, "voices must be 1..%d\n",
+					BENCH_POLYPHONY);
+				return 1;
+			}
+			bench_callback(calls, voices);
+		}
+		return 0;
+	}
+	if (argc >= 2 && strcmp(argv[1], "alias") == 0) {
+		if (argc == 2) {
+			bench_alias(60);
+			bench_alias(84);
+			bench_alias(96);
+			bench_alias(108);
+		}
+		for (int i = 2; i < argc; i++)
+			bench_alias(atoi(argv[i]));
+		return 0;
+	}
+	if (argc >= 2 && strcmp(argv[1], "stress") == 0) {
+		bench_stress(argc > 2 ? atof(argv[2]) : 5.0,
+			     argc > 3 ? atof(argv[3]) : 0.0);
+		return 0;
+	}
+	if (argc >= 2 && strcmp(argv[1], "render") == 0) {
+		bench_render(argc > 2 ? atof(argv[2]) : 60.0);
+		return 0;
+	}
+	fprintf(stderr,
+		"Usage: %s callback [<callbacks> [<voices>...]]\n"
+		"       %s alias [<midi_note>...]\n"
+		"       %s stress [<seconds> [<stall_ms>]]\n"
+		"       %s render [<seconds>]\n",
+		argv[0], argv[0], argv[0], argv[0]);
+	return 1;
+}
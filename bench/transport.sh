@@ -0,0 +1,28 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+# transport.sh --- compare run.c stdout transports (pty, pipe, socketpair)
+# Copyright (c) 2026 Jakob Kastelic
+#
+# For each transport, runs a two-node graph (linelat src -> linelat sink)
+# under bin/run and prints the per-line latency and CPU reported by the
+# probes, followed by the CPU time of run.c itself (relay threads plus the
+# reaped sink) as reported by times(1): user and system, in that order.
+#
+# Usage: sh bench/transport.sh [<lines> [<interval_us> [<pad>]]]
+
+LINES=${1:-20000}
+INTERVAL=${2:-50}
+PAD=${3:-64}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for t in pty pipe socketpair; do
+	SRC="bin/bench_linelat src $LINES $INTERVAL $PAD"
+	cat > "$TMP/$t.dot" <<DOT
+"$SRC" [stdout=$t];
+"$SRC" -> bin/bench_linelat sink $LINES;
+DOT
+	echo "== $t"
+	(bin/run "$TMP/$t.dot"; times > "$TMP/times") 2>&1
+	echo "run  $(tail -n 1 "$TMP/times")"
+done
@@ -0,0 +1,82 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+# warp_check.sh --- check that time-warped replay gives the same results
+# Copyright (c) 2026 Jakob Kastelic
+#
+# Replays recorded logs (e.g. one session cut from log/all.log and
+# log/midi_notes.log) through bin/group -> rules.lua -> stats.lua, once in
+# real time and once under "run -w <speed>", both with the virtual clock
+# starting at the first recorded TIME. As in play.dot, stats.lua also
+# reads the replayed lines, which carry the LESSON header. Each run starts
+# from a copy of log/stats.log. The RESULT and STATS lines of both runs
+# must be identical.
+#
+# Each STATS line is also stamped with the clock of the graph when it
+# leaves stats.lua, which under -w is the warped clock. Its lag behind
+# the line's own time= must not be negative, and must agree between the
+# two runs to within SLACK_MS of real time, scaled by <speed>: scheduling
+# jitter is multiplied along with everything else.
+#
+# Usage: sh bench/warp_check.sh <speed> <log>...
+
+[ $# -ge 2 ] || { echo "Usage: $0 <speed> <log>..." >&2; exit 1; }
+SPEED=$1
+shift
+SLACK_MS=500
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+FIRST=$(cat "$@" | sed -n 's/.*TIME:\([0-9]*\).*/\1/p' | sort -n | head -n 1)
+[ -n "$FIRST" ] || { echo "warp_check: no TIME: fields in logs" >&2; exit 1; }
+EPOCH=$((FIRST / 1000 - 1))
+
+cat > "$TMP/stamp.sh" <<'SH'
+while IFS= read -r l; do echo "$(date +%s%3N) $l"; done
+SH
+
+for s in 1 "$SPEED"; do
+	rm -f "$TMP/stats.log"
+	[ -f log/stats.log ] && cp log/stats.log "$TMP/stats.log"
+	STATS="lua src/stats.lua $TMP/stats.log"
+	cat > "$TMP/replay.dot" <<DOT
+bin/bench_replay $* -> bin/group;
+bin/bench_replay $* -> $STATS;
+bin/group -> lua src/rules.lua;
+lua src/rules.lua -> $STATS;
+lua src/rules.lua -> STDOUT;
+$STATS -> sh $TMP/stamp.sh;
+sh $TMP/stamp.sh -> STDOUT;
+DOT
+	START=$(date +%s)
+	bin/run -w "$s@$EPOCH" "$TMP/replay.dot" |
+		grep -a -E '^([0-9]+ )?(RESULT|STATS) ' > "$TMP/raw_$s.txt"
+	sed 's/^[0-9]* //' "$TMP/raw_$s.txt" > "$TMP/out_$s.txt"
+	sed -n 's/^\([0-9]*\) STATS time=\([0-9]*\) .*/\1 \2/p' \
+		"$TMP/raw_$s.txt" |
+		awk '{ printf "%.0f\n", $1 - $2 }' > "$TMP/lag_$s.txt"
+	echo "speed $s: $(wc -l < "$TMP/out_$s.txt") lines in" \
+		"$(($(date +%s) - START)) s, STATS lag ms:" \
+		$(cat "$TMP/lag_$s.txt")
+done
+
+STATUS=0
+if ! diff -u "$TMP/out_1.txt" "$TMP/out_$SPEED.txt"; then
+	echo "FAIL warp x$SPEED differs from real time"
+	STATUS=1
+fi
+if [ ! -s "$TMP/lag_1.txt" ]; then
+	echo "FAIL no STATS lines to check time= against"
+	STATUS=1
+elif ! paste "$TMP/lag_1.txt" "$TMP/lag_$SPEED.txt" |
+	awk -v tol=$((SLACK_MS * SPEED)) '
+	$1 < 0 || $2 < 0 || $2 - $1 > tol || $1 - $2 > tol {
+		printf "STATS %d: lag %.0f ms in real time, %.0f ms warped\n",
+		       NR, $1, $2
+		bad = 1
+	}
+	END { exit bad }'; then
+	echo "FAIL warp x$SPEED STATS time= does not follow the warped clock"
+	STATUS=1
+fi
+[ $STATUS -eq 0 ] && echo "OK warp x$SPEED matches real time"
+exit $STATUS
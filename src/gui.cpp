@@ -30,7 +30,9 @@
 //           [lesson=<id>[...,mastery=<n>,power=<n>]] [suggestion=<token>]
 //           [chunk=<hash>[...,mastery=<n>,power=<n>]]
 //         Updates the status bar.  Points delta animation fires when
-//         today's score increases after the first stats load.
+//         today's score increases after the first stats load.  Lines
+//         that do not start with "STATS time=", such as bin/midi's
+//         MIDI_STATS, are ignored.
 //     SUGGESTION chunk=<hash> skills=<s> reason=<r>
 //         Enters chunk mode: sets current_chunk=<hash>, emits LOAD_CHUNK,
 //         flashes skills as status text.
@@ -49,6 +51,12 @@
 // RECEIVED (stdin, from stats.lua, bin/load, and bin/karaoke)
 //     KARAOKE_DONE          Karaoke playback finished; resets button to normal.
 //
+// REPLAY
+//     gui <file>      Instead of opening a window, feed each line of <file>
+//                     to the stdin parser, then print the status bar fields
+//                     as "pts=<n> goal=<n.nn> goal_met=<0|1> streak=<n>
+//                     power_for=<n>" and exit.  Used by tst/.
+//
 // FILES
 //     seq/<n>.png     Score image for lesson n.
 //     chn/<hash>.png  Score image for chunk <hash>.
@@ -175,6 +183,11 @@ struct state {
 	// Synth volume (forwarded as SET MASTER_GAIN; 0 = off)
 	float synth_vol = 0.3f;
 
+	// Audio health (from STATUS SYNTH lines; load < 0 = none seen yet)
+	float synth_load  = -1.0f;
+	int   synth_p99   = 0;
+	long  synth_xruns = 0;
+
 	// Per-skill mastery (from SKILL_STATS lines emitted by stats.lua)
 	struct SkillStat { char name[32]; float mastery; };
 	SkillStat skill_stats[32];
@@ -557,7 +570,9 @@ static void handle_stats(const char *buf)
 {
 	// STATS time=<t> total_today=<n.nn> goal=<n.nn> streak=<n>
 	//       [lesson=<id>[ivl=<n>,ease=<n>,tot_dur=<s>,mastery=<n>,power=<n>]]
-	if (strncmp(buf, "STATS", 5) != 0)
+	// Only stats.lua's daily totals; other STATS-like lines (e.g.
+	// MIDI_STATS from bin/midi) must not reset the score to 0.
+	if (strncmp(buf, "STATS time=", 11) != 0)
 		return;
 
 	float total = 0.0f, goal = 0.0f;
@@ -958,6 +973,7 @@ static void parse_line(const char *buf)
 	if (strncmp(buf, "STATUS MIDI input opened: ", 26) == 0) {
 		char nm[128]; strncpy(nm, buf + 26, 127); nm[127] = '\0';
 		char *nl = strpbrk(nm, "\r\n"); if (nl) *nl = '\0';
+		char *dev = strstr(nm, " (DEV:"); if (dev) *dev = '\0';
 		for (int i = 0; i < state.midi_count; i++)
 			if (strcmp(state.midi_names[i], nm) == 0) { state.midi_in = i; break; }
 		return;
@@ -969,6 +985,12 @@ static void parse_line(const char *buf)
 			if (strcmp(state.midi_names[i], nm) == 0) { state.midi_out = i; break; }
 		return;
 	}
+	// STATUS SYNTH load=<pct> p99=<us> xruns=<n>  (periodic, from synth.c)
+	if (strncmp(buf, "STATUS SYNTH ", 13) == 0) {
+		sscanf(buf + 13, "load=%f p99=%d xruns=%ld", &state.synth_load,
+		       &state.synth_p99, &state.synth_xruns);
+		return;
+	}
 	if (strncmp(buf, "STATUS MIDI forward: ", 21) == 0) {
 		state.midi_fwd = (strncmp(buf + 21, "ON", 2) == 0);
 		return;
@@ -1864,6 +1886,15 @@ static void show_settings(void)
 			if (ImGui::IsItemHovered())
 				ImGui::SetTooltip("Volume of the built-in synthesizer (0 = muted)");
 
+			// Synth audio health
+			if (state.synth_load >= 0.0f)
+				ImGui::Text("Synth audio: load %.1f%%  p99 %d us  xruns %ld",
+					    state.synth_load, state.synth_p99, state.synth_xruns);
+			else
+				ImGui::TextDisabled("Synth audio: no status yet");
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("Share of the audio deadline spent rendering, 99th percentile callback time, and dropouts since start");
+
 			// MIDI event log
 			ImGui::Spacing();
 			ImGui::Separator();
@@ -2131,8 +2162,29 @@ static void gui_main(void)
 	check_new_day();
 }
 
-int main(int, char **)
+// REPLAY: parse the lines of path without a window, print the status bar
+static int replay(const char *path)
 {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	char buf[MAX_LEN];
+	while (fgets(buf, sizeof(buf), f))
+		parse_line(buf);
+	fclose(f);
+	printf("pts=%d goal=%.2f goal_met=%d streak=%d power_for=%d\n",
+	       state.status.pts, state.status.goal, state.status.goal_met ? 1 : 0,
+	       state.status.streak, state.status.power_for);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		return replay(argv[1]);
+
 	glfwSetErrorCallback([](int error, const char *description) {
 		fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 	});
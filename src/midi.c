@@ -3,11 +3,23 @@
 // Copyright (c) 2026 Jakob Kastelic
 
 /* DESCRIPTION
- *     midi reads incoming MIDI messages from a connected device and writes
- *     text events to standard output with timestamps, suitable for piping
- *     to downstream programs.  All MIDI message handling occurs in a
- *     background RtMidi callback; a self-pipe wakes the main poll() loop
- *     without busy-waiting.
+ *     midi reads incoming MIDI messages from one or more connected devices
+ *     and writes text events to standard output with timestamps, suitable
+ *     for piping to downstream programs.  The RtMidi callback, which runs
+ *     on the backend's thread, only timestamps each message and pushes it
+ *     into a lock-free single-producer/single-consumer ring of its input;
+ *     a self-pipe wakes the main poll() loop, which formats everything
+ *     queued since the last wakeup and writes it to stdout in one batch.
+ *     A slow consumer of stdout therefore never delays MIDI input
+ *     delivery.  If a ring overflows, the oldest queued events are kept
+ *     and the new ones are counted and reported in a STATUS line.
+ *
+ *     Up to MAX_INPUTS inputs (e.g. a keyboard and a pedal board) can be
+ *     open at once, each with its own ring and time base.  The main loop
+ *     merges the rings by MONO_US, taking the earliest queued event of
+ *     any input each time, and tags every note event with DEV:<n>, the
+ *     input's slot number as given when it was opened.  Merging never
+ *     waits for an input that has nothing queued, so it adds no latency.
  *
  *     Commands sent via stdin select input/output devices and control
  *     forwarding.  Lines not beginning with "MIDI" are silently ignored,
@@ -19,22 +31,70 @@
  *     On startup the program enumerates available MIDI devices, emitting
  *     one DEVICE_AVAIL line per device, then restores the last-used input
  *     device, output device, and forwarding flag from the settings log.
- *     Settings are saved to the log on every change.
+ *     Settings are saved to the log on every change.  Devices plugged in
+ *     or removed later are noticed without polling (see HOTPLUG).
  *
  *     Note names in output use LilyPond absolute pitch with sharps only:
  *     c' = middle C (MIDI 60), cis' = C#4 (MIDI 61), ais = Bb3, and so on.
  *     Octave marks: ' raises by one octave, , lowers by one.
  *
  * COMMANDS (stdin)
- *     MIDI IN <n>                Open MIDI input device number n.
+ *     MIDI IN <n>                Open MIDI input device number n, closing
+ *                                all other inputs.
+ *     MIDI IN ADD <n>            Open device n as an additional input.
+ *     MIDI IN REMOVE <n>         Close input device n.
+ *     MIDI IN file:<path.mid>[@<speed>][,loop]
+ *                                Play a Standard MIDI File as the input
+ *                                device, <speed> times faster than real
+ *                                time (default 1), optionally looping.
+ *                                See FILE INPUT.
  *     MIDI OUT <n>               Open MIDI output device number n.
- *     MIDI FORWARD ON            Forward raw MIDI input bytes to the output
- * port. MIDI FORWARD OFF           Disable forwarding. MIDI DEVICES
- * Re-enumerate devices and emit DEVICE_AVAIL lines. MIDI TEST Send a C#4
- * note-on/note-off (250 ms) to the output. MIDI NOTE_ON <lily> VELOCITY:<v>
- * Send note-on to the current output device. MIDI NOTE_OFF <lily> Send note-off
- * to the current output device. MIDI PANIC                        Send All
- * Notes Off (CC 123) on all 16 channels.
+ *     MIDI FORWARD ON            Forward raw MIDI input bytes to the
+ *                                output port.
+ *     MIDI FORWARD OFF           Disable forwarding.
+ *     MIDI DEVICES               Re-enumerate devices and emit DEVICE_AVAIL
+ *                                lines.
+ *     MIDI TEST                  Send a C#4 note-on/note-off (250 ms) to
+ *                                the output.
+ *     MIDI NOTE_ON <lily> VELOCITY:<v>
+ *                                Send note-on to the current output device.
+ *     MIDI NOTE_OFF <lily>       Send note-off to the current output device.
+ *     MIDI PANIC                 Send All Notes Off (CC 123) on all 16
+ *                                channels.
+ *     MIDI RATE [<bytes_per_s> [<burst>]]
+ *                                Limit the output to <bytes_per_s>
+ *                                (0 = unlimited), allowing bursts of
+ *                                <burst> bytes, and report the output
+ *                                queues.  See OUTPUT.
+ *     MIDI SCHEDULE <us> NOTE_ON <lily> VELOCITY:<v>
+ *     MIDI SCHEDULE <us> NOTE_OFF <lily>
+ *                                Queue a note-on/note-off to be sent when
+ *                                CLOCK_MONOTONIC reaches <us> microseconds
+ *                                (the clock of MONO_US).  Times already
+ *                                past are sent at once.  See SCHEDULING.
+ *     MIDI SCHEDULE CLEAR        Drop all queued events.
+ *     MIDI SCHEDULE STATS        Report the late-by distribution of the
+ *                                scheduled events sent so far.
+ *     MIDI RECORD ON             Record input to a new MIDI file in
+ *                                log/rec/ (see RECORDING).
+ *     MIDI RECORD OFF            Finish the current recording.
+ *     MIDI CHORD ON [<spread_ms>]
+ *                                Emit CHORD events, grouping notes
+ *                                struck within <spread_ms> of each other
+ *                                (default CHORD_SPREAD_MS, or the last
+ *                                value set).  See CHORD.
+ *     MIDI CHORD OFF             Stop emitting CHORD events.
+ *     MIDI STATS                 Report playing statistics (see STATS).
+ *     MIDI STATS EVERY <s>       Also report them every <s> seconds;
+ *                                0 stops the periodic reports.
+ *     MIDI STATS RESET           Start the statistics afresh.
+ *     MIDI FILTER [<type>...]    Drop the listed system message types at
+ *                                the driver: CLOCK (timing clock 0xF8 and
+ *                                MTC quarter frame 0xF1), SENSE (active
+ *                                sensing 0xFE), SYSEX (0xF0).  NONE clears
+ *                                the filter.  The default is CLOCK SENSE.
+ *                                Without arguments, only report the filter
+ *                                and the message counters.
  *
  * EVENTS (stdout)
  *     DEVICE_AVAIL <n> <name>
@@ -42,40 +102,211 @@
  *         found, one line with the synthetic name "(no MIDI devices)" is
  *         emitted.
  *
- *     NOTE_ON <lily> VELOCITY:<v> TIME:<ms>
+ *     NOTE_ON <lily> VELOCITY:<v> TIME:<ms> MONO_US:<us> DEV:<n>
  *         MIDI note-on with velocity > 0.  <lily> is the LilyPond pitch
- *         name; <ms> is milliseconds since the Unix epoch (CLOCK_REALTIME).
+ *         name; <ms> is milliseconds since the Unix epoch (CLOCK_REALTIME)
+ *         sampled when the callback runs.  <us> is the event time in
+ *         microseconds on CLOCK_MONOTONIC, derived from the driver's own
+ *         time stamps (see TIMESTAMPS); use it for interval measurements.
+ *         <n> is the slot of the input the note came from.
  *
- *     NOTE_OFF <lily> TIME:<ms>
+ *     NOTE_OFF <lily> TIME:<ms> MONO_US:<us> DEV:<n>
  *         MIDI note-off, or note-on with velocity 0.
  *
+ *     STATUS MIDI input opened: <name> (DEV:<n>)
+ *         An input was opened in slot <n>.  Slots are reused after
+ *         an input is closed.
+ *
+ *     CHORD <t_first_on> <t_last_on> <t_release> <lily>...
+ *         Notes played together, emitted when the last held note is
+ *         released (see CHORD).  Times are TIME milliseconds: the first
+ *         and last onset of the chord and the release of its last note.
+ *         Pitches are in ascending order.
+ *
+ *     MIDI_STATS <name> n=<n> mean=<x> sd=<x> p10=<x> p50=<x> p90=<x> max=<x>
+ *         One line per statistic, see STATS.  The prefix keeps them apart
+ *         from the "STATS time=" daily totals of stats.lua, which bin/gui
+ *         also reads.
+ *
+ *     DEVICE_ADDED <n> <name>
+ *     DEVICE_REMOVED <name>
+ *         A device appeared or went away (see HOTPLUG).  Followed by the
+ *         complete DEVICE_AVAIL list, since indices may have shifted.
+ *
  *     STATUS <message>
  *         Informational message, e.g. device open/close confirmation,
  *         forwarding state change, test result, or error description.
  *
+ *     STATUS MIDI received: note=<n> channel=<n> sysex=<n> clock=<n>
+ *            sense=<n> system=<n> wakeups=<n>
+ *         Reply to MIDI FILTER: messages that reached the callback since
+ *         startup, by type (channel = channel messages other than notes,
+ *         system = other system messages), and the number of times the
+ *         callback woke the main loop.  Filtered types stop counting
+ *         once the driver drops them.
+ *
+ * SCHEDULING
+ *     Scheduled events are kept in a binary min-heap ordered by time (and
+ *     by arrival for equal times) and sent by a dedicated thread, started
+ *     on the first MIDI SCHEDULE, that sleeps with clock_nanosleep() to
+ *     the absolute time of the earliest event.  The thread asks for
+ *     SCHED_FIFO priority and falls back to normal priority, with a
+ *     STATUS note, where that is not permitted.  When an event earlier
+ *     than the one being waited for arrives, the thread is woken with
+ *     SIGUSR1.  Because the sleep is clock_nanosleep(), schedules also
+ *     follow the accelerated clock of run -w.
+ *
+ *     The late-by time of each event (send time minus scheduled time) is
+ *     recorded in a histogram of SCHED_LATE_BIN_US wide bins; the reply
+ *     to MIDI SCHEDULE STATS is
+ *         STATUS MIDI schedule: sent=<n> pending=<n> late_p50_us=<x>
+ *                late_p99_us=<x> late_max_us=<x>
+ *     where the percentiles are bin upper edges.  Scheduled events are
+ *     sent through the play queue (see OUTPUT), so the late-by time ends
+ *     when an event is queued, not when it leaves the port.
+ *
+ * OUTPUT
+ *     Everything sent to the output port goes through one output thread,
+ *     which keeps a queue per priority and always sends from the highest
+ *     non-empty one:
+ *         forward   input bytes forwarded with MIDI FORWARD ON
+ *         control   MIDI PANIC
+ *         play      MIDI NOTE_ON/NOTE_OFF, MIDI TEST, MIDI SCHEDULE
+ *     The thread paces the port with a token bucket: bytes are sent at
+ *     most at <bytes_per_s> on average, and at most <burst> back to back
+ *     after a pause.  The default, OUT_RATE bytes/s with OUT_BURST, is
+ *     the budget of a 31.25 kbaud DIN cable, so a hardware synth never
+ *     receives faster than it could over DIN.  A message that finds its
+ *     queue full (OUT_Q_SZ) is dropped, as is one longer than
+ *     OUT_MSG_MAX or one sent while no output is open.  The thread
+ *     sleeps on a semaphore while there is nothing to send.
+ *
+ *     The input callbacks take no lock to forward: each input has an
+ *     SPSC ring of FWD_RING_SZ messages into the output thread, which
+ *     moves them to the forward queue before choosing what to send.  A
+ *     message that finds the ring full counts as dropped from the
+ *     forward queue.
+ *     At exit, midi waits up to OUT_FLUSH_US for the queues to drain.
+ *     The reply to MIDI RATE is
+ *         STATUS MIDI output rate: <bytes_per_s> bytes/s burst=<burst>
+ *         STATUS MIDI output <queue>: sent=<n> dropped=<n> depth=<n>
+ *                max_depth=<n>
+ *     with one line for each queue.  The setting is saved in
+ *     log/midi.log.
+ *
+ * FILE INPUT
+ *     A file input stands in for a hardware device: a player thread
+ *     waits on a condition variable with an absolute CLOCK_MONOTONIC
+ *     deadline until each event is due (closing the input signals it, so
+ *     it stops at once rather than at the next event) and then calls the
+ *     same callback RtMidi would, so filtering, MONO_US, forwarding and
+ *     every downstream event behave as with a keyboard.  The delta stamp
+ *     passed with each message comes from the file's tempo map (divided
+ *     by <speed>), not from when the thread woke up.  Format 0 and 1
+ *     files with PPQ or SMPTE division are accepted; tracks are merged by
+ *     time, and only channel messages are played (sysex and meta events
+ *     are skipped).  A file whose events all fall at time 0 has no length
+ *     and cannot be looped.  When playback ends without loop, "STATUS
+ *     MIDI file finished: <path>" is emitted.  A file input is not saved
+ *     to log/midi.log; MIDI IN <n> stops it, while a device opened with
+ *     MIDI IN ADD plays along with it.
+ *
+ * RECORDING
+ *     While recording is on, every channel message that reaches the main
+ *     loop (notes with their velocities, CC 64 pedal and other
+ *     controllers, program changes, pitch bend) is appended to
+ *     log/rec/<YYYYmmdd-HHMMSS>.mid, one file per midi run or MIDI RECORD
+ *     ON.  The file is format 0 with REC_PPQ ticks per quarter at 120 bpm,
+ *     i.e. REC_US_PER_TICK us per tick, counted from MONO_US times since
+ *     recording started.  The main loop only copies events into a queue;
+ *     a writer thread encodes and appends them, and at most every
+ *     REC_FLUSH_US (and when recording stops) writes an end-of-track
+ *     event and patches the track length, so the file on disk is always
+ *     a complete SMF that MIDI IN file: can replay.  The setting is saved
+ *     in log/midi.log, so recording resumes with every new session.
+ *
+ * CHORD
+ *     Held notes are kept in a 128-bit set.  With MIDI CHORD ON, every
+ *     note struck while at least one note is held belongs to the same
+ *     phrase; when the set becomes empty, the phrase is split into
+ *     chords in onset order, a note starting a new chord when it was
+ *     struck more than <spread_ms> after the first note of the current
+ *     one.  A rolled chord thus stays one chord, and a passing note
+ *     played over a held chord becomes a chord of its own.  A note
+ *     struck twice in one phrase keeps its first onset and last
+ *     release.  The setting is saved in log/midi.log.
+ *
+ * STATS
+ *     The main loop keeps running distributions of the notes it formats,
+ *     since startup or MIDI STATS RESET, at O(1) cost per event:
+ *         IOI       ms between the onsets of successive chords
+ *         SPREAD    ms from first to last onset within a chord of two
+ *                   or more notes
+ *         VELOCITY  note-on velocity
+ *         DURATION  ms from note-on to note-off
+ *     A chord is a run of onsets within <spread_ms> of its first one,
+ *     the same rule as CHORD (which need not be on), so a single note
+ *     counts as a chord for IOI; a chord is counted once the next one
+ *     starts.  Times are MONO_US differences.  Mean and sd are exact;
+ *     percentiles are bin middles (1 ms bins for IOI and SPREAD, 5 ms
+ *     for DURATION, the last bin open-ended).
+ *
+ * HOTPLUG
+ *     The main loop watches the kernel's uevent netlink socket.  A socket
+ *     filter attached to it lets through only uevents carrying
+ *     "SUBSYSTEM=sound" within their first HOTPLUG_SCAN_LEN bytes (and
+ *     any longer ones, which are checked after reading), so USB, block,
+ *     power supply and other devices do not wake midi.  A sound uevent
+ *     schedules a re-enumeration HOTPLUG_SETTLE_US later, giving the
+ *     sequencer time to create the new ports.  Devices that appeared or
+ *     went away are reported.  An input or output whose device went
+ *     away is closed, with "STATUS MIDI input lost: <name> (DEV:<n>)" or
+ *     "STATUS MIDI output lost: <name>".  Devices saved in log/midi.log
+ *     are reopened as soon as they are back.  Names are matched without
+ *     the trailing ALSA "<client>:<port>" numbers, which change when a
+ *     device is replugged.  Nothing is polled, so an idle session wakes
+ *     only on device changes.
+ *
+ * TIMESTAMPS
+ *     RtMidi passes each message with the time since the previous message
+ *     as measured by the driver, which is unaffected by how late the
+ *     callback thread gets to run.  The first message after opening a
+ *     port is anchored to CLOCK_MONOTONIC; each later one is the previous
+ *     event time plus its delta.  The result is clamped so it is never in
+ *     the future, and re-anchored when it falls more than RESYNC_US
+ *     behind the clock, which bounds the error from a driver clock that
+ *     runs slow or from a gap the deltas do not describe.
+ *
  * FILES
  *     log/midi.log    Persists the last-used device names and forward flag.
  *                     Format (device names, not indices, to survive hotplug):
- *                         IN <device name>
+ *                         IN <device name>     (one line per input)
  *                         OUT <device name>
  *                         FORWARD <0|1>
+ *                         FILTER <type>... | NONE
+ *                         RECORD <0|1>
+ *                         CHORD <0|1> <spread_ms>
+ *                         RATE <bytes_per_s> <burst>
  *
  * EXAMPLE INPUT
  *     MIDI DEVICES
  *     MIDI IN 0
  *     MIDI OUT 1
  *     MIDI FORWARD ON
+ *     MIDI FILTER CLOCK SENSE SYSEX
  *     MIDI TEST
  *
  * EXAMPLE OUTPUT
  *     DEVICE_AVAIL 0 USB Midi Keyboard
  *     DEVICE_AVAIL 1 Virtual Synth
- *     STATUS MIDI input opened: USB Midi Keyboard
+ *     STATUS MIDI input opened: USB Midi Keyboard (DEV:0)
  *     STATUS MIDI output opened: Virtual Synth
  *     STATUS Forwarding enabled
+ *     STATUS MIDI filter: CLOCK SENSE SYSEX
+ *     STATUS MIDI received: note=0 channel=0 sysex=0 clock=96 sense=3 ...
  *     STATUS MIDI test sent: C#4
- *     NOTE_ON cis' VELOCITY:100 TIME:1740000000000
- *     NOTE_OFF cis' TIME:1740000000250
+ *     NOTE_ON cis' VELOCITY:100 TIME:1740000000000 MONO_US:86400000000 DEV:0
+ *     NOTE_OFF cis' TIME:1740000000250 MONO_US:86400250113 DEV:0
  */
 
 /* Required for: pipe, clock_gettime, struct timespec, poll */
@@ -83,25 +314,63 @@
 
 #include <rtmidi/rtmidi_c.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <asm/socket.h> /* SO_ATTACH_FILTER */
+#include <linux/filter.h>
+#include <linux/netlink.h>
+
 /* ------------------------------------------------------------------ */
 /* Constants                                                           */
 /* ------------------------------------------------------------------ */
 
 #define MAX_DEVICES 64
 #define MAX_NAME_LEN 256
-#define MAX_PRESSED 128
+#define N_NOTES 128
+#define CHORD_SPREAD_MS 80 /* default onset spread of one CHORD */
+#define HIST_BINS 2000	   /* MIDI STATS bins, plus one overflow bin */
 #define CMD_BUF_SZ 512
+#define IN_BUF_SZ (CMD_BUF_SZ * 8)
 #define LOG_PATH "log/midi.log"
+#define RING_SZ 1024 /* input events; must be a power of two */
+#define MAX_INPUTS 8
+#define OUT_BUF_SZ 65536
+#define RESYNC_US 50000 /* max lag of derived time behind the clock */
+#define SCHED_MAX 4096	/* queued MIDI SCHEDULE events */
+#define SCHED_LATE_BIN_US 10
+#define SCHED_LATE_BINS 1000 /* plus one overflow bin */
+#define OUT_Q_SZ 256	     /* queued output messages per priority */
+#define FWD_RING_SZ 128	     /* forwarded messages per input; power of 2 */
+#define OUT_MSG_MAX 256	     /* longest message that can be queued */
+#define OUT_RATE 3125	     /* bytes/s: 31.25 kbaud DIN, 10 bits/byte */
+#define OUT_BURST 96	     /* bytes sent back to back after a pause */
+#define OUT_FLUSH_US 1000000 /* max wait for the queues to drain at exit */
+#define REC_DIR "log/rec"
+#define REC_PPQ 25000
+#define REC_US_PER_QN 500000 /* 120 bpm */
+#define REC_US_PER_TICK (REC_US_PER_QN / REC_PPQ)
+#define REC_FLUSH_US 1000000
+#define HOTPLUG_SETTLE_US 250000 /* uevent to sequencer port creation */
+#define HOTPLUG_BUF_SZ 8192
+#define HOTPLUG_SCAN_LEN 384 /* uevent bytes the socket filter searches */
+#define NO_DEVICES "(no MIDI devices)"
 
 /* LilyPond absolute pitch note names (chromatic scale, no flats) */
 static const char *const NOTE_NAMES[12] = {
@@ -110,36 +379,249 @@ static const char *const NOTE_NAMES[12] = {
 /* C#4 = MIDI note 61, matching NOTES_Cs4 in theory.h */
 #define NOTE_Cs4 61
 
+/* MIDI FILTER bits */
+#define FILTER_SYSEX 1
+#define FILTER_CLOCK 2
+#define FILTER_SENSE 4
+#define FILTER_DEFAULT (FILTER_CLOCK | FILTER_SENSE)
+
+/* Received-message counters, by type */
+enum {
+	CNT_NOTE,
+	CNT_CHANNEL,
+	CNT_SYSEX,
+	CNT_CLOCK,
+	CNT_SENSE,
+	CNT_SYSTEM,
+	N_CNT
+};
+
+static const char *const CNT_NAMES[N_CNT] = {"note",  "channel", "sysex",
+					     "clock", "sense",	 "system"};
+
+/* Output priorities, highest first */
+enum { PRIO_FORWARD, PRIO_CONTROL, PRIO_PLAY, N_PRIO };
+
+static const char *const PRIO_NAMES[N_PRIO] = {"forward", "control", "play"};
+
 /* ------------------------------------------------------------------ */
 /* State                                                               */
 /* ------------------------------------------------------------------ */
 
+/* Raw MIDI message as captured by the callback */
+typedef struct {
+	int64_t time_ms;
+	int64_t time_us; /* CLOCK_MONOTONIC, from driver delta stamps */
+	unsigned char len;
+	unsigned char msg[3];
+} RawEvent;
+
+/* Channel message of a MIDI file, at its tempo-mapped time */
+typedef struct {
+	int64_t t_us;
+	uint32_t tick;
+	uint32_t seq; /* file order, keeps merging stable */
+	unsigned char len;
+	unsigned char msg[3];
+} SmfEvent;
+
+/* MIDI RECORD state; the queue is shared under mu with the writer */
+typedef struct {
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+	pthread_t thread;
+	RawEvent *queue;
+	int n_queue;
+	int cap_queue;
+	int stop;
+
+	/* Writer thread only */
+	FILE *f;
+	int64_t start_us;
+	int64_t last_tick;
+	uint32_t trk_len; /* bytes after the MTrk header, without EOT */
+	long events;
+	char path[64];
+} Recorder;
+
+struct State;
+
+/* One open input and its callback context.  The callback of every input
+   runs on the backend thread of its own port, so each input has its own
+   SPSC ring and time base; slots are reused, and the slot number is the
+   DEV:<n> tag of its events. */
+typedef struct {
+	struct State *s;
+	int used;
+	int idx;	 /* device index, -1 for a file input */
+	RtMidiInPtr h;	 /* NULL for a file input */
+	char name[MAX_NAME_LEN]; /* device name, empty for a file input */
+
+	/* The callback advances ring_head, main ring_tail.  Both are
+	   free-running counters; the slot is index % RING_SZ. */
+	RawEvent ring[RING_SZ];
+	unsigned int ring_head;
+	unsigned int ring_tail;
+	unsigned long ring_dropped;  /* written by callback only */
+	unsigned long drop_reported; /* main thread's last report */
+
+	/* Time of the last event (CLOCK_MONOTONIC us, 0 = none); owned
+	   by the callback while the input is open */
+	int64_t last_us;
+} Input;
+
+/* MIDI STATS distribution: fixed-width bins for percentiles, running
+   sums for mean and standard deviation; adding a value is O(1) */
+typedef struct {
+	int width; /* bin width, in the unit of the values */
+	unsigned long n;
+	unsigned long bins[HIST_BINS + 1];
+	double sum, sum2;
+	int64_t max;
+} Hist;
+
+/* Output event queued by MIDI SCHEDULE */
+typedef struct {
+	int64_t t_us; /* CLOCK_MONOTONIC */
+	uint64_t seq; /* arrival order, breaks ties */
+	unsigned char msg[3];
+} SchedEvent;
+
+/* Output message waiting for the output thread */
+typedef struct {
+	unsigned short len;
+	unsigned char msg[OUT_MSG_MAX];
+} OutMsg;
+
+/* FIFO of one output priority, under oq_mu */
 typedef struct {
+	OutMsg q[OUT_Q_SZ];
+	int head;
+	int n;
+	int max_depth;
+	unsigned long sent;
+	unsigned long dropped; /* queue full, too long, or no output */
+} OutQueue;
+
+/* Forwarded messages of one input slot.  The callback advances head,
+   the output thread tail; free-running like Input.ring.  Kept out of
+   Input so that reusing a slot never clears a ring being drained. */
+typedef struct {
+	OutMsg ring[FWD_RING_SZ];
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped; /* written by callback only */
+} FwdRing;
+
+typedef struct State {
 	/* Device registry */
 	char dev_names[MAX_DEVICES][MAX_NAME_LEN];
 	int n_devices;
 
-	/* Currently open port indices (-1 = none) */
-	int in_idx;
+	/* Open inputs, merged by time, and the output (-1 = none) */
+	Input in[MAX_INPUTS];
 	int out_idx;
-	RtMidiInPtr midi_in;
 	RtMidiOutPtr midi_out;
 
-	/* Pressed-note list, insertion-ordered */
-	unsigned char pressed[MAX_PRESSED];
-	int n_pressed;
+	/* Held notes, one bit per MIDI note */
+	uint64_t held[N_NOTES / 64];
+	int n_held;
+
+	/* MIDI CHORD: notes struck since the held set was last empty, with
+	   the onset and release time (TIME ms) of each */
+	int chords;
+	int chord_spread_ms;
+	uint64_t struck[N_NOTES / 64];
+	int64_t on_ms[N_NOTES];
+	int64_t off_ms[N_NOTES];
+
+	/* MIDI STATS since startup or reset.  Onsets within chord_spread_ms
+	   of the first one of a cluster form one chord; cl_* describe the
+	   current cluster.  on_us is the onset of each held note. */
+	Hist st_ioi, st_spread, st_vel, st_dur;
+	int64_t cl_first_us, cl_last_us;
+	int cl_n;
+	int64_t on_us[N_NOTES];
+	int stats_every_s; /* 0 = only on request */
+	int64_t stats_at;  /* next periodic report (CLOCK_MONOTONIC us) */
 
 	/* MIDI-forwarding flag */
 	int forward;
 
+	/* FILTER_* bits; counters are written by the callbacks only */
+	int filter;
+	unsigned long counts[N_CNT];
+	unsigned long wakeups;
+
 	/* Saved device names from log (used to reopen on startup) */
-	char saved_in_name[MAX_NAME_LEN];
+	char saved_in[MAX_INPUTS][MAX_NAME_LEN];
+	int n_saved_in;
 	char saved_out_name[MAX_NAME_LEN];
 
+	/* Hotplug: uevent socket (-1 = none), and when to re-enumerate
+	   (CLOCK_MONOTONIC us, 0 = nothing pending) */
+	int hp_fd;
+	int64_t rescan_at;
+
 	/* Self-pipe: MIDI callback writes a byte to wake up poll() */
 	int pipe_r; /* read end  – watched by poll() */
 	int pipe_w; /* write end – written by MIDI callback */
 
+	/* MIDI IN file: playback; play_stop is guarded by play_mu and
+	   signalled on play_cv, play_done is set atomically by the
+	   player thread */
+	Input *play_in;
+	SmfEvent *play_ev;
+	int play_n;
+	int64_t play_len_us;
+	double play_speed;
+	int play_loop;
+	int play_active;
+	int play_stop;
+	int play_done;
+	pthread_mutex_t play_mu;
+	pthread_cond_t play_cv;
+	pthread_t play_thread;
+	char play_path[MAX_NAME_LEN];
+
+	/* MIDI RECORD */
+	int record; /* setting, saved in the log */
+	int recording;
+	Recorder rec;
+
+	/* Serialises sends to midi_out (by the output thread) and
+	   replacing it (by the main thread) */
+	pthread_mutex_t out_mu;
+
+	/* Output queues, one per PRIO_*, and the thread that drains them
+	   through a token bucket of out_rate bytes/s (0 = unlimited) and
+	   out_burst bytes; all under oq_mu.  oq_sem wakes the thread,
+	   oq_cv signals sends to out_flush(). */
+	pthread_mutex_t oq_mu;
+	pthread_cond_t oq_cv;
+	sem_t oq_sem;
+	pthread_t oq_thread;
+	OutQueue oq[N_PRIO];
+	FwdRing fwd[MAX_INPUTS]; /* lock-free, by input slot */
+	int oq_busy; /* a message is being sent */
+	int out_rate;
+	int out_burst;
+	double tokens;
+	int64_t tokens_us;
+
+	/* MIDI SCHEDULE queue and its thread; all under sched_mu */
+	pthread_mutex_t sched_mu;
+	pthread_cond_t sched_cv;
+	pthread_t sched_thread;
+	int sched_started;
+	SchedEvent sched[SCHED_MAX];
+	int n_sched;
+	uint64_t sched_seq;
+	int64_t sched_wait_us; /* time being slept for, 0 = awake */
+	unsigned long sched_sent;
+	unsigned long sched_late[SCHED_LATE_BINS + 1];
+	int64_t sched_late_max;
+
 	/* Set to 0 to exit the main loop */
 	int running;
 } State;
@@ -157,6 +639,15 @@ int64_t now_ms(void)
 	return (int64_t)ts.tv_sec * 1000 + (int64_t)ts.tv_nsec / 1000000;
 }
 
+static int64_t mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + (int64_t)ts.tv_nsec / 1000;
+}
+
 /* Convert MIDI note to LilyPond absolute pitch, e.g. 60 -> "c'", 74 -> "d''" */
 static void note_to_lily(unsigned char note, char *buf, size_t len)
 {
@@ -242,99 +733,648 @@ static void out_devices(const State *s)
 	fflush(stdout);
 }
 
-static void out_note_on(unsigned char note, unsigned char velocity)
+/* Note events are left in the stdout buffer; the main loop flushes
+   once per batch of input events. */
+static void out_note_on(unsigned char note, unsigned char velocity,
+			int64_t t_ms, int64_t t_us, int dev)
 {
 	char name[16];
 	note_to_lily(note, name, sizeof(name));
-	printf("NOTE_ON %s VELOCITY:%u TIME:%" PRId64 "\n", name,
-	       (unsigned)velocity, now_ms());
-	fflush(stdout);
+	printf("NOTE_ON %s VELOCITY:%u TIME:%" PRId64 " MONO_US:%" PRId64
+	       " DEV:%d\n",
+	       name, (unsigned)velocity, t_ms, t_us, dev);
 }
 
-static void out_note_off(unsigned char note)
+static void out_note_off(unsigned char note, int64_t t_ms, int64_t t_us,
+			 int dev)
 {
 	char name[16];
 	note_to_lily(note, name, sizeof(name));
-	printf("NOTE_OFF %s TIME:%" PRId64 "\n", name, now_ms());
-	fflush(stdout);
+	printf("NOTE_OFF %s TIME:%" PRId64 " MONO_US:%" PRId64 " DEV:%d\n",
+	       name, t_ms, t_us, dev);
+}
+
+/* ------------------------------------------------------------------ */
+/* Output queue                                                        */
+/* ------------------------------------------------------------------ */
+
+/* Send to the current output; returns -1 if there is none or on error */
+static int port_send(State *s, const unsigned char *msg, int len)
+{
+	int ret = -1;
+	pthread_mutex_lock(&s->out_mu);
+	if (s->midi_out)
+		ret = rtmidi_out_send_message(s->midi_out, msg, len);
+	pthread_mutex_unlock(&s->out_mu);
+	return ret;
+}
+
+/* Queue a message for the output thread at priority prio; returns -1,
+   counting it as dropped, if the queue is full or msg too long */
+static int send_out(State *s, int prio, const unsigned char *msg, int len)
+{
+	OutQueue *q = &s->oq[prio];
+	int ret = -1;
+
+	pthread_mutex_lock(&s->oq_mu);
+	if (len <= OUT_MSG_MAX && q->n < OUT_Q_SZ) {
+		OutMsg *m = &q->q[(q->head + q->n) % OUT_Q_SZ];
+		m->len = (unsigned short)len;
+		memcpy(m->msg, msg, (size_t)len);
+		if (++q->n > q->max_depth)
+			q->max_depth = q->n;
+		ret = 0;
+	} else {
+		q->dropped++;
+	}
+	pthread_mutex_unlock(&s->oq_mu);
+	if (ret == 0)
+		sem_post(&s->oq_sem);
+	return ret;
+}
+
+/* Input callback: hand a message to the output thread without locking.
+   The seq_cst store of head followed by the load of tail (mirrored in
+   drain_fwd) means that either the output thread is woken or it sees
+   the message before it next sleeps. */
+static void fwd_push(State *s, Input *in, const unsigned char *msg,
+		     size_t len)
+{
+	FwdRing *r = &s->fwd[in - s->in];
+	unsigned int head = r->head;
+	if (len > OUT_MSG_MAX ||
+	    head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+		FWD_RING_SZ) {
+		__atomic_store_n(&r->dropped, r->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	OutMsg *m = &r->ring[head % FWD_RING_SZ];
+	m->len = (unsigned short)len;
+	memcpy(m->msg, msg, len);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head)
+		sem_post(&s->oq_sem);
+}
+
+/* Output thread: move forwarded messages to the forward queue; call
+   with oq_mu held.  Returns once every ring was seen empty after its
+   tail was stored. */
+static void drain_fwd(State *s)
+{
+	OutQueue *q = &s->oq[PRIO_FORWARD];
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		FwdRing *r = &s->fwd[i];
+		unsigned int tail = r->tail;
+		while (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != tail) {
+			if (q->n < OUT_Q_SZ) {
+				q->q[(q->head + q->n) % OUT_Q_SZ] =
+				    r->ring[tail % FWD_RING_SZ];
+				if (++q->n > q->max_depth)
+					q->max_depth = q->n;
+			} else {
+				q->dropped++;
+			}
+			__atomic_store_n(&r->tail, ++tail, __ATOMIC_SEQ_CST);
+		}
+	}
+}
+
+/* Messages forwarded but not yet in the forward queue, and those
+   dropped because a ring was full */
+static void fwd_pending(State *s, int *n, unsigned long *dropped)
+{
+	*n = 0;
+	*dropped = 0;
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		FwdRing *r = &s->fwd[i];
+		*n += (int)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+			    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+		*dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+}
+
+/* Sleep on oq_sem for up to wait_us (-1 = until posted); call with
+   oq_mu held */
+static void wait_output(State *s, int64_t wait_us)
+{
+	pthread_mutex_unlock(&s->oq_mu);
+	if (wait_us < 0) {
+		while (sem_wait(&s->oq_sem) != 0 && errno == EINTR)
+			;
+	} else {
+		/* sem_timedwait() only takes CLOCK_REALTIME */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		int64_t ns = ts.tv_nsec + wait_us * 1000;
+		ts.tv_sec += (time_t)(ns / 1000000000);
+		ts.tv_nsec = (long)(ns % 1000000000);
+		sem_timedwait(&s->oq_sem, &ts);
+	}
+	pthread_mutex_lock(&s->oq_mu);
+}
+
+/* Refill the token bucket; call with oq_mu held */
+static void refill_tokens(State *s, int64_t now)
+{
+	s->tokens += (double)(now - s->tokens_us) * s->out_rate / 1e6;
+	s->tokens_us = now;
+	if (s->tokens > s->out_burst)
+		s->tokens = s->out_burst;
+}
+
+/* Output thread: sends the oldest message of the highest non-empty
+   priority once the bucket is out of debt.  A message may take the
+   bucket below zero, so one longer than the burst still goes out, and
+   the rate holds on average. */
+static void *thr_output(void *arg)
+{
+	State *s = (State *)arg;
+
+	pthread_mutex_lock(&s->oq_mu);
+	for (;;) {
+		drain_fwd(s);
+		int p = 0;
+		while (p < N_PRIO && s->oq[p].n == 0)
+			p++;
+		if (p == N_PRIO) {
+			wait_output(s, -1);
+			continue;
+		}
+
+		OutQueue *q = &s->oq[p];
+		if (s->out_rate > 0) {
+			refill_tokens(s, mono_us());
+			if (s->tokens < 0) {
+				wait_output(s, (int64_t)(-s->tokens * 1e6 /
+							 s->out_rate) + 1);
+				continue;
+			}
+			s->tokens -= q->q[q->head].len;
+		}
+
+		OutMsg m = q->q[q->head];
+		q->head = (q->head + 1) % OUT_Q_SZ;
+		q->n--;
+		s->oq_busy = 1;
+		pthread_mutex_unlock(&s->oq_mu);
+		int ret = port_send(s, m.msg, m.len);
+		pthread_mutex_lock(&s->oq_mu);
+		s->oq_busy = 0;
+		if (ret < 0)
+			q->dropped++;
+		else
+			q->sent++;
+		pthread_cond_broadcast(&s->oq_cv); /* for out_flush() */
+	}
+	return NULL;
+}
+
+/* Start fn with SCHED_FIFO priority if permitted; returns -1 if it had
+   to be started with normal priority instead */
+static int start_rt_thread(pthread_t *t, void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	struct sched_param sp = {.sched_priority =
+				     sched_get_priority_min(SCHED_FIFO) + 10};
+	int ret = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &sp);
+	if (pthread_create(t, &attr, fn, arg) != 0) {
+		pthread_create(t, NULL, fn, arg);
+		ret = -1;
+	}
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/* Wait until every queued message has been sent, or OUT_FLUSH_US */
+static void out_flush(State *s)
+{
+	int64_t due = mono_us() + OUT_FLUSH_US;
+	struct timespec ts = {(time_t)(due / 1000000),
+			      (long)(due % 1000000) * 1000};
+	int left = 1;
+
+	pthread_mutex_lock(&s->oq_mu);
+	while (left) {
+		unsigned long dropped;
+		fwd_pending(s, &left, &dropped);
+		left += s->oq_busy;
+		for (int p = 0; p < N_PRIO; p++)
+			left += s->oq[p].n;
+		if (left && pthread_cond_timedwait(&s->oq_cv, &s->oq_mu,
+						   &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&s->oq_mu);
+}
+
+static void set_out_rate(State *s, int rate, int burst)
+{
+	pthread_mutex_lock(&s->oq_mu);
+	s->out_rate = rate;
+	s->out_burst = burst;
+	s->tokens = burst;
+	s->tokens_us = mono_us();
+	pthread_mutex_unlock(&s->oq_mu);
+	sem_post(&s->oq_sem);
+}
+
+static void report_output(State *s)
+{
+	if (s->out_rate > 0)
+		out_status("MIDI output rate: %d bytes/s burst=%d",
+			   s->out_rate, s->out_burst);
+	else
+		out_status("MIDI output rate: unlimited");
+
+	unsigned long sent[N_PRIO], dropped[N_PRIO], fwd_dropped;
+	int depth[N_PRIO], max_depth[N_PRIO], fwd_n;
+	pthread_mutex_lock(&s->oq_mu);
+	for (int p = 0; p < N_PRIO; p++) {
+		sent[p] = s->oq[p].sent;
+		dropped[p] = s->oq[p].dropped;
+		depth[p] = s->oq[p].n;
+		max_depth[p] = s->oq[p].max_depth;
+	}
+	pthread_mutex_unlock(&s->oq_mu);
+	fwd_pending(s, &fwd_n, &fwd_dropped);
+	depth[PRIO_FORWARD] += fwd_n;
+	dropped[PRIO_FORWARD] += fwd_dropped;
+	for (int p = 0; p < N_PRIO; p++)
+		out_status("MIDI output %s: sent=%lu dropped=%lu depth=%d "
+			   "max_depth=%d",
+			   PRIO_NAMES[p], sent[p], dropped[p], depth[p],
+			   max_depth[p]);
 }
 
 /* ------------------------------------------------------------------ */
 /* Note tracking                                                       */
 /* ------------------------------------------------------------------ */
 
-static void add_pressed_note(State *s, unsigned char note)
+static int note_test(const uint64_t *bits, unsigned char note)
 {
-	for (int i = 0; i < s->n_pressed; i++)
-		if (s->pressed[i] == note)
-			return;
-	if (s->n_pressed < MAX_PRESSED)
-		s->pressed[s->n_pressed++] = note;
+	return (int)(bits[note >> 6] >> (note & 63) & 1);
 }
 
-static void remove_pressed_note(State *s, unsigned char note)
+static void note_set(uint64_t *bits, unsigned char note)
 {
-	for (int i = 0; i < s->n_pressed; i++) {
-		if (s->pressed[i] == note) {
-			memmove(&s->pressed[i], &s->pressed[i + 1],
-				(size_t)(s->n_pressed - i - 1));
-			s->n_pressed--;
-			return;
+	bits[note >> 6] |= (uint64_t)1 << (note & 63);
+}
+
+static void note_clear(uint64_t *bits, unsigned char note)
+{
+	bits[note >> 6] &= ~((uint64_t)1 << (note & 63));
+}
+
+/* ------------------------------------------------------------------ */
+/* Statistics                                                          */
+/* ------------------------------------------------------------------ */
+
+static void hist_init(Hist *h, int width)
+{
+	memset(h, 0, sizeof(*h));
+	h->width = width;
+}
+
+static void hist_add(Hist *h, int64_t v)
+{
+	if (v < 0)
+		v = 0;
+	int64_t bin = v / h->width;
+	h->bins[bin < HIST_BINS ? bin : HIST_BINS]++;
+	h->n++;
+	h->sum += (double)v;
+	h->sum2 += (double)v * (double)v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Percentile as the middle of its bin (exact for integers in unit
+   bins), at most the maximum */
+static int64_t hist_pct(const Hist *h, double p)
+{
+	unsigned long want = (unsigned long)(p * (double)h->n), acc = 0;
+	for (int i = 0; i < HIST_BINS; i++) {
+		acc += h->bins[i];
+		if (acc > want) {
+			int64_t v = (int64_t)i * h->width + h->width / 2;
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void stats_reset(State *s)
+{
+	hist_init(&s->st_ioi, 1000);	/* us */
+	hist_init(&s->st_spread, 1000); /* us */
+	hist_init(&s->st_vel, 1);
+	hist_init(&s->st_dur, 5000); /* us */
+	s->cl_n = 0;
+}
+
+/* Onset of a note: extend the current chord or start the next one */
+static void stats_onset(State *s, int64_t t_us, unsigned char velocity)
+{
+	hist_add(&s->st_vel, velocity);
+	if (s->cl_n &&
+	    t_us - s->cl_first_us <= (int64_t)s->chord_spread_ms * 1000) {
+		if (t_us > s->cl_last_us)
+			s->cl_last_us = t_us;
+		s->cl_n++;
+		return;
+	}
+	if (s->cl_n > 1)
+		hist_add(&s->st_spread, s->cl_last_us - s->cl_first_us);
+	if (s->cl_n)
+		hist_add(&s->st_ioi, t_us - s->cl_first_us);
+	s->cl_first_us = s->cl_last_us = t_us;
+	s->cl_n = 1;
+}
+
+/* One MIDI_STATS line; time values are scaled from us to ms */
+static void out_hist(const char *name, const Hist *h, double scale)
+{
+	double mean = h->n ? h->sum / (double)h->n : 0;
+	double var = h->n ? h->sum2 / (double)h->n - mean * mean : 0;
+	printf("MIDI_STATS %s n=%lu mean=%.1f sd=%.1f p10=%.1f p50=%.1f "
+	       "p90=%.1f max=%.1f\n",
+	       name, h->n, mean * scale, var > 0 ? sqrt(var) * scale : 0,
+	       (double)hist_pct(h, 0.10) * scale,
+	       (double)hist_pct(h, 0.50) * scale,
+	       (double)hist_pct(h, 0.90) * scale, (double)h->max * scale);
+}
+
+static void out_stats(const State *s)
+{
+	out_hist("IOI", &s->st_ioi, 1e-3);
+	out_hist("SPREAD", &s->st_spread, 1e-3);
+	out_hist("VELOCITY", &s->st_vel, 1.0);
+	out_hist("DURATION", &s->st_dur, 1e-3);
+	fflush(stdout);
+}
+
+static void note_pressed(State *s, unsigned char note, const RawEvent *ev)
+{
+	stats_onset(s, ev->time_us, ev->msg[2]);
+	if (!note_test(s->held, note)) {
+		note_set(s->held, note);
+		s->n_held++;
+		s->on_us[note] = ev->time_us;
+	}
+	if (!note_test(s->struck, note)) {
+		note_set(s->struck, note);
+		s->on_ms[note] = ev->time_ms;
+	}
+}
+
+/* Emit the notes struck since the held set was last empty as CHORD
+   lines: a note starts a new chord when it was struck more than
+   chord_spread_ms after the first note of the current one */
+static void out_chords(State *s)
+{
+	unsigned char notes[N_NOTES];
+	int n = 0;
+	for (int i = 0; i < N_NOTES; i++)
+		if (note_test(s->struck, (unsigned char)i))
+			notes[n++] = (unsigned char)i;
+
+	/* Stable insertion sort by onset, so equal onsets stay in pitch
+	   order; n is the size of a phrase of held notes, a few at most */
+	for (int i = 1; i < n; i++) {
+		unsigned char v = notes[i];
+		int j = i;
+		while (j > 0 && s->on_ms[notes[j - 1]] > s->on_ms[v]) {
+			notes[j] = notes[j - 1];
+			j--;
 		}
+		notes[j] = v;
 	}
+
+	for (int a = 0; a < n;) {
+		int64_t first = s->on_ms[notes[a]], last = first, release = 0;
+		uint64_t group[N_NOTES / 64] = {0};
+		int b = a;
+		for (; b < n; b++) {
+			if (s->on_ms[notes[b]] - first > s->chord_spread_ms)
+				break;
+			last = s->on_ms[notes[b]];
+			if (s->off_ms[notes[b]] > release)
+				release = s->off_ms[notes[b]];
+			note_set(group, notes[b]);
+		}
+		printf("CHORD %" PRId64 " %" PRId64 " %" PRId64, first, last,
+		       release);
+		for (int i = 0; i < N_NOTES; i++) {
+			if (note_test(group, (unsigned char)i)) {
+				char name[16];
+				note_to_lily((unsigned char)i, name,
+					     sizeof(name));
+				printf(" %s", name);
+			}
+		}
+		printf("\n");
+		a = b;
+	}
+	memset(s->struck, 0, sizeof(s->struck));
+}
+
+static void note_released(State *s, unsigned char note, const RawEvent *ev)
+{
+	if (!note_test(s->held, note))
+		return;
+	note_clear(s->held, note);
+	s->n_held--;
+	hist_add(&s->st_dur, ev->time_us - s->on_us[note]);
+	s->off_ms[note] = ev->time_ms;
+	if (s->n_held == 0 && s->chords)
+		out_chords(s);
 }
 
 /* ------------------------------------------------------------------ */
 /* MIDI callback – runs in RtMidi's background thread.                */
 /*                                                                     */
-/* All message handling is done here. You cannot mix the callback API  */
-/* with rtmidi_in_get_message() – calling getMessage() when a callback */
-/* is set produces the "a user callback is currently set" warning and  */
-/* returns nothing. The self-pipe byte just wakes poll() on the main   */
-/* thread so it can react to stdin commands without busy-waiting; the  */
-/* actual MIDI work is already done before that byte is written.       */
+/* The callback does no formatting or stdio: it timestamps the message */
+/* and pushes it into its input's SPSC ring, then wakes the main poll()*/
+/* with a self-pipe byte, but only if that ring was empty before the   */
+/* push. The main loop drains all rings completely on every wakeup, so */
+/* a non-empty ring always has a wakeup pending. The seq_cst store of  */
+/* ring_head followed by the load of ring_tail (mirrored in            */
+/* drain_events) makes sure that either the callback sees the ring     */
+/* drained and wakes main, or main sees the new event before going     */
+/* back to sleep.                                                      */
+/*                                                                     */
+/* You cannot mix the callback API with rtmidi_in_get_message() –      */
+/* calling getMessage() when a callback is set produces the "a user    */
+/* callback is currently set" warning and returns nothing.             */
 /* ------------------------------------------------------------------ */
 
+/* Event time from the driver's delta stamp; see TIMESTAMPS */
+static int64_t event_time_us(Input *in, double stamp)
+{
+	int64_t now = mono_us();
+	int64_t t = now;
+	if (in->last_us)
+		t = in->last_us + (int64_t)(stamp * 1e6 + 0.5);
+	if (t > now || now - t > RESYNC_US)
+		t = now;
+	in->last_us = t;
+	return t;
+}
+
+static int msg_type(unsigned char status)
+{
+	if (status < 0xF0)
+		return (status & 0xE0U) == 0x80 ? CNT_NOTE : CNT_CHANNEL;
+	switch (status) {
+	case 0xF0:
+		return CNT_SYSEX;
+	case 0xF1:
+	case 0xF8:
+		return CNT_CLOCK;
+	case 0xFE:
+		return CNT_SENSE;
+	default:
+		return CNT_SYSTEM;
+	}
+}
+
+static int filtered(int filter, int type)
+{
+	return (type == CNT_SYSEX && (filter & FILTER_SYSEX)) ||
+	       (type == CNT_CLOCK && (filter & FILTER_CLOCK)) ||
+	       (type == CNT_SENSE && (filter & FILTER_SENSE));
+}
+
 static void midi_callback(double stamp, const unsigned char *msg, size_t size,
 			  void *userdata)
 {
-	(void)stamp;
-	State *s = (State *)userdata;
+	Input *in = (Input *)userdata;
+	State *s = in->s;
+	int64_t t_us = event_time_us(in, stamp);
 
-	if (size < 3)
-		goto wake;
+	if (size == 0)
+		return;
 
-	{
-		unsigned char status = msg[0] & 0xF0U;
-		unsigned char note = msg[1];
-		unsigned char velocity = msg[2];
-		int changed = 0;
+	/* Count, then drop what the driver did not filter already; only
+	   channel messages wake the main loop */
+	int type = msg_type(msg[0]);
+	__atomic_fetch_add(&s->counts[type], 1, __ATOMIC_RELAXED);
+	if (filtered(__atomic_load_n(&s->filter, __ATOMIC_RELAXED), type))
+		return;
 
-		if (status == 0x90 && velocity > 0) {
-			add_pressed_note(s, note);
-			out_note_on(note, velocity);
-			changed = 1;
-		} else if (status == 0x80 ||
-			   (status == 0x90 && velocity == 0)) {
-			remove_pressed_note(s, note);
-			out_note_off(note);
-			changed = 1;
-		}
+	/* Forward raw bytes to output if enabled */
+	if (size >= 3 && __atomic_load_n(&s->forward, __ATOMIC_RELAXED))
+		fwd_push(s, in, msg, size);
 
-		(void)changed;
+	if (type != CNT_NOTE && type != CNT_CHANNEL)
+		return;
+	if (size > sizeof(in->ring[0].msg))
+		return;
 
-		/* Forward raw bytes to output if enabled */
-		if (s->forward && s->midi_out)
-			rtmidi_out_send_message(s->midi_out, msg, (int)size);
+	unsigned int head = in->ring_head;
+	if (head - __atomic_load_n(&in->ring_tail, __ATOMIC_ACQUIRE) ==
+	    RING_SZ) {
+		__atomic_store_n(&in->ring_dropped, in->ring_dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
 	}
 
-wake:
-	/* Wake the main poll() so it can handle any pending stdin too */
-	(void)write(s->pipe_w, "!", 1);
+	RawEvent *ev = &in->ring[head % RING_SZ];
+	ev->time_ms = now_ms();
+	ev->time_us = t_us;
+	ev->len = (unsigned char)size;
+	memcpy(ev->msg, msg, size);
+	__atomic_store_n(&in->ring_head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&in->ring_tail, __ATOMIC_SEQ_CST) == head) {
+		__atomic_fetch_add(&s->wakeups, 1, __ATOMIC_RELAXED);
+		(void)write(s->pipe_w, "!", 1);
+	}
+}
+
+/* Main thread: format one input event */
+static void rec_push(Recorder *r, const RawEvent *ev);
+
+static void handle_event(State *s, const RawEvent *ev, int dev)
+{
+	if (s->recording)
+		rec_push(&s->rec, ev);
+
+	if (ev->len < 3)
+		return;
+
+	unsigned char status = ev->msg[0] & 0xF0U;
+	unsigned char note = ev->msg[1] & 0x7FU;
+	unsigned char velocity = ev->msg[2];
+
+	if (status == 0x90 && velocity > 0) {
+		note_pressed(s, note, ev);
+		out_note_on(note, velocity, ev->time_ms, ev->time_us, dev);
+	} else if (status == 0x80 || (status == 0x90 && velocity == 0)) {
+		out_note_off(note, ev->time_ms, ev->time_us, dev);
+		note_released(s, note, ev);
+	}
+}
+
+static void stop_player(State *s);
+
+/* Main thread: format every queued event, then write them in one go.
+   The rings are merged by event time: each step takes the earliest head
+   among all inputs, so events that arrived together come out in order.
+   Nothing is held back for inputs that have not delivered yet, which
+   would add latency; an event arriving after a later one was written
+   keeps its own MONO_US. */
+static void drain_events(State *s)
+{
+	for (;;) {
+		Input *best = NULL;
+		for (int i = 0; i < MAX_INPUTS; i++) {
+			Input *in = &s->in[i];
+			if (!in->used ||
+			    __atomic_load_n(&in->ring_head, __ATOMIC_SEQ_CST) ==
+				in->ring_tail)
+				continue;
+			if (!best ||
+			    in->ring[in->ring_tail % RING_SZ].time_us <
+				best->ring[best->ring_tail % RING_SZ].time_us)
+				best = in;
+		}
+		if (!best)
+			break;
+		unsigned int tail = best->ring_tail;
+		handle_event(s, &best->ring[tail % RING_SZ],
+			     (int)(best - s->in));
+		__atomic_store_n(&best->ring_tail, tail + 1, __ATOMIC_SEQ_CST);
+	}
+
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		Input *in = &s->in[i];
+		unsigned long dropped =
+		    __atomic_load_n(&in->ring_dropped, __ATOMIC_RELAXED);
+		if (dropped != in->drop_reported) {
+			out_status("MIDI input overrun: %lu events dropped "
+				   "(DEV:%d)",
+				   dropped - in->drop_reported, i);
+			in->drop_reported = dropped;
+		}
+	}
+	if (s->play_active && __atomic_load_n(&s->play_done, __ATOMIC_ACQUIRE)) {
+		stop_player(s);
+		out_status("MIDI file finished: %s", s->play_path);
+	}
+	fflush(stdout);
 }
 
 /* Forward declarations (open_midi_in/out are needed by restore_from_log) */
-static void open_midi_in(State *s, int idx);
+static void open_midi_in(State *s, int idx, int add);
 static void open_midi_out(State *s, int idx);
 
 /* ------------------------------------------------------------------ */
@@ -347,6 +1387,39 @@ static void open_midi_out(State *s, int idx);
 /*   FORWARD 1                                                         */
 /* ------------------------------------------------------------------ */
 
+/* "CLOCK SENSE", or "NONE" for an empty filter */
+static void filter_names(int filter, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s%s%s%s", filter & FILTER_CLOCK ? "CLOCK " : "",
+		 filter & FILTER_SENSE ? "SENSE " : "",
+		 filter & FILTER_SYSEX ? "SYSEX " : "", filter ? "" : "NONE");
+	size_t n = strlen(buf);
+	if (n && buf[n - 1] == ' ')
+		buf[n - 1] = '\0';
+}
+
+/* Parse space-separated filter types; returns 0 on an unknown word */
+static int parse_filter(const char *args, int *filter)
+{
+	char buf[CMD_BUF_SZ];
+	strncpy(buf, args, CMD_BUF_SZ - 1);
+	buf[CMD_BUF_SZ - 1] = '\0';
+
+	int f = 0;
+	for (char *w = strtok(buf, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+		if (strcmp(w, "CLOCK") == 0)
+			f |= FILTER_CLOCK;
+		else if (strcmp(w, "SENSE") == 0)
+			f |= FILTER_SENSE;
+		else if (strcmp(w, "SYSEX") == 0)
+			f |= FILTER_SYSEX;
+		else if (strcmp(w, "NONE") != 0)
+			return 0;
+	}
+	*filter = f;
+	return 1;
+}
+
 static void save_log(const State *s)
 {
 	FILE *f = fopen(LOG_PATH, "w");
@@ -354,23 +1427,85 @@ static void save_log(const State *s)
 		out_status("Warning: could not write %s", LOG_PATH);
 		return;
 	}
-	if (s->in_idx >= 0)
-		fprintf(f, "IN %s\n", s->dev_names[s->in_idx]);
+	/* The saved inputs include devices that are currently absent or
+	   replaced by a file input */
+	for (int i = 0; i < s->n_saved_in; i++)
+		fprintf(f, "IN %s\n", s->saved_in[i]);
 	if (s->out_idx >= 0)
 		fprintf(f, "OUT %s\n", s->dev_names[s->out_idx]);
+	else if (s->saved_out_name[0])
+		fprintf(f, "OUT %s\n", s->saved_out_name);
 	fprintf(f, "FORWARD %d\n", s->forward);
+	char names[64];
+	filter_names(s->filter, names, sizeof(names));
+	fprintf(f, "FILTER %s\n", names);
+	fprintf(f, "RECORD %d\n", s->record);
+	fprintf(f, "CHORD %d %d\n", s->chords, s->chord_spread_ms);
+	fprintf(f, "RATE %d %d\n", s->out_rate, s->out_burst);
 	fclose(f);
 }
 
-/* Find device index by exact name match; returns -1 if not found */
+/* Length of a device name without the " <client>:<port>" suffix that
+   ALSA port names end in; the client number changes on replugging */
+static size_t name_stem(const char *name)
+{
+	size_t n = strlen(name), i = n;
+	int colon = 0;
+	while (i > 0 && (name[i - 1] == ':' ||
+			 (name[i - 1] >= '0' && name[i - 1] <= '9'))) {
+		colon += name[i - 1] == ':';
+		i--;
+	}
+	return colon == 1 && i > 0 && i < n && name[i - 1] == ' ' ? i - 1 : n;
+}
+
+static int same_device(const char *a, const char *b)
+{
+	size_t n = name_stem(a);
+	return n == name_stem(b) && strncmp(a, b, n) == 0;
+}
+
+/* Find device index by name, ignoring the ALSA client number; returns
+   -1 if not found */
 static int find_device_by_name(const State *s, const char *name)
 {
 	for (int i = 0; i < s->n_devices; i++)
 		if (strcmp(s->dev_names[i], name) == 0)
 			return i;
+	for (int i = 0; i < s->n_devices; i++)
+		if (same_device(s->dev_names[i], name))
+			return i;
 	return -1;
 }
 
+/* Add an input to the saved list, or update its name if the device is
+   there already */
+static void save_in_name(State *s, const char *name)
+{
+	int i = 0;
+	while (i < s->n_saved_in && !same_device(s->saved_in[i], name))
+		i++;
+	if (i == MAX_INPUTS)
+		return;
+	strncpy(s->saved_in[i], name, MAX_NAME_LEN - 1);
+	s->saved_in[i][MAX_NAME_LEN - 1] = '\0';
+	if (i == s->n_saved_in)
+		s->n_saved_in++;
+}
+
+static void forget_in_name(State *s, const char *name)
+{
+	for (int i = 0; i < s->n_saved_in; i++) {
+		if (same_device(s->saved_in[i], name)) {
+			memmove(s->saved_in[i], s->saved_in[i + 1],
+				(size_t)(s->n_saved_in - i - 1) *
+				    sizeof(s->saved_in[0]));
+			s->n_saved_in--;
+			return;
+		}
+	}
+}
+
 static void load_log(State *s)
 {
 	FILE *f = fopen(LOG_PATH, "r");
@@ -385,14 +1520,27 @@ static void load_log(State *s)
 			*nl = '\0';
 
 		char name[MAX_NAME_LEN];
-		int fwd;
+		int fwd, rec, chords, spread, rate, burst;
 
 		if (sscanf(line, "IN %255[^\n]", name) == 1)
-			strncpy(s->saved_in_name, name, MAX_NAME_LEN - 1);
+			save_in_name(s, name);
 		else if (sscanf(line, "OUT %255[^\n]", name) == 1)
-			strncpy(s->saved_out_name, name, MAX_NAME_LEN - 1);
+			snprintf(s->saved_out_name,
+				 sizeof s->saved_out_name, "%s", name);
 		else if (sscanf(line, "FORWARD %d", &fwd) == 1)
 			s->forward = fwd;
+		else if (sscanf(line, "RECORD %d", &rec) == 1)
+			s->record = rec;
+		else if (sscanf(line, "CHORD %d %d", &chords, &spread) == 2) {
+			s->chords = chords;
+			s->chord_spread_ms = spread;
+		} else if (sscanf(line, "RATE %d %d", &rate, &burst) == 2 &&
+			   rate >= 0 && burst > 0) {
+			s->out_rate = rate;
+			s->out_burst = burst;
+		}
+		else if (strncmp(line, "FILTER ", 7) == 0)
+			parse_filter(line + 7, &s->filter);
 	}
 	fclose(f);
 }
@@ -400,13 +1548,13 @@ static void load_log(State *s)
 /* Called after refresh_devices() to reopen ports saved in the log */
 static void restore_from_log(State *s)
 {
-	if (s->saved_in_name[0]) {
-		int idx = find_device_by_name(s, s->saved_in_name);
+	for (int i = 0; i < s->n_saved_in; i++) {
+		int idx = find_device_by_name(s, s->saved_in[i]);
 		if (idx >= 0)
-			open_midi_in(s, idx);
+			open_midi_in(s, idx, 1);
 		else
 			out_status("Saved IN device not found: %s",
-				   s->saved_in_name);
+				   s->saved_in[i]);
 	}
 	if (s->saved_out_name[0]) {
 		int idx = find_device_by_name(s, s->saved_out_name);
@@ -424,7 +1572,8 @@ static void restore_from_log(State *s)
 /* Device management                                                   */
 /* ------------------------------------------------------------------ */
 
-static void refresh_devices(State *s)
+/* Enumerate ports into dev_names without reporting them */
+static void probe_devices(State *s)
 {
 	s->n_devices = 0;
 
@@ -445,29 +1594,88 @@ static void refresh_devices(State *s)
 	rtmidi_in_free(probe);
 
 	if (s->n_devices == 0) {
-		strncpy(s->dev_names[0], "(no MIDI devices)", MAX_NAME_LEN - 1);
+		strncpy(s->dev_names[0], NO_DEVICES, MAX_NAME_LEN - 1);
 		s->dev_names[0][MAX_NAME_LEN - 1] = '\0';
 		s->n_devices = 1;
 	}
+}
 
+static void refresh_devices(State *s)
+{
+	probe_devices(s);
 	out_devices(s);
 	out_status("MIDI forward: %s", s->forward ? "ON" : "OFF");
 }
 
-static void open_midi_in(State *s, int idx)
+/* Claim a free input slot, cleared, with its ring empty; main thread */
+static Input *alloc_input(State *s)
+{
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		Input *in = &s->in[i];
+		if (!in->used) {
+			memset(in, 0, sizeof(*in));
+			in->s = s;
+			in->idx = -1;
+			return in;
+		}
+	}
+	out_status("Too many MIDI inputs (max %d)", MAX_INPUTS);
+	return NULL;
+}
+
+/* Close one input; its callback has stopped when this returns */
+static void close_input(State *s, Input *in)
+{
+	if (!in->h) {
+		stop_player(s);
+		return;
+	}
+	rtmidi_close_port(in->h);
+	rtmidi_in_free(in->h);
+	in->h = NULL;
+	in->used = 0;
+}
+
+/* Close every input; returns how many were open */
+static int close_inputs(State *s)
+{
+	int n = 0;
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		if (s->in[i].used) {
+			close_input(s, &s->in[i]);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Open device idx as an input, in addition to the open ones if add is
+   set, else in place of them */
+static void open_midi_in(State *s, int idx, int add)
 {
 	if (idx < 0 || idx >= s->n_devices) {
 		out_status("Invalid IN device index");
 		return;
 	}
 
-	if (s->midi_in) {
-		rtmidi_close_port(s->midi_in);
-		rtmidi_in_free(s->midi_in);
-		s->midi_in = NULL;
-		s->in_idx = -1;
+	if (add) {
+		for (int i = 0; i < MAX_INPUTS; i++) {
+			if (s->in[i].used && s->in[i].idx == idx) {
+				out_status("MIDI input already open: %s "
+					   "(DEV:%d)",
+					   s->dev_names[idx], i);
+				return;
+			}
+		}
+	} else {
+		close_inputs(s);
+		s->n_saved_in = 0;
 	}
 
+	Input *in = alloc_input(s);
+	if (!in)
+		return;
+
 	RtMidiInPtr h = rtmidi_in_create_default();
 	if (!h || !h->ok) {
 		out_status("Failed to create MIDI input");
@@ -476,25 +1684,50 @@ static void open_midi_in(State *s, int idx)
 
 	/* Register callback before opening so no messages are missed.
 	   All message handling happens inside the callback; we never call
-	   rtmidi_in_get_message() since that conflicts with callback mode. */
-	rtmidi_in_set_callback(h, midi_callback, s);
+	   rtmidi_in_get_message() since that conflicts with callback mode.
+	   The slot is in use from here on, so drain_events sees whatever
+	   the callback pushes. */
+	in->used = 1;
+	rtmidi_in_set_callback(h, midi_callback, in);
 
 	rtmidi_open_port(h, (unsigned int)idx, "midi_c_in");
-	rtmidi_in_ignore_types(h, 0, 0,
-			       0); /* don't ignore sysex/timing/sense */
+	rtmidi_in_ignore_types(h, s->filter & FILTER_SYSEX,
+			       s->filter & FILTER_CLOCK,
+			       s->filter & FILTER_SENSE);
 
 	if (!h->ok) {
 		out_status("Failed to open MIDI input port");
 		rtmidi_in_free(h);
+		in->used = 0;
 		return;
 	}
 
-	s->midi_in = h;
-	s->in_idx = idx;
-	out_status("MIDI input opened: %s", s->dev_names[idx]);
+	in->h = h;
+	in->idx = idx;
+	strncpy(in->name, s->dev_names[idx], MAX_NAME_LEN - 1);
+	save_in_name(s, in->name);
+	out_status("MIDI input opened: %s (DEV:%d)", in->name,
+		   (int)(in - s->in));
 }
 
-static void open_midi_out(State *s, int idx)
+/* MIDI IN REMOVE: close device idx and drop it from the saved list */
+static void remove_midi_in(State *s, int idx)
+{
+	if (idx < 0 || idx >= s->n_devices) {
+		out_status("Invalid IN device index");
+		return;
+	}
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		if (s->in[i].used && s->in[i].idx == idx) {
+			close_input(s, &s->in[i]);
+			out_status("MIDI input closed: %s (DEV:%d)",
+				   s->dev_names[idx], i);
+		}
+	}
+	forget_in_name(s, s->dev_names[idx]);
+}
+
+static void open_midi_out(State *s, int idx)
 {
 	if (idx < 0 || idx >= s->n_devices) {
 		out_status("Invalid OUT device index");
@@ -502,9 +1735,11 @@ static void open_midi_out(State *s, int idx)
 	}
 
 	if (s->midi_out) {
+		pthread_mutex_lock(&s->out_mu);
 		rtmidi_close_port(s->midi_out);
 		rtmidi_out_free(s->midi_out);
 		s->midi_out = NULL;
+		pthread_mutex_unlock(&s->out_mu);
 		s->out_idx = -1;
 	}
 
@@ -522,30 +1757,583 @@ static void open_midi_out(State *s, int idx)
 		return;
 	}
 
+	pthread_mutex_lock(&s->out_mu);
 	s->midi_out = h;
+	pthread_mutex_unlock(&s->out_mu);
+	set_out_rate(s, s->out_rate, s->out_burst); /* full bucket */
 	s->out_idx = idx;
+	strncpy(s->saved_out_name, s->dev_names[idx], MAX_NAME_LEN - 1);
 	out_status("MIDI output opened: %s", s->dev_names[idx]);
 }
 
 static void close_midi_in(State *s)
 {
-	if (s->midi_in) {
-		rtmidi_close_port(s->midi_in);
-		rtmidi_in_free(s->midi_in);
-		s->midi_in = NULL;
-		s->in_idx = -1;
+	if (close_inputs(s))
 		out_status("MIDI input disconnected");
-	} else {
+	else
 		out_status("No MIDI input connected");
+}
+
+/* ------------------------------------------------------------------ */
+/* File input                                                          */
+/* ------------------------------------------------------------------ */
+
+static uint32_t be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Variable-length quantity; returns -1 past end */
+static long read_vlq(const unsigned char **p, const unsigned char *end)
+{
+	long v = 0;
+	for (int i = 0; i < 4 && *p < end; i++) {
+		unsigned char b = *(*p)++;
+		v = (v << 7) | (b & 0x7F);
+		if (!(b & 0x80))
+			return v;
+	}
+	return -1;
+}
+
+static int cmp_smf_event(const void *a, const void *b)
+{
+	const SmfEvent *x = a, *y = b;
+	if (x->tick != y->tick)
+		return x->tick < y->tick ? -1 : 1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+typedef struct {
+	uint32_t tick;
+	uint32_t seq;
+	uint32_t us_per_qn;
+} Tempo;
+
+static int cmp_tempo(const void *a, const void *b)
+{
+	const Tempo *x = a, *y = b;
+	if (x->tick != y->tick)
+		return x->tick < y->tick ? -1 : 1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Parse one MTrk chunk, appending channel messages and tempo changes;
+   returns -1 on a malformed track */
+static int parse_track(const unsigned char *p, const unsigned char *end,
+		       SmfEvent **ev, int *n_ev, int *cap_ev, Tempo **tempo,
+		       int *n_tempo, uint32_t *seq, uint32_t *end_tick)
+{
+	uint32_t tick = 0;
+	unsigned char running = 0;
+
+	while (p < end) {
+		long delta = read_vlq(&p, end);
+		if (delta < 0 || p >= end)
+			return -1;
+		tick += (uint32_t)delta;
+		if (tick > *end_tick)
+			*end_tick = tick;
+
+		unsigned char status = *p;
+		if (status & 0x80)
+			p++;
+		else if (running)
+			status = running;
+		else
+			return -1;
+
+		if (status == 0xFF) { /* meta */
+			if (p >= end)
+				return -1;
+			unsigned char type = *p++;
+			long len = read_vlq(&p, end);
+			if (len < 0 || len > end - p)
+				return -1;
+			if (type == 0x51 && len == 3) {
+				Tempo *t = realloc(
+				    *tempo, (size_t)(*n_tempo + 1) * sizeof **tempo);
+				if (!t)
+					return -1;
+				*tempo = t;
+				t[*n_tempo].tick = tick;
+				t[*n_tempo].seq = (*seq)++;
+				t[*n_tempo].us_per_qn = (uint32_t)p[0] << 16 |
+							(uint32_t)p[1] << 8 | p[2];
+				(*n_tempo)++;
+			}
+			p += len;
+			if (type == 0x2F)
+				break;
+			continue;
+		}
+		if (status == 0xF0 || status == 0xF7) { /* sysex: skipped */
+			long len = read_vlq(&p, end);
+			if (len < 0 || len > end - p)
+				return -1;
+			p += len;
+			continue;
+		}
+		if (status >= 0xF0) /* no other system messages in SMF */
+			return -1;
+
+		running = status;
+		int n_data = (status & 0xE0) == 0xC0 ? 1 : 2;
+		if (end - p < n_data)
+			return -1;
+		if (*n_ev == *cap_ev) {
+			int cap = *cap_ev ? *cap_ev * 2 : 1024;
+			SmfEvent *e = realloc(*ev, (size_t)cap * sizeof **ev);
+			if (!e)
+				return -1;
+			*ev = e;
+			*cap_ev = cap;
+		}
+		SmfEvent *e = &(*ev)[(*n_ev)++];
+		e->tick = tick;
+		e->seq = (*seq)++;
+		e->len = (unsigned char)(1 + n_data);
+		e->msg[0] = status;
+		e->msg[1] = p[0] & 0x7F;
+		e->msg[2] = n_data == 2 ? (p[1] & 0x7F) : 0;
+		p += n_data;
+	}
+	return 0;
+}
+
+/* Load a Standard MIDI File and convert ticks to microseconds with its
+   tempo map; returns NULL after reporting the problem */
+static SmfEvent *load_smf(const char *path, int *n_out, int64_t *len_us)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		out_status("Cannot open MIDI file: %s", path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	unsigned char *data = size > 0 ? malloc((size_t)size) : NULL;
+	if (!data || fread(data, 1, (size_t)size, f) != (size_t)size) {
+		fclose(f);
+		free(data);
+		out_status("Cannot read MIDI file: %s", path);
+		return NULL;
+	}
+	fclose(f);
+
+	const unsigned char *p = data, *end = data + size;
+	if (size < 14 || memcmp(p, "MThd", 4) != 0 || be32(p + 4) < 6) {
+		free(data);
+		out_status("Not a Standard MIDI File: %s", path);
+		return NULL;
+	}
+	unsigned int ntrks = (unsigned int)(p[10] << 8 | p[11]);
+	unsigned int division = (unsigned int)(p[12] << 8 | p[13]);
+	p += 8 + be32(p + 4);
+
+	SmfEvent *ev = NULL;
+	Tempo *tempo = NULL;
+	int n_ev = 0, cap_ev = 0, n_tempo = 0, bad = 0;
+	uint32_t seq = 0, end_tick = 0;
+	for (unsigned int t = 0; t < ntrks && end - p >= 8; t++) {
+		uint32_t len = be32(p + 4);
+		if (memcmp(p, "MTrk", 4) != 0 || len > (uint32_t)(end - p - 8)) {
+			bad = 1;
+			break;
+		}
+		if (parse_track(p + 8, p + 8 + len, &ev, &n_ev, &cap_ev, &tempo,
+				&n_tempo, &seq, &end_tick) != 0)
+			bad = 1;
+		p += 8 + len;
+	}
+	free(data);
+	if (bad || n_ev == 0 || division == 0) {
+		free(ev);
+		free(tempo);
+		out_status("%s MIDI file: %s", n_ev ? "Malformed" : "Empty",
+			   path);
+		return NULL;
+	}
+
+	/* Tempo changes can come from any track (format 1: usually the
+	   first), so convert after merging everything by tick */
+	qsort(ev, (size_t)n_ev, sizeof *ev, cmp_smf_event);
+	if (n_tempo)
+		qsort(tempo, (size_t)n_tempo, sizeof *tempo, cmp_tempo);
+
+	double us_per_tick;
+	int ti = 0;
+	uint32_t base_tick = 0;
+	double base_us = 0;
+	if (division & 0x8000) { /* SMPTE: -fps, ticks per frame */
+		int fps = -(int)(signed char)(division >> 8);
+		us_per_tick = 1e6 / (fps * (double)(division & 0xFF));
+		n_tempo = 0;
+	} else {
+		us_per_tick = 500000.0 / division;
+	}
+	for (int i = 0; i <= n_ev; i++) {
+		uint32_t tick = i < n_ev ? ev[i].tick : end_tick;
+		while (ti < n_tempo && tempo[ti].tick <= tick) {
+			base_us += (tempo[ti].tick - base_tick) * us_per_tick;
+			base_tick = tempo[ti].tick;
+			us_per_tick = (double)tempo[ti].us_per_qn / division;
+			ti++;
+		}
+		int64_t t_us =
+		    (int64_t)(base_us + (tick - base_tick) * us_per_tick + 0.5);
+		if (i < n_ev)
+			ev[i].t_us = t_us;
+		else
+			*len_us = t_us;
+	}
+	free(tempo);
+	*n_out = n_ev;
+	return ev;
+}
+
+/* Wait until CLOCK_MONOTONIC reaches due_us; returns 1 if told to stop */
+static int player_wait(State *s, int64_t due_us)
+{
+	struct timespec ts = {(time_t)(due_us / 1000000),
+			      (long)(due_us % 1000000) * 1000};
+	int stop;
+
+	pthread_mutex_lock(&s->play_mu);
+	while (!s->play_stop &&
+	       pthread_cond_timedwait(&s->play_cv, &s->play_mu, &ts) !=
+		   ETIMEDOUT)
+		;
+	stop = s->play_stop;
+	pthread_mutex_unlock(&s->play_mu);
+	return stop;
+}
+
+/* Player thread: feeds the file to midi_callback at tempo-map times */
+static void *thr_player(void *arg)
+{
+	State *s = (State *)arg;
+	double speed = s->play_speed;
+	int64_t start = mono_us(), base_us = 0, prev_us = 0;
+
+	do {
+		for (int i = 0; i < s->play_n; i++) {
+			const SmfEvent *e = &s->play_ev[i];
+			int64_t file_us = base_us + e->t_us;
+			int64_t due = start + (int64_t)((double)file_us / speed);
+			if (player_wait(s, due))
+				return NULL;
+			double stamp = (double)(file_us - prev_us) / speed / 1e6;
+			prev_us = file_us;
+			midi_callback(stamp, e->msg, e->len, s->play_in);
+		}
+		base_us += s->play_len_us;
+	} while (s->play_loop);
+
+	__atomic_store_n(&s->play_done, 1, __ATOMIC_RELEASE);
+	(void)write(s->pipe_w, "!", 1);
+	return NULL;
+}
+
+static void stop_player(State *s)
+{
+	if (!s->play_active)
+		return;
+	pthread_mutex_lock(&s->play_mu);
+	s->play_stop = 1;
+	pthread_cond_signal(&s->play_cv);
+	pthread_mutex_unlock(&s->play_mu);
+	pthread_join(s->play_thread, NULL);
+	free(s->play_ev);
+	s->play_ev = NULL;
+	s->play_in->used = 0;
+	s->play_in = NULL;
+	s->play_active = 0;
+}
+
+/* "file:<path>[@<speed>][,loop]" */
+static void open_file_in(State *s, const char *spec)
+{
+	char path[MAX_NAME_LEN];
+	strncpy(path, spec, MAX_NAME_LEN - 1);
+	path[MAX_NAME_LEN - 1] = '\0';
+
+	int loop = 0;
+	double speed = 1.0;
+	size_t n = strlen(path);
+	if (n > 5 && strcmp(path + n - 5, ",loop") == 0) {
+		loop = 1;
+		path[n - 5] = '\0';
+	}
+	char *at = strrchr(path, '@');
+	if (at) {
+		char *endp;
+		speed = strtod(at + 1, &endp);
+		if (*endp || speed <= 0) {
+			out_status("Invalid playback speed: %s", at + 1);
+			return;
+		}
+		*at = '\0';
 	}
+
+	int n_ev;
+	int64_t len_us = 0;
+	SmfEvent *ev = load_smf(path, &n_ev, &len_us);
+	if (!ev)
+		return;
+	if (loop && len_us <= 0) {
+		out_status("Cannot loop a MIDI file of zero length: %s", path);
+		free(ev);
+		return;
+	}
+
+	close_inputs(s);
+	Input *in = alloc_input(s);
+	if (!in) {
+		free(ev);
+		return;
+	}
+
+	s->play_in = in;
+	s->play_ev = ev;
+	s->play_n = n_ev;
+	s->play_len_us = len_us;
+	s->play_speed = speed;
+	s->play_loop = loop;
+	s->play_stop = 0;
+	s->play_done = 0;
+	snprintf(s->play_path, sizeof s->play_path, "%s", path);
+	in->used = 1;
+	if (pthread_create(&s->play_thread, NULL, thr_player, s) != 0) {
+		free(ev);
+		s->play_ev = NULL;
+		s->play_in = NULL;
+		in->used = 0;
+		out_status("Failed to start MIDI file player");
+		return;
+	}
+	s->play_active = 1;
+	out_status("MIDI input opened: file:%s (%d events, %.1f s, speed %g%s) "
+		   "(DEV:%d)",
+		   path, n_ev, (double)len_us / 1e6, speed, loop ? ", loop" : "",
+		   (int)(in - s->in));
+}
+
+/* ------------------------------------------------------------------ */
+/* Recording                                                           */
+/* ------------------------------------------------------------------ */
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static int put_vlq(unsigned char *p, uint32_t v)
+{
+	unsigned char tmp[4];
+	int n = 0;
+	do {
+		tmp[n++] = (unsigned char)(v & 0x7F);
+		v >>= 7;
+	} while (v && n < 4);
+	for (int i = 0; i < n; i++)
+		p[i] = (unsigned char)(tmp[n - 1 - i] | (i < n - 1 ? 0x80 : 0));
+	return n;
+}
+
+static void rec_write(Recorder *r, const unsigned char *p, size_t n)
+{
+	fwrite(p, 1, n, r->f);
+	r->trk_len += (uint32_t)n;
+}
+
+/* Writer thread: append one event with its delta time */
+static void rec_encode(Recorder *r, const RawEvent *ev)
+{
+	unsigned char buf[16];
+	int64_t tick = (ev->time_us - r->start_us) / REC_US_PER_TICK;
+	if (tick < r->last_tick)
+		tick = r->last_tick;
+	int64_t delta = tick - r->last_tick;
+	r->last_tick = tick;
+
+	/* Longer gaps than a 4-byte delta holds (~89 min) are bridged
+	   with empty text events */
+	while (delta > 0x0FFFFFFF) {
+		int n = put_vlq(buf, 0x0FFFFFFF);
+		buf[n++] = 0xFF;
+		buf[n++] = 0x01;
+		buf[n++] = 0x00;
+		rec_write(r, buf, (size_t)n);
+		delta -= 0x0FFFFFFF;
+	}
+	int n = put_vlq(buf, (uint32_t)delta);
+	memcpy(buf + n, ev->msg, ev->len);
+	rec_write(r, buf, (size_t)n + ev->len);
+	r->events++;
+}
+
+/* Terminate the track and patch its length, then put the write position
+   back over the end-of-track event for the next append */
+static void rec_flush(Recorder *r)
+{
+	static const unsigned char eot[4] = {0x00, 0xFF, 0x2F, 0x00};
+	unsigned char len[4];
+	long pos = ftell(r->f);
+	fwrite(eot, 1, sizeof(eot), r->f);
+	put_be32(len, r->trk_len + (uint32_t)sizeof(eot));
+	fseek(r->f, 18, SEEK_SET);
+	fwrite(len, 1, sizeof(len), r->f);
+	fseek(r->f, pos, SEEK_SET);
+	fflush(r->f);
+}
+
+static void *thr_recorder(void *arg)
+{
+	Recorder *r = (Recorder *)arg;
+	RawEvent *batch = NULL;
+	int cap_batch = 0, dirty = 0;
+	int64_t flush_due = 0;
+
+	pthread_mutex_lock(&r->mu);
+	for (;;) {
+		if (r->n_queue == 0 && !r->stop) {
+			if (!dirty) {
+				pthread_cond_wait(&r->cv, &r->mu);
+				continue;
+			}
+			struct timespec ts = {(time_t)(flush_due / 1000000),
+					      (long)(flush_due % 1000000) *
+						  1000};
+			if (pthread_cond_timedwait(&r->cv, &r->mu, &ts) == 0)
+				continue;
+		}
+
+		/* Swap queues so the main thread can keep appending */
+		RawEvent *q = r->queue;
+		int n = r->n_queue, cap = r->cap_queue, stop = r->stop;
+		r->queue = batch;
+		r->cap_queue = cap_batch;
+		r->n_queue = 0;
+		batch = q;
+		cap_batch = cap;
+		pthread_mutex_unlock(&r->mu);
+
+		for (int i = 0; i < n; i++)
+			rec_encode(r, &batch[i]);
+		if (n > 0 && !dirty) {
+			dirty = 1;
+			flush_due = mono_us() + REC_FLUSH_US;
+		}
+		if (dirty && (stop || mono_us() >= flush_due)) {
+			rec_flush(r);
+			dirty = 0;
+		}
+
+		pthread_mutex_lock(&r->mu);
+		if (stop && r->n_queue == 0)
+			break;
+	}
+	pthread_mutex_unlock(&r->mu);
+	free(batch);
+	return NULL;
+}
+
+/* Main thread: queue an event for the writer */
+static void rec_push(Recorder *r, const RawEvent *ev)
+{
+	pthread_mutex_lock(&r->mu);
+	if (r->n_queue == r->cap_queue) {
+		int cap = r->cap_queue ? r->cap_queue * 2 : 256;
+		RawEvent *q = realloc(r->queue, (size_t)cap * sizeof(*q));
+		if (!q) {
+			pthread_mutex_unlock(&r->mu);
+			return;
+		}
+		r->queue = q;
+		r->cap_queue = cap;
+	}
+	r->queue[r->n_queue++] = *ev;
+	if (r->n_queue == 1)
+		pthread_cond_signal(&r->cv);
+	pthread_mutex_unlock(&r->mu);
+}
+
+static void rec_start(State *s)
+{
+	Recorder *r = &s->rec;
+	if (s->recording)
+		return;
+
+	mkdir("log", 0755);
+	mkdir(REC_DIR, 0755);
+	time_t now = time(NULL);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	snprintf(r->path, sizeof(r->path), REC_DIR "/%s.mid", stamp);
+
+	r->f = fopen(r->path, "wb");
+	if (!r->f) {
+		out_status("Cannot create %s", r->path);
+		return;
+	}
+
+	/* Header, then the tempo that makes one tick REC_US_PER_TICK */
+	unsigned char hdr[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1,
+			       REC_PPQ >> 8, REC_PPQ & 0xFF,
+			       'M', 'T', 'r', 'k', 0, 0, 0, 0};
+	unsigned char tempo[] = {0x00, 0xFF, 0x51, 0x03,
+				 (REC_US_PER_QN >> 16) & 0xFF,
+				 (REC_US_PER_QN >> 8) & 0xFF,
+				 REC_US_PER_QN & 0xFF};
+	fwrite(hdr, 1, sizeof(hdr), r->f);
+	r->trk_len = 0;
+	rec_write(r, tempo, sizeof(tempo));
+	rec_flush(r);
+
+	r->start_us = mono_us();
+	r->last_tick = 0;
+	r->events = 0;
+	r->stop = 0;
+	r->n_queue = 0;
+	if (pthread_create(&r->thread, NULL, thr_recorder, r) != 0) {
+		fclose(r->f);
+		out_status("Failed to start MIDI recorder");
+		return;
+	}
+	s->recording = 1;
+	out_status("MIDI recording to %s", r->path);
+}
+
+static void rec_stop(State *s)
+{
+	Recorder *r = &s->rec;
+	if (!s->recording)
+		return;
+	pthread_mutex_lock(&r->mu);
+	r->stop = 1;
+	pthread_cond_signal(&r->cv);
+	pthread_mutex_unlock(&r->mu);
+	pthread_join(r->thread, NULL);
+	fclose(r->f);
+	s->recording = 0;
+	out_status("MIDI recording stopped: %s (%ld events)", r->path,
+		   r->events);
 }
 
 static void close_midi_out(State *s)
 {
 	if (s->midi_out) {
+		pthread_mutex_lock(&s->out_mu);
 		rtmidi_close_port(s->midi_out);
 		rtmidi_out_free(s->midi_out);
 		s->midi_out = NULL;
+		pthread_mutex_unlock(&s->out_mu);
 		s->out_idx = -1;
 		out_status("MIDI output disconnected");
 	} else {
@@ -553,6 +2341,179 @@ static void close_midi_out(State *s)
 	}
 }
 
+/* ------------------------------------------------------------------ */
+/* Hotplug                                                             */
+/*                                                                     */
+/* The kernel announces every device change with a uevent on a netlink */
+/* socket, which poll() watches alongside stdin; a socket filter drops */
+/* the uevents of other subsystems in the kernel, so nothing wakes the */
+/* main loop while no sound device comes or goes.  A sound uevent    */
+/* arms a rescan HOTPLUG_SETTLE_US later (the poll() timeout), by when */
+/* the sequencer ports of a new card exist; the burst of uevents one   */
+/* plug produces collapses into that single rescan.                    */
+/* ------------------------------------------------------------------ */
+
+/* The mock backend replaces the socket with a pipe of fake uevents */
+#ifndef HOTPLUG_OPEN
+#define HOTPLUG_OPEN hotplug_open
+
+/* Accept a uevent only if "M=sound\0" (the tail of "SUBSYSTEM=sound")
+   starts at one of its first HOTPLUG_SCAN_LEN bytes.  Classic BPF cannot
+   loop, so the search is unrolled, two word compares and an accept per
+   offset.  A load past the end of the message makes the kernel drop it;
+   a message longer than the search is accepted, and hotplug_read()
+   checks the full key either way.  The kernel charges the program to
+   the socket's option memory (net.core.optmem_max), which bounds the
+   search; if it refuses the filter, every uevent is read, which is only
+   slower. */
+static void hotplug_filter(int fd)
+{
+	static const char key[8] = "M=sound";
+	static struct sock_filter prog[HOTPLUG_SCAN_LEN * 5 + 1];
+	struct sock_filter *f = prog;
+	uint32_t w[2];
+
+	for (int j = 0; j < 2; j++) /* BPF_ABS loads are big-endian */
+		w[j] = (uint32_t)(unsigned char)key[4 * j] << 24 |
+		       (uint32_t)(unsigned char)key[4 * j + 1] << 16 |
+		       (uint32_t)(unsigned char)key[4 * j + 2] << 8 |
+		       (uint32_t)(unsigned char)key[4 * j + 3];
+	for (int i = 0; i < HOTPLUG_SCAN_LEN; i++) {
+		/* on mismatch, skip to the next offset */
+		*f++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+						    (uint32_t)i);
+		*f++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						    w[0], 0, 3);
+		*f++ = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+						    (uint32_t)i + 4);
+		*f++ = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						    w[1], 0, 1);
+		*f++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+						    0xffffffff);
+	}
+	*f++ = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	struct sock_fprog fp = {(unsigned short)(f - prog), prog};
+	(void)setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof(fp));
+}
+
+static int hotplug_open(void)
+{
+	struct sockaddr_nl sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1; /* kernel uevents, not udev's re-broadcasts */
+
+	int fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+	hotplug_filter(fd);
+	return fd;
+}
+#endif
+
+/* Read all pending uevents; returns 1 if any is about a sound device.
+   A uevent is a sequence of NUL-terminated "KEY=value" strings. */
+static int hotplug_read(int fd)
+{
+	static char buf[HOTPLUG_BUF_SZ];
+	int sound = 0;
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[n] = '\0';
+		for (char *p = buf; p < buf + n; p += strlen(p) + 1)
+			if (strcmp(p, "SUBSYSTEM=sound") == 0)
+				sound = 1;
+	}
+	return sound;
+}
+
+static int device_listed(char (*names)[MAX_NAME_LEN], int n, const char *name)
+{
+	for (int i = 0; i < n; i++)
+		if (strcmp(names[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Re-enumerate after a hotplug event: report what changed, close the
+   ports of devices that went away, and reopen saved devices that came
+   back.  Device indices may shift, so the full list is sent again. */
+static void rescan_devices(State *s)
+{
+	static char old[MAX_DEVICES][MAX_NAME_LEN];
+	int n_old = s->n_devices;
+	memcpy(old, s->dev_names, sizeof(old));
+	probe_devices(s);
+
+	int changed = 0;
+	for (int i = 0; i < n_old; i++) {
+		if (strcmp(old[i], NO_DEVICES) != 0 &&
+		    !device_listed(s->dev_names, s->n_devices, old[i])) {
+			printf("DEVICE_REMOVED %s\n", old[i]);
+			changed = 1;
+		}
+	}
+	for (int i = 0; i < s->n_devices; i++) {
+		if (strcmp(s->dev_names[i], NO_DEVICES) != 0 &&
+		    !device_listed(old, n_old, s->dev_names[i])) {
+			printf("DEVICE_ADDED %d %s\n", i, s->dev_names[i]);
+			changed = 1;
+		}
+	}
+	if (!changed)
+		return;
+	out_devices(s);
+
+	for (int i = 0; i < MAX_INPUTS; i++) {
+		Input *in = &s->in[i];
+		if (!in->h)
+			continue;
+		in->idx = find_device_by_name(s, in->name);
+		if (in->idx < 0) {
+			close_input(s, in);
+			out_status("MIDI input lost: %s (DEV:%d)", in->name, i);
+		}
+	}
+	if (s->midi_out) {
+		s->out_idx = find_device_by_name(s, s->saved_out_name);
+		if (s->out_idx < 0) {
+			pthread_mutex_lock(&s->out_mu);
+			rtmidi_close_port(s->midi_out);
+			rtmidi_out_free(s->midi_out);
+			s->midi_out = NULL;
+			pthread_mutex_unlock(&s->out_mu);
+			out_status("MIDI output lost: %s", s->saved_out_name);
+		}
+	}
+
+	int reopened = 0;
+	for (int i = 0; i < s->n_saved_in; i++) {
+		int idx = find_device_by_name(s, s->saved_in[i]);
+		int open = 0;
+		for (int k = 0; k < MAX_INPUTS; k++)
+			if (s->in[k].h && s->in[k].idx == idx)
+				open = 1;
+		if (idx >= 0 && !open) {
+			open_midi_in(s, idx, 1);
+			reopened = 1;
+		}
+	}
+	if (s->saved_out_name[0] && !s->midi_out) {
+		int idx = find_device_by_name(s, s->saved_out_name);
+		if (idx >= 0) {
+			open_midi_out(s, idx);
+			reopened = 1;
+		}
+	}
+	if (reopened)
+		save_log(s);
+}
+
 static void panic_midi_out(State *s)
 {
 	if (!s->midi_out) {
@@ -570,25 +2531,53 @@ static void panic_midi_out(State *s)
 	 * fallback — 2048 extra messages, sent as fast as rtmidi could push
 	 * them.  Some hardware synths overflow their input buffer on that
 	 * burst and lock up entirely until power-cycled.  The CC trio is
-	 * enough for any compliant synth, so the brute-force sweep is gone. */
+	 * enough for any compliant synth, so the brute-force sweep is gone,
+	 * and the output thread paces what is left to the DIN rate. */
 	unsigned char cc[3];
 	for (int ch = 0; ch < 16; ch++) {
 		cc[0] = (unsigned char)(0xB0 | ch);
 		cc[1] = 64; cc[2] = 0;
-		rtmidi_out_send_message(s->midi_out, cc, 3);
+		send_out(s, PRIO_CONTROL, cc, 3);
 		cc[1] = 120; cc[2] = 0;
-		rtmidi_out_send_message(s->midi_out, cc, 3);
+		send_out(s, PRIO_CONTROL, cc, 3);
 		cc[1] = 123; cc[2] = 0;
-		rtmidi_out_send_message(s->midi_out, cc, 3);
+		send_out(s, PRIO_CONTROL, cc, 3);
 	}
-	/* Brief sleep so the CC messages flush over USB-MIDI / virtual MIDI
-	 * before the port is closed at process exit.  rtmidi has no
-	 * synchronous flush. */
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 20 * 1000000L };
-	nanosleep(&ts, NULL);
 	out_status("MIDI panic sent");
 }
 
+static void report_filter(const State *s)
+{
+	char names[64];
+	filter_names(s->filter, names, sizeof(names));
+	out_status("MIDI filter: %s", names);
+
+	char counts[256];
+	size_t pos = 0;
+	for (int i = 0; i < N_CNT; i++)
+		pos += (size_t)snprintf(
+		    counts + pos, sizeof(counts) - pos, "%s=%lu ", CNT_NAMES[i],
+		    __atomic_load_n(&s->counts[i], __ATOMIC_RELAXED));
+	out_status("MIDI received: %swakeups=%lu", counts,
+		   __atomic_load_n(&s->wakeups, __ATOMIC_RELAXED));
+}
+
+static void set_filter(State *s, const char *args)
+{
+	int f;
+	if (!parse_filter(args, &f)) {
+		out_status("Usage: MIDI FILTER [CLOCK] [SENSE] [SYSEX] | NONE");
+		return;
+	}
+	__atomic_store_n(&s->filter, f, __ATOMIC_RELAXED);
+	for (int i = 0; i < MAX_INPUTS; i++)
+		if (s->in[i].h)
+			rtmidi_in_ignore_types(s->in[i].h, f & FILTER_SYSEX,
+					       f & FILTER_CLOCK,
+					       f & FILTER_SENSE);
+	save_log(s);
+}
+
 static void test_midi_out(State *s)
 {
 	if (!s->midi_out) {
@@ -599,7 +2588,7 @@ static void test_midi_out(State *s)
 	unsigned char msg_on[3] = {0x90, NOTE_Cs4, 100};
 	unsigned char msg_off[3] = {0x80, NOTE_Cs4, 0};
 
-	if (rtmidi_out_send_message(s->midi_out, msg_on, 3) < 0) {
+	if (send_out(s, PRIO_PLAY, msg_on, 3) < 0) {
 		out_status("MIDI test error (Note On)");
 		return;
 	}
@@ -607,7 +2596,7 @@ static void test_midi_out(State *s)
 	struct timespec ts_wait = {0, 250 * 1000 * 1000};
 	nanosleep(&ts_wait, NULL);
 
-	if (rtmidi_out_send_message(s->midi_out, msg_off, 3) < 0) {
+	if (send_out(s, PRIO_PLAY, msg_off, 3) < 0) {
 		out_status("MIDI test error (Note Off)");
 		return;
 	}
@@ -619,6 +2608,192 @@ static void test_midi_out(State *s)
 /* Command parsing                                                     */
 /* ------------------------------------------------------------------ */
 
+/* Parse "NOTE_ON <lily> VELOCITY:<v>" or "NOTE_OFF <lily>" into msg;
+   returns -1 after reporting the problem */
+static int parse_note_cmd(const char *args, unsigned char msg[3])
+{
+	char lily[16];
+	unsigned int vel;
+	int note;
+
+	if (sscanf(args, "NOTE_ON %15s VELOCITY:%u", lily, &vel) == 2) {
+		msg[0] = 0x90;
+		msg[2] = (unsigned char)(vel & 0x7FU);
+	} else if (sscanf(args, "NOTE_OFF %15s", lily) == 1) {
+		msg[0] = 0x80;
+		msg[2] = 0;
+	} else {
+		out_status(strncmp(args, "NOTE_ON", 7) == 0
+			       ? "Usage: MIDI NOTE_ON <pitch> VELOCITY:<v>"
+			       : "Usage: MIDI NOTE_OFF <pitch>");
+		return -1;
+	}
+	if ((note = lily_to_note(lily)) < 0) {
+		out_status("Invalid note: %s", lily);
+		return -1;
+	}
+	msg[1] = (unsigned char)note;
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Scheduled output                                                    */
+/* ------------------------------------------------------------------ */
+
+static int sched_before(const SchedEvent *a, const SchedEvent *b)
+{
+	return a->t_us < b->t_us || (a->t_us == b->t_us && a->seq < b->seq);
+}
+
+static void heap_push(State *s, SchedEvent ev)
+{
+	int i = s->n_sched++;
+	while (i > 0 && sched_before(&ev, &s->sched[(i - 1) / 2])) {
+		s->sched[i] = s->sched[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->sched[i] = ev;
+}
+
+static SchedEvent heap_pop(State *s)
+{
+	SchedEvent top = s->sched[0];
+	SchedEvent last = s->sched[--s->n_sched];
+	int i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= s->n_sched)
+			break;
+		if (c + 1 < s->n_sched &&
+		    sched_before(&s->sched[c + 1], &s->sched[c]))
+			c++;
+		if (!sched_before(&s->sched[c], &last))
+			break;
+		s->sched[i] = s->sched[c];
+		i = c;
+	}
+	s->sched[i] = last;
+	return top;
+}
+
+static void on_wake_signal(int sig)
+{
+	(void)sig; /* only interrupts clock_nanosleep() */
+}
+
+static void *thr_schedule(void *arg)
+{
+	State *s = (State *)arg;
+
+	pthread_mutex_lock(&s->sched_mu);
+	for (;;) {
+		if (s->n_sched == 0) {
+			pthread_cond_wait(&s->sched_cv, &s->sched_mu);
+			continue;
+		}
+
+		int64_t due = s->sched[0].t_us;
+		if (due > mono_us()) {
+			struct timespec ts = {(time_t)(due / 1000000),
+					      (long)(due % 1000000) * 1000};
+			s->sched_wait_us = due;
+			pthread_mutex_unlock(&s->sched_mu);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+			pthread_mutex_lock(&s->sched_mu);
+			s->sched_wait_us = 0;
+			pthread_cond_broadcast(&s->sched_cv);
+			continue;
+		}
+
+		SchedEvent ev = heap_pop(s);
+		pthread_mutex_unlock(&s->sched_mu);
+		int64_t late = mono_us() - ev.t_us;
+		send_out(s, PRIO_PLAY, ev.msg, 3);
+		pthread_mutex_lock(&s->sched_mu);
+
+		int64_t bin = late / SCHED_LATE_BIN_US;
+		s->sched_late[bin < SCHED_LATE_BINS ? bin : SCHED_LATE_BINS]++;
+		if (late > s->sched_late_max)
+			s->sched_late_max = late;
+		s->sched_sent++;
+	}
+	return NULL;
+}
+
+static void start_scheduler(State *s)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_wake_signal; /* no SA_RESTART */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (start_rt_thread(&s->sched_thread, thr_schedule, s) < 0)
+		out_status("MIDI scheduler running without real-time priority");
+	s->sched_started = 1;
+}
+
+static void schedule(State *s, int64_t t_us, const unsigned char msg[3])
+{
+	if (!s->sched_started)
+		start_scheduler(s);
+
+	pthread_mutex_lock(&s->sched_mu);
+	if (s->n_sched == SCHED_MAX) {
+		pthread_mutex_unlock(&s->sched_mu);
+		out_status("MIDI schedule full, event dropped");
+		return;
+	}
+	SchedEvent ev = {t_us, s->sched_seq++, {msg[0], msg[1], msg[2]}};
+	heap_push(s, ev);
+	pthread_cond_broadcast(&s->sched_cv);
+
+	/* The thread may be asleep for a later event. A signal sent just
+	   before it enters clock_nanosleep() would be lost, so repeat
+	   until it reports being awake. */
+	while (s->sched_wait_us > t_us) {
+		pthread_kill(s->sched_thread, SIGUSR1);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&s->sched_cv, &s->sched_mu, &ts);
+	}
+	pthread_mutex_unlock(&s->sched_mu);
+}
+
+/* Percentile from the late-by histogram, as the bin's upper edge */
+static long late_percentile(const State *s, double p)
+{
+	unsigned long want = (unsigned long)(p * (double)s->sched_sent);
+	unsigned long acc = 0;
+	for (int i = 0; i <= SCHED_LATE_BINS; i++) {
+		acc += s->sched_late[i];
+		if (acc > want)
+			return i < SCHED_LATE_BINS
+				   ? (long)(i + 1) * SCHED_LATE_BIN_US
+				   : (long)s->sched_late_max;
+	}
+	return 0;
+}
+
+static void report_schedule(State *s)
+{
+	pthread_mutex_lock(&s->sched_mu);
+	unsigned long sent = s->sched_sent;
+	int pending = s->n_sched;
+	long p50 = late_percentile(s, 0.50), p99 = late_percentile(s, 0.99);
+	int64_t max = s->sched_late_max;
+	pthread_mutex_unlock(&s->sched_mu);
+	out_status("MIDI schedule: sent=%lu pending=%d late_p50_us=%ld "
+		   "late_p99_us=%ld late_max_us=%" PRId64,
+		   sent, pending, p50, p99, max);
+}
+
 static void handle_command(State *s, const char *line)
 {
 	char cmd[CMD_BUF_SZ];
@@ -631,67 +2806,142 @@ static void handle_command(State *s, const char *line)
 
 	int n;
 
-	if (sscanf(cmd, "MIDI IN %d", &n) == 1) {
-		open_midi_in(s, n);
+	if (strncmp(cmd, "MIDI IN file:", 13) == 0) {
+		open_file_in(s, cmd + 13);
+	} else if (sscanf(cmd, "MIDI IN ADD %d", &n) == 1) {
+		open_midi_in(s, n, 1);
+		save_log(s);
+	} else if (sscanf(cmd, "MIDI IN REMOVE %d", &n) == 1) {
+		remove_midi_in(s, n);
+		save_log(s);
+	} else if (sscanf(cmd, "MIDI IN %d", &n) == 1) {
+		open_midi_in(s, n, 0);
 		save_log(s);
 	} else if (sscanf(cmd, "MIDI OUT %d", &n) == 1) {
 		open_midi_out(s, n);
 		save_log(s);
 	} else if (strcmp(cmd, "MIDI FORWARD ON") == 0) {
-		s->forward = 1;
+		__atomic_store_n(&s->forward, 1, __ATOMIC_RELAXED);
 		out_status("Forwarding enabled");
 		save_log(s);
 	} else if (strcmp(cmd, "MIDI FORWARD OFF") == 0) {
-		s->forward = 0;
+		__atomic_store_n(&s->forward, 0, __ATOMIC_RELAXED);
 		out_status("Forwarding disabled");
 		save_log(s);
+	} else if (strcmp(cmd, "MIDI FILTER") == 0) {
+		report_filter(s);
+	} else if (strncmp(cmd, "MIDI FILTER ", 12) == 0) {
+		set_filter(s, cmd + 12);
+		report_filter(s);
+	} else if (strcmp(cmd, "MIDI RECORD ON") == 0) {
+		s->record = 1;
+		rec_start(s);
+		save_log(s);
+	} else if (strcmp(cmd, "MIDI RECORD OFF") == 0) {
+		s->record = 0;
+		rec_stop(s);
+		save_log(s);
+	} else if (strcmp(cmd, "MIDI CHORD OFF") == 0) {
+		s->chords = 0;
+		memset(s->struck, 0, sizeof(s->struck));
+		out_status("MIDI chords: OFF");
+		save_log(s);
+	} else if (strncmp(cmd, "MIDI CHORD ON", 13) == 0 &&
+		   (cmd[13] == '\0' || cmd[13] == ' ')) {
+		int ms = s->chord_spread_ms;
+		if (cmd[13] && sscanf(cmd + 13, "%d", &ms) != 1)
+			ms = -1;
+		if (ms < 0) {
+			out_status("Usage: MIDI CHORD ON [<spread_ms>]");
+		} else {
+			s->chords = 1;
+			s->chord_spread_ms = ms;
+			out_status("MIDI chords: ON spread=%d ms", ms);
+			save_log(s);
+		}
+	} else if (strcmp(cmd, "MIDI STATS") == 0) {
+		out_stats(s);
+	} else if (strcmp(cmd, "MIDI STATS RESET") == 0) {
+		stats_reset(s);
+		out_status("MIDI stats reset");
+	} else if (sscanf(cmd, "MIDI STATS EVERY %d", &n) == 1 && n >= 0) {
+		s->stats_every_s = n;
+		s->stats_at = n ? mono_us() + (int64_t)n * 1000000 : 0;
+		out_status("MIDI stats every %d s", n);
+	} else if (strncmp(cmd, "MIDI RATE", 9) == 0 &&
+		   (cmd[9] == '\0' || cmd[9] == ' ')) {
+		int rate = s->out_rate, burst = s->out_burst;
+		if (cmd[9] && (sscanf(cmd + 9, "%d %d", &rate, &burst) < 1 ||
+			       rate < 0 || burst < 1)) {
+			out_status("Usage: MIDI RATE [<bytes_per_s> "
+				   "[<burst>]]");
+		} else {
+			if (cmd[9]) {
+				set_out_rate(s, rate, burst);
+				save_log(s);
+			}
+			report_output(s);
+		}
 	} else if (strcmp(cmd, "MIDI DEVICES") == 0) {
 		refresh_devices(s);
 	} else if (strcmp(cmd, "MIDI TEST") == 0) {
 		test_midi_out(s);
 	} else if (strcmp(cmd, "MIDI PANIC") == 0) {
 		panic_midi_out(s);
-	} else if (strncmp(cmd, "MIDI NOTE_ON ", 13) == 0) {
-		char lily[16];
-		unsigned int vel;
-		if (sscanf(cmd, "MIDI NOTE_ON %15s VELOCITY:%u", lily, &vel) ==
-		    2) {
-			int note = lily_to_note(lily);
-			if (note < 0)
-				out_status("Invalid note: %s", lily);
-			else if (!s->midi_out)
-				out_status("No MIDI output connected");
-			else {
-				unsigned char msg[3] = {
-				    0x90, (unsigned char)note,
-				    (unsigned char)(vel & 0x7FU)};
-				rtmidi_out_send_message(s->midi_out, msg, 3);
-			}
-		} else {
-			out_status("Usage: MIDI NOTE_ON <pitch> VELOCITY:<v>");
-		}
-	} else if (strncmp(cmd, "MIDI NOTE_OFF ", 14) == 0) {
-		char lily[16];
-		if (sscanf(cmd, "MIDI NOTE_OFF %15s", lily) == 1) {
-			int note = lily_to_note(lily);
-			if (note < 0)
-				out_status("Invalid note: %s", lily);
-			else if (!s->midi_out)
+	} else if (strncmp(cmd, "MIDI NOTE_ON ", 13) == 0 ||
+		   strncmp(cmd, "MIDI NOTE_OFF ", 14) == 0) {
+		unsigned char msg[3];
+		if (parse_note_cmd(cmd + 5, msg) == 0) {
+			if (!s->midi_out)
 				out_status("No MIDI output connected");
-			else {
-				unsigned char msg[3] = {0x80,
-							(unsigned char)note, 0};
-				rtmidi_out_send_message(s->midi_out, msg, 3);
-			}
-		} else {
-			out_status("Usage: MIDI NOTE_OFF <pitch>");
+			else
+				send_out(s, PRIO_PLAY, msg, 3);
 		}
+	} else if (strcmp(cmd, "MIDI SCHEDULE STATS") == 0) {
+		report_schedule(s);
+	} else if (strcmp(cmd, "MIDI SCHEDULE CLEAR") == 0) {
+		pthread_mutex_lock(&s->sched_mu);
+		s->n_sched = 0;
+		pthread_mutex_unlock(&s->sched_mu);
+		out_status("MIDI schedule cleared");
+	} else if (strncmp(cmd, "MIDI SCHEDULE ", 14) == 0) {
+		long long t_us;
+		int pos = 0;
+		unsigned char msg[3];
+		if (sscanf(cmd, "MIDI SCHEDULE %lld %n", &t_us, &pos) != 1 ||
+		    pos == 0)
+			out_status("Usage: MIDI SCHEDULE <us> NOTE_ON|NOTE_OFF "
+				   "...");
+		else if (parse_note_cmd(cmd + pos, msg) == 0)
+			schedule(s, (int64_t)t_us, msg);
 	} else if (strncmp(cmd, "MIDI", 4) == 0) {
 		out_status("Unknown MIDI command: %s", cmd);
 	}
 	/* Lines not starting with MIDI are silently ignored. */
 }
 
+/* Handle every complete line in buf; returns the length of the
+   incomplete rest, which is moved to the start of buf.  Reading stdin
+   with read() rather than stdio keeps poll() in step with the data: a
+   burst of commands is handled in one go, not one line per wakeup. */
+static size_t handle_input(State *s, char *buf, size_t len)
+{
+	char *p = buf, *end = buf + len, *nl;
+	while ((nl = memchr(p, '\n', (size_t)(end - p)))) {
+		*nl = '\0';
+		handle_command(s, p);
+		p = nl + 1;
+	}
+	len = (size_t)(end - p);
+	if (len == IN_BUF_SZ - 1) { /* overlong line: take it as is */
+		buf[len] = '\0';
+		handle_command(s, buf);
+		return 0;
+	}
+	memmove(buf, p, len);
+	return len;
+}
+
 /* ------------------------------------------------------------------ */
 /* Entry point                                                         */
 /* ------------------------------------------------------------------ */
@@ -700,14 +2950,36 @@ int main(void)
 {
 	State s;
 	memset(&s, 0, sizeof(s));
-	s.in_idx = -1;
 	s.out_idx = -1;
+	s.filter = FILTER_DEFAULT;
+	s.chord_spread_ms = CHORD_SPREAD_MS;
+	stats_reset(&s);
+	s.out_rate = OUT_RATE;
+	s.out_burst = OUT_BURST;
 	s.running = 1;
-
-	setbuf(stdout, NULL);
+	pthread_mutex_init(&s.out_mu, NULL);
+	pthread_mutex_init(&s.oq_mu, NULL);
+	pthread_mutex_init(&s.sched_mu, NULL);
+	pthread_cond_init(&s.sched_cv, NULL);
+	pthread_mutex_init(&s.rec.mu, NULL);
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&s.rec.cv, &ca);
+	pthread_cond_init(&s.oq_cv, &ca);
+	pthread_mutex_init(&s.play_mu, NULL);
+	pthread_cond_init(&s.play_cv, &ca);
+	pthread_condattr_destroy(&ca);
+	sem_init(&s.oq_sem, 0, 0);
+
+	/* Fully buffered: note events are flushed once per batch, and the
+	   other output helpers flush on their own */
+	static char out_buf[OUT_BUF_SZ];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
 
 	/* Self-pipe: midi_callback (background thread) writes here to wake
-	   the main poll() without busy-waiting */
+	   the main poll() without busy-waiting. Non-blocking so the callback
+	   can never stall on it. */
 	int pipefd[2];
 	if (pipe(pipefd) != 0) {
 		perror("pipe");
@@ -715,48 +2987,105 @@ int main(void)
 	}
 	s.pipe_r = pipefd[0];
 	s.pipe_w = pipefd[1];
+	fcntl(s.pipe_w, F_SETFL, fcntl(s.pipe_w, F_GETFL) | O_NONBLOCK);
+
+	/* Watch for device changes before enumerating, so none is missed */
+	s.hp_fd = HOTPLUG_OPEN();
+	if (s.hp_fd < 0)
+		out_status("Hotplug detection unavailable");
+	else
+		fcntl(s.hp_fd, F_SETFL, fcntl(s.hp_fd, F_GETFL) | O_NONBLOCK);
+
+	if (start_rt_thread(&s.oq_thread, thr_output, &s) < 0)
+		out_status("MIDI output running without real-time priority");
 
 	refresh_devices(&s);
 	load_log(&s);
 	restore_from_log(&s);
+	if (s.record)
+		rec_start(&s);
 	out_status("MIDI forward: %s", s.forward ? "ON" : "OFF");
 
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 	fds[0].fd = STDIN_FILENO;
 	fds[0].events = POLLIN;
 	fds[1].fd = s.pipe_r;
 	fds[1].events = POLLIN;
+	fds[2].fd = s.hp_fd; /* ignored by poll() if negative */
+	fds[2].events = POLLIN;
 
-	char line[CMD_BUF_SZ];
+	char in_buf[IN_BUF_SZ];
+	size_t in_len = 0;
 
 	while (s.running) {
-		int ret =
-		    poll(fds, 2, -1); /* block until stdin or MIDI arrives */
-		if (ret < 0)
+		/* Block until stdin, MIDI or a device change arrives, or a
+		   rescan or stats report is due */
+		int64_t due = s.rescan_at;
+		if (s.stats_at && (!due || s.stats_at < due))
+			due = s.stats_at;
+		int timeout = -1;
+		if (due) {
+			int64_t left = due - mono_us();
+			timeout = left > 0 ? (int)((left + 999) / 1000) : 0;
+		}
+		int ret = poll(fds, 3, timeout);
+		if (ret < 0 && errno != EINTR)
 			break;
-
-		if (fds[0].revents & POLLIN) {
-			if (!fgets(line, sizeof(line), stdin)) {
-				/* EOF on stdin: stop watching it but keep
-				 * running */
+		if (ret < 0)
+			continue;
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) {
+			ssize_t n = read(STDIN_FILENO, in_buf + in_len,
+					 sizeof(in_buf) - 1 - in_len);
+			if (n <= 0) {
+				/* EOF on stdin: handle a last unterminated
+				 * line, stop watching it but keep running */
+				if (in_len > 0) {
+					in_buf[in_len] = '\0';
+					handle_command(&s, in_buf);
+					in_len = 0;
+				}
 				fds[0].fd = -1;
 			} else {
-				handle_command(&s, line);
+				in_len = handle_input(&s, in_buf,
+						      in_len + (size_t)n);
 			}
 		}
 
-		/* Drain the wake bytes written by midi_callback; the actual
-		   MIDI processing already happened inside the callback itself.
-		 */
+		/* Drain the wake bytes before the ring, so an event pushed
+		   after the ring is found empty leaves a byte for next time */
 		if (fds[1].revents & POLLIN) {
 			char discard[64];
 			(void)read(s.pipe_r, discard, sizeof(discard));
+			drain_events(&s);
+		}
+
+		if ((fds[2].revents & POLLIN) && hotplug_read(s.hp_fd) &&
+		    !s.rescan_at)
+			s.rescan_at = mono_us() + HOTPLUG_SETTLE_US;
+		if (s.rescan_at && mono_us() >= s.rescan_at) {
+			s.rescan_at = 0;
+			rescan_devices(&s);
+			fflush(stdout);
+		}
+		if (s.stats_at && mono_us() >= s.stats_at) {
+			s.stats_at += (int64_t)s.stats_every_s * 1000000;
+			out_stats(&s);
 		}
 	}
 
+	rec_stop(&s);
 	panic_midi_out(&s);
+	out_flush(&s);
+
+	/* Brief sleep so the CC messages flush over USB-MIDI / virtual MIDI
+	 * before the port is closed.  rtmidi has no synchronous flush. */
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = 20 * 1000000L};
+	nanosleep(&ts, NULL);
 	close_midi_in(&s);
 	close_midi_out(&s);
+	if (s.hp_fd >= 0)
+		close(s.hp_fd);
 	close(s.pipe_r);
 	close(s.pipe_w);
 	return 0;
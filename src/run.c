@@ -10,7 +10,43 @@
  * or exits with an error, the entire graph is terminated via SIGTERM.
  *
  * ARGUMENTS
- * arg[1]: Path to the graph definition file (e.g., "pipeline.dot").
+ * run [-n] [-w <speed>[@<epoch>]] [-d <path>[:<secs>]] [-c <socket>]
+ *     [-j <jobs>] <graph.dot> [<input>...]
+ * graph.dot: Path to the graph definition file (e.g., "pipeline.dot").
+ * input: Batch mode. One independent instance of the graph is run per
+ *     input file, with the file as STDIN, up to <jobs> at a time (default:
+ *     number of online CPUs). The STDOUT of each instance is collected and
+ *     written out in input order, and the throughput is reported on
+ *     stderr. In batch mode an instance ends once all of its programs
+ *     have exited, rather than at the first quiet exit.
+ * -n: Parse only. Report node and edge counts, parse time and peak memory
+ *     on stderr, then exit without starting anything.
+ * -d: Live graph snapshot. Every <secs> seconds (default 2) the graph is
+ *     written to <path> in Graphviz DOT, with edges labelled by lines/s,
+ *     bytes/s and queue depth (bytes written but not yet consumed) and
+ *     penwidth growing with the line rate, and program nodes labelled by
+ *     CPU% (from /proc, Linux only). Render with e.g. "dot -Tsvg". The
+ *     per-edge counters are only maintained when -d is given.
+ * -c: Control socket. run listens on the UNIX socket <socket> for
+ *     line-based commands (e.g. "socat - UNIX-CONNECT:<socket>"):
+ *       EDGES          List edges as: EDGE <n> "<from>" -> "<to>"
+ *       TAP <edge> [PREFIX <text>] [RATE <lines/s>] [REGEX <ere>]
+ *                      Copy lines flowing on an edge (given as <n> or as
+ *                      "<from>" -> "<to>") to this connection as
+ *                      TAP <id> <line>. REGEX takes the rest of the line.
+ *       TAPS           List this connection's taps with their counters.
+ *       UNTAP <id>     Detach a tap and report its final counters.
+ *     Tapped lines are copied from the relay buffer into a per-connection
+ *     ring and written out by a separate thread; when the observer falls
+ *     behind or exceeds RATE, lines are dropped rather than slowing the
+ *     edge, and a "DROPPED <id> rate=<n> full=<n>" line reports the
+ *     running totals before the next delivered line. Closing the
+ *     connection detaches its taps.
+ * -w: Time-warp mode. Every child is started with warp.so (found next to
+ *     the run executable, or at $WARP_LIB) preloaded, so its realtime and
+ *     monotonic clocks run <speed> times faster and its sleeps are
+ *     shortened accordingly. <epoch> sets the virtual Unix time (seconds)
+ *     at graph start; by default the virtual clock starts at the real one.
  *
  * GRAPH SYNTAX
  * Statements follow the DOT format: "NodeA" -> "NodeB";
@@ -18,6 +54,21 @@
  * - Arrows represent a pipe from the source's stdout to the sink's stdin.
  * - Multiple sinks (fan-out) or multiple sources (fan-in) are supported.
  * - Statements must terminate with a semicolon (;).
+ * - include "file.dot"; splices in another graph file, with the path
+ *   taken relative to the including file. Nodes with the same name in
+ *   different files are the same node.
+ *
+ * NODE ATTRIBUTES
+ * A statement without an arrow sets attributes on a node:
+ *     "bin/midi" [stdout=pipe];
+ * - stdout=pty        : Child stdout is a pseudo-terminal (default), which
+ *                       makes stdio line-buffered at the cost of line
+ *                       discipline processing and CR/LF translation.
+ * - stdout=pipe       : Child stdout is a plain pipe.
+ * - stdout=socketpair : Child stdout is a UNIX stream socket.
+ * In the pipe modes the child is started under stdbuf(1) with -oL, and
+ * RUN_TRANSPORT is set in its environment, so stdio stays line-buffered
+ * without a PTY. Programs that manage their own buffering may ignore it.
  *
  * SPECIAL NODES
  * STDIN       : The host terminal's standard input.
@@ -35,12 +86,19 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <pthread.h>
+#include <regex.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -51,12 +109,29 @@
 #include <util.h>
 #endif
 
-#define MAX_NODES 256
-#define MAX_EDGES 512
-#define MAX_ARGV 64
-#define MAX_CHILDREN 256
+#define MAX_INCLUDE_DEPTH 32
 #define LINE_BUF 65536
 
+/* Per-edge traffic, only allocated when a live snapshot is requested */
+typedef struct {
+	uint64_t lines;
+	uint64_t bytes_out; /* written into the edge by its source */
+	uint64_t bytes_in;  /* read from the edge by its sink */
+} EdgeStat;
+static EdgeStat *g_edge_stats;
+static const char *g_dot_path;
+static int g_dot_secs = 2;
+
+static void stat_add(uint64_t *ctr, uint64_t v)
+{
+	__atomic_add_fetch(ctr, v, __ATOMIC_RELAXED);
+}
+
+static uint64_t stat_get(uint64_t *ctr)
+{
+	return __atomic_load_n(ctr, __ATOMIC_RELAXED);
+}
+
 static void die(const char *msg)
 {
 	fprintf(stderr, "\x1b[31mError:\x1b[0m %s\n", msg);
@@ -64,17 +139,25 @@ static void die(const char *msg)
 }
 
 static volatile int g_terminating;
+static int g_drain; /* batch mode: quiet exits do not end the graph */
 static pthread_mutex_t g_term_mu = PTHREAD_MUTEX_INITIALIZER;
 
-static pid_t g_children[MAX_CHILDREN];
-static int g_nchildren;
+static pid_t *g_children;
+static int g_nchildren, g_children_cap;
 static pthread_mutex_t g_children_mu = PTHREAD_MUTEX_INITIALIZER;
 
 static void register_child(pid_t pid)
 {
 	pthread_mutex_lock(&g_children_mu);
-	if (g_nchildren < MAX_CHILDREN)
-		g_children[g_nchildren++] = pid;
+	if (g_nchildren == g_children_cap) {
+		int cap = g_children_cap ? g_children_cap * 2 : 64;
+		pid_t *p = realloc(g_children, (size_t)cap * sizeof(pid_t));
+		if (!p)
+			die("realloc(children)");
+		g_children = p;
+		g_children_cap = cap;
+	}
+	g_children[g_nchildren++] = pid;
 	pthread_mutex_unlock(&g_children_mu);
 }
 
@@ -117,43 +200,105 @@ static int fd_recv_line(int rd, char *buf, size_t bufsz)
 }
 
 typedef enum { NT_STDIN, NT_STDOUT, NT_STDOUT_IMM, NT_PROG } NodeKind;
+typedef enum { TR_PTY, TR_PIPE, TR_SOCKETPAIR } Transport;
 typedef struct {
 	NodeKind kind;
-	char cmd[512];
+	Transport out;
+	char *cmd; /* node name as written, e.g. "bin/midi" or "STDIN" */
 } Node;
 typedef struct {
 	int from;
 	int to;
 } Edge;
 
-static int node_eq(const Node *a, const Node *b)
+/* Growable node and edge tables; nodes are interned through an
+ * open-addressing hash of their names (slots hold node index or -1). */
+typedef struct {
+	Node *nodes;
+	int n_nodes, cap_nodes;
+	Edge *edges;
+	int n_edges, cap_edges;
+	int *slots;
+	size_t n_slots; /* power of two, at least twice n_nodes */
+} Graph;
+
+static size_t hash_str(const char *s)
 {
-	if (a->kind != b->kind)
-		return 0;
-	return (a->kind == NT_PROG) ? strcmp(a->cmd, b->cmd) == 0 : 1;
+	size_t h = 2166136261u; /* FNV-1a */
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
 }
 
-static int intern_node(Node *nodes, int *n, const char *name)
+static void rehash(Graph *g, size_t n_slots)
 {
-	Node tmp;
+	free(g->slots);
+	g->n_slots = n_slots;
+	g->slots = malloc(n_slots * sizeof(int));
+	for (size_t i = 0; i < n_slots; i++)
+		g->slots[i] = -1;
+	for (int ni = 0; ni < g->n_nodes; ni++) {
+		size_t i = hash_str(g->nodes[ni].cmd) & (n_slots - 1);
+		while (g->slots[i] >= 0)
+			i = (i + 1) & (n_slots - 1);
+		g->slots[i] = ni;
+	}
+}
+
+static int intern_node(Graph *g, const char *name)
+{
+	if ((size_t)g->n_nodes * 2 >= g->n_slots)
+		rehash(g, g->n_slots ? g->n_slots * 2 : 64);
+	size_t i = hash_str(name) & (g->n_slots - 1);
+	for (; g->slots[i] >= 0; i = (i + 1) & (g->n_slots - 1))
+		if (strcmp(g->nodes[g->slots[i]].cmd, name) == 0)
+			return g->slots[i];
+
+	if (g->n_nodes == g->cap_nodes) {
+		int cap = g->cap_nodes ? g->cap_nodes * 2 : 64;
+		Node *p = realloc(g->nodes, (size_t)cap * sizeof(Node));
+		if (!p)
+			die("realloc(nodes)");
+		g->nodes = p;
+		g->cap_nodes = cap;
+	}
+	Node *n = &g->nodes[g->n_nodes];
+	n->out = TR_PTY;
 	if (strcmp(name, "STDIN") == 0)
-		tmp.kind = NT_STDIN;
+		n->kind = NT_STDIN;
 	else if (strcmp(name, "STDOUT") == 0)
-		tmp.kind = NT_STDOUT;
+		n->kind = NT_STDOUT;
 	else if (strcmp(name, "STDOUT_IMM") == 0)
-		tmp.kind = NT_STDOUT_IMM;
-	else {
-		tmp.kind = NT_PROG;
-		snprintf(tmp.cmd, sizeof tmp.cmd, "%s", name);
+		n->kind = NT_STDOUT_IMM;
+	else
+		n->kind = NT_PROG;
+	n->cmd = strdup(name);
+	g->slots[i] = g->n_nodes;
+	return g->n_nodes++;
+}
+
+static void add_edge(Graph *g, int from, int to)
+{
+	if (g->n_edges == g->cap_edges) {
+		int cap = g->cap_edges ? g->cap_edges * 2 : 64;
+		Edge *p = realloc(g->edges, (size_t)cap * sizeof(Edge));
+		if (!p)
+			die("realloc(edges)");
+		g->edges = p;
+		g->cap_edges = cap;
 	}
+	g->edges[g->n_edges].from = from;
+	g->edges[g->n_edges].to = to;
+	g->n_edges++;
+}
 
-	for (int i = 0; i < *n; i++)
-		if (node_eq(&nodes[i], &tmp))
-			return i;
-	if (*n >= MAX_NODES)
-		die("too many nodes");
-	nodes[(*n)++] = tmp;
-	return *n - 1;
+static void free_graph(Graph *g)
+{
+	for (int i = 0; i < g->n_nodes; i++)
+		free(g->nodes[i].cmd);
+	free(g->nodes);
+	free(g->edges);
+	free(g->slots);
 }
 
 static void strip_comments(char *s)
@@ -215,8 +360,95 @@ static char *trim(char *s)
 	return s;
 }
 
-static void parse_graph(char *src, Node *nodes, int *n_nodes, Edge *edges,
-			int *n_edges)
+static char *unquote(char *s)
+{
+	size_t len = strlen(s);
+	if (len >= 2 && s[0] == '"' && s[len - 1] == '"') {
+		s[len - 1] = '\0';
+		s++;
+	}
+	return s;
+}
+
+/* Find the opening '[' of a trailing attribute list, or NULL */
+static char *find_attrs(char *s)
+{
+	int in_q = 0;
+	for (char *p = s; *p; p++) {
+		if (*p == '"')
+			in_q = !in_q;
+		else if (!in_q && *p == '[')
+			return p;
+	}
+	return NULL;
+}
+
+static void set_node_attr(Node *node, const char *key, const char *val)
+{
+	if (strcmp(key, "stdout") == 0) {
+		if (node->kind != NT_PROG)
+			die("stdout attribute only applies to programs");
+		if (strcmp(val, "pty") == 0)
+			node->out = TR_PTY;
+		else if (strcmp(val, "pipe") == 0)
+			node->out = TR_PIPE;
+		else if (strcmp(val, "socketpair") == 0)
+			node->out = TR_SOCKETPAIR;
+		else
+			die("stdout must be pty, pipe or socketpair");
+	} else
+		die("unknown node attribute");
+}
+
+static void parse_attrs(char *list, Node *node)
+{
+	char *end = strrchr(list, ']');
+	if (!end || *trim(end + 1))
+		die("expected ']' at end of attribute list");
+	*end = '\0';
+	for (char *tok = strtok(list, ", \t"); tok;
+	     tok = strtok(NULL, ", \t")) {
+		char *eq = strchr(tok, '=');
+		if (!eq)
+			die("expected key=value in attribute list");
+		*eq = '\0';
+		set_node_attr(node, tok, unquote(eq + 1));
+	}
+}
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f);
+	rewind(f);
+	char *src = malloc((size_t)sz + 1);
+	if (fread(src, 1, (size_t)sz, f) != (size_t)sz)
+		die("fread");
+	src[sz] = '\0';
+	fclose(f);
+	return src;
+}
+
+static void parse_file(Graph *g, const char *path, int depth);
+
+/* include "file.dot"; paths are relative to the including file */
+static void parse_include(Graph *g, char *arg, const char *from, int depth)
+{
+	char *name = unquote(trim(arg));
+	char path[PATH_MAX];
+	const char *slash = strrchr(from, '/');
+	if (name[0] == '/' || !slash)
+		snprintf(path, sizeof path, "%s", name);
+	else
+		snprintf(path, sizeof path, "%.*s/%s", (int)(slash - from),
+			 from, name);
+	parse_file(g, path, depth + 1);
+}
+
+static void parse_graph(Graph *g, char *src, const char *path, int depth)
 {
 	strip_comments(src);
 	for (char *p = src; *p; p++)
@@ -232,38 +464,51 @@ static void parse_graph(char *src, Node *nodes, int *n_nodes, Edge *edges,
 		}
 		*semi = '\0';
 		char *t = trim(stmt);
-		if (*t) {
-			char *parts[MAX_NODES];
-			int np = split_arrow(t, parts, MAX_NODES);
+		char *attrs = find_attrs(t);
+		if (strncmp(t, "include", 7) == 0 &&
+		    isspace((unsigned char)t[7])) {
+			parse_include(g, t + 7, path, depth);
+		} else if (attrs) {
+			*attrs++ = '\0';
+			char *parts[2];
+			if (split_arrow(t, parts, 2) != 1)
+				die("attributes are only supported on nodes");
+			char *name = unquote(trim(t));
+			if (!*name)
+				die("attribute list without a node");
+			int ni = intern_node(g, name);
+			parse_attrs(attrs, &g->nodes[ni]);
+		} else if (*t) {
+			int max_parts = (int)(strlen(t) / 2) + 2;
+			char **parts = malloc((size_t)max_parts * sizeof(char *));
+			int np = split_arrow(t, parts, max_parts);
 			if (np < 2)
 				die("expected '->'");
-			for (int i = 0; i + 1 < np; i++) {
-				char ta[512], tb[512];
-				snprintf(ta, sizeof ta, "%s", trim(parts[i]));
-				snprintf(tb, sizeof tb, "%s",
-					 trim(parts[i + 1]));
-				char *ca = ta, *cb = tb;
-				if (ca[0] == '"') {
-					ca++;
-					ca[strlen(ca) - 1] = '\0';
-				}
-				if (cb[0] == '"') {
-					cb++;
-					cb[strlen(cb) - 1] = '\0';
-				}
-				int ai = intern_node(nodes, n_nodes, ca);
-				int bi = intern_node(nodes, n_nodes, cb);
-				if (*n_edges >= MAX_EDGES)
-					die("too many edges");
-				edges[*n_edges].from = ai;
-				edges[*n_edges].to = bi;
-				(*n_edges)++;
+			int prev = intern_node(g, unquote(trim(parts[0])));
+			for (int i = 1; i < np; i++) {
+				int cur = intern_node(g, unquote(trim(parts[i])));
+				add_edge(g, prev, cur);
+				prev = cur;
 			}
+			free(parts);
 		}
 		stmt = semi + 1;
 	}
 }
 
+static void parse_file(Graph *g, const char *path, int depth)
+{
+	if (depth > MAX_INCLUDE_DEPTH)
+		die("include nested too deeply (cycle?)");
+	char *src = read_file(path);
+	if (!src) {
+		fprintf(stderr, "\x1b[31mError:\x1b[0m cannot read '%s'\n", path);
+		exit(1);
+	}
+	parse_graph(g, src, path, depth);
+	free(src);
+}
+
 static char *parse_argv(const char *cmd, char **out, int max_out)
 {
 	char *buf = malloc(strlen(cmd) + 1);
@@ -297,6 +542,13 @@ static char *parse_argv(const char *cmd, char **out, int max_out)
 	return buf;
 }
 
+/* Relay ends stay in run; children must not keep them open past exec, or
+ * a downstream program never sees EOF. */
+static void set_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
 typedef struct {
 	int *data;
 	int n, cap;
@@ -310,9 +562,165 @@ static void il_push(IntList *l, int v)
 	l->data[l->n++] = v;
 }
 
+/* A control connection. Replies and tapped lines are queued in a ring
+ * and written to the socket by the connection's writer thread, so a slow
+ * observer never blocks a relay. */
+#define CONN_RING 65536
+typedef struct {
+	int fd;
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+	char ring[CONN_RING];
+	size_t head, len;
+	int closed;
+	int refs; /* reader and writer threads */
+} Conn;
+
+typedef struct Tap {
+	int id;
+	int edge;
+	Conn *conn;
+	char prefix[256];
+	regex_t re;
+	int has_re;
+	double rate, tokens; /* lines/s token bucket; rate 0 = unlimited */
+	struct timespec last;
+	char *partial; /* start of a line split across relay reads */
+	size_t plen;
+	uint64_t lines, drop_rate, drop_full, reported;
+	struct Tap *next;
+} Tap;
+
+/* The taps of one edge.  mu is held by the relay while it filters a
+ * read, so one busy or stalled edge does not hold up the others. */
+typedef struct {
+	pthread_mutex_t mu;
+	Tap *head;
+} TapList;
+
+static TapList *g_taps; /* per edge, only allocated with a control socket */
+
+static void ring_copy_in(Conn *c, const char *data, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		c->ring[(c->head + c->len + i) % CONN_RING] = data[i];
+	c->len += n;
+	pthread_cond_broadcast(&c->cv);
+}
+
+/* Append to a connection's ring; returns 0 if it does not fit */
+static int conn_put(Conn *c, const char *data, size_t n)
+{
+	pthread_mutex_lock(&c->mu);
+	int ok = !c->closed && c->len + n <= CONN_RING;
+	if (ok)
+		ring_copy_in(c, data, n);
+	pthread_mutex_unlock(&c->mu);
+	return ok;
+}
+
+/* Append to a connection's ring, waiting for room (control replies) */
+static void conn_write(Conn *c, const char *data, size_t n)
+{
+	pthread_mutex_lock(&c->mu);
+	while (n > 0 && !c->closed) {
+		size_t k = CONN_RING - c->len;
+		if (k == 0) {
+			pthread_cond_wait(&c->cv, &c->mu);
+			continue;
+		}
+		if (k > n)
+			k = n;
+		ring_copy_in(c, data, k);
+		data += k;
+		n -= k;
+	}
+	pthread_mutex_unlock(&c->mu);
+}
+
+static void tap_line(Tap *t, const char *line, size_t n)
+{
+	if (t->prefix[0] && strncmp(line, t->prefix, strlen(t->prefix)) != 0)
+		return;
+	if (t->has_re) {
+		char tmp[LINE_BUF];
+		snprintf(tmp, sizeof tmp, "%.*s", (int)n, line);
+		if (regexec(&t->re, tmp, 0, NULL, 0) != 0)
+			return;
+	}
+	if (t->rate > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t->tokens += t->rate * ((double)(now.tv_sec - t->last.tv_sec) +
+					(now.tv_nsec - t->last.tv_nsec) / 1e9);
+		if (t->tokens > t->rate)
+			t->tokens = t->rate;
+		t->last = now;
+		if (t->tokens < 1.0) {
+			t->drop_rate++;
+			return;
+		}
+		t->tokens -= 1.0;
+	}
+	char hdr[128];
+	uint64_t dropped = t->drop_rate + t->drop_full;
+	if (dropped != t->reported) {
+		int k = snprintf(hdr, sizeof hdr,
+				 "DROPPED %d rate=%llu full=%llu\n", t->id,
+				 (unsigned long long)t->drop_rate,
+				 (unsigned long long)t->drop_full);
+		if (conn_put(t->conn, hdr, (size_t)k))
+			t->reported = dropped;
+	}
+	int k = snprintf(hdr, sizeof hdr, "TAP %d ", t->id);
+	char msg[LINE_BUF + 128];
+	if ((size_t)k + n + 1 > sizeof msg)
+		n = sizeof msg - (size_t)k - 1;
+	memcpy(msg, hdr, (size_t)k);
+	memcpy(msg + k, line, n);
+	msg[(size_t)k + n] = '\n';
+	if (conn_put(t->conn, msg, (size_t)k + n + 1))
+		t->lines++;
+	else
+		t->drop_full++;
+}
+
+/* Copy one relay read to the taps of an edge, splitting it into lines */
+static void tap_feed(int edge, const char *buf, size_t n)
+{
+	TapList *l = &g_taps[edge];
+	pthread_mutex_lock(&l->mu);
+	for (Tap *t = l->head; t; t = t->next) {
+		const char *p = buf, *end = buf + n, *nl;
+		while ((nl = memchr(p, '\n', (size_t)(end - p)))) {
+			const char *line = p;
+			size_t len = (size_t)(nl - p);
+			if (t->plen) {
+				size_t room = LINE_BUF - t->plen;
+				size_t k = len < room ? len : room;
+				memcpy(t->partial + t->plen, p, k);
+				line = t->partial;
+				len = t->plen + k;
+				t->plen = 0;
+			}
+			if (len && line[len - 1] == '\r')
+				len--; /* PTY line endings */
+			tap_line(t, line, len);
+			p = nl + 1;
+		}
+		size_t rest = (size_t)(end - p);
+		if (rest > LINE_BUF - t->plen)
+			rest = LINE_BUF - t->plen;
+		memcpy(t->partial + t->plen, p, rest);
+		t->plen += rest;
+	}
+	pthread_mutex_unlock(&l->mu);
+}
+
 typedef struct {
 	int src_rd;
 	int *dst_wrs;
+	int *dst_edges;
 	int n_dst;
 } FanoutArg;
 static void *thr_fanout(void *arg)
@@ -321,15 +729,32 @@ static void *thr_fanout(void *arg)
 	char buf[LINE_BUF];
 	ssize_t n;
 	while (!g_terminating && (n = read(a->src_rd, buf, sizeof buf)) > 0) {
-		int alive = 0;
+		int alive = 0, lines = 0;
+		if (g_edge_stats)
+			for (char *p = buf; (p = memchr(p, '\n',
+						       (size_t)(buf + n - p)));
+			     p++)
+				lines++;
 		for (int i = 0; i < a->n_dst; i++) {
 			if (a->dst_wrs[i] < 0)
 				continue;
 			if (write(a->dst_wrs[i], buf, (size_t)n) != n) {
 				close(a->dst_wrs[i]);
 				a->dst_wrs[i] = -1;
-			} else
+			} else {
 				alive = 1;
+				if (g_edge_stats) {
+					EdgeStat *es =
+					    &g_edge_stats[a->dst_edges[i]];
+					stat_add(&es->lines, (uint64_t)lines);
+					stat_add(&es->bytes_out, (uint64_t)n);
+				}
+			}
+		}
+		for (int i = 0; g_taps && i < a->n_dst; i++) {
+			int e = a->dst_edges[i];
+			if (__atomic_load_n(&g_taps[e].head, __ATOMIC_ACQUIRE))
+				tap_feed(e, buf, (size_t)n);
 		}
 		if (!alive)
 			break;
@@ -339,12 +764,14 @@ static void *thr_fanout(void *arg)
 		if (a->dst_wrs[i] >= 0)
 			close(a->dst_wrs[i]);
 	free(a->dst_wrs);
+	free(a->dst_edges);
 	free(a);
 	return NULL;
 }
 
 typedef struct {
 	int src_rd;
+	int edge;
 	int dst_wr;
 	pthread_mutex_t *mu;
 } FaninSubArg;
@@ -357,6 +784,8 @@ static void *thr_fanin_sub(void *arg)
 		ssize_t n = read(a->src_rd, buf + len, sizeof buf - len - 1);
 		if (n <= 0)
 			break;
+		if (g_edge_stats)
+			stat_add(&g_edge_stats[a->edge].bytes_in, (uint64_t)n);
 		len += (size_t)n;
 		char *start = buf;
 		char *nl;
@@ -386,6 +815,7 @@ done:
 
 typedef struct {
 	int *src_rds;
+	int *src_edges;
 	int n_src;
 	int dst_wr;
 } FaninArg;
@@ -397,6 +827,7 @@ static void *thr_fanin(void *arg)
 	for (int i = 0; i < a->n_src; i++) {
 		FaninSubArg *sa = malloc(sizeof *sa);
 		sa->src_rd = a->src_rds[i];
+		sa->edge = a->src_edges[i];
 		sa->dst_wr = a->dst_wr;
 		sa->mu = &mu;
 		pthread_create(&subs[i], NULL, thr_fanin_sub, sa);
@@ -406,6 +837,7 @@ static void *thr_fanin(void *arg)
 	close(a->dst_wr);
 	free(subs);
 	free(a->src_rds);
+	free(a->src_edges);
 	free(a);
 	return NULL;
 }
@@ -426,12 +858,16 @@ void *thr_stdin_pump(void *arg)
 
 typedef struct {
 	int src_rd;
+	int edge;
 } StdoutArg;
 static void *thr_stdout(void *arg)
 {
 	StdoutArg *a = arg;
 	char line[LINE_BUF];
 	while (!g_terminating && fd_recv_line(a->src_rd, line, sizeof line)) {
+		if (g_edge_stats)
+			stat_add(&g_edge_stats[a->edge].bytes_in,
+				 strlen(line) + 1);
 		puts(line);
 		fflush(stdout);
 	}
@@ -446,6 +882,8 @@ static void *thr_stdout_imm(void *arg)
 	char buf[4096];
 	ssize_t n;
 	while (!g_terminating && (n = read(a->src_rd, buf, sizeof buf)) > 0) {
+		if (g_edge_stats)
+			stat_add(&g_edge_stats[a->edge].bytes_in, (uint64_t)n);
 		if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n)
 			break;
 		fflush(stdout);
@@ -471,8 +909,10 @@ void *thr_wait(void *arg)
 			terminate_all(1);
 		}
 	} else if (WIFEXITED(status)) {
-		if (WEXITSTATUS(status) == 0)
-			terminate_all(0); // Quiet success
+		if (WEXITSTATUS(status) == 0) {
+			if (!g_drain)
+				terminate_all(0); // Quiet success
+		}
 		else if (!g_terminating) {
 			fprintf(stderr,
 				"\x1b[31mError:\x1b[0m `%s` exited status %d\n",
@@ -489,6 +929,433 @@ void *thr_wait(void *arg)
 	return NULL;
 }
 
+static const char *node_name(const Node *n)
+{
+	switch (n->kind) {
+	case NT_STDIN:
+		return "STDIN";
+	case NT_STDOUT:
+		return "STDOUT";
+	case NT_STDOUT_IMM:
+		return "STDOUT_IMM";
+	default:
+		return n->cmd;
+	}
+}
+
+static void dot_quote(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* utime + stime of a process in clock ticks, or -1 if unavailable */
+static long proc_cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024];
+	snprintf(path, sizeof path, "/proc/%ld/stat", (long)pid);
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	size_t n = fread(buf, 1, sizeof buf - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	char *p = strrchr(buf, ')'); /* comm may contain spaces */
+	unsigned long ut, st;
+	if (!p || sscanf(p + 1,
+			 " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			 &ut, &st) != 2)
+		return -1;
+	return (long)(ut + st);
+}
+
+typedef struct {
+	Node *nodes;
+	int n_nodes;
+	Edge *edges;
+	int n_edges;
+	pid_t *pids;
+} SnapArg;
+static void *thr_snapshot(void *arg)
+{
+	SnapArg *a = arg;
+	uint64_t *prev_lines = calloc((size_t)a->n_edges, sizeof(uint64_t));
+	uint64_t *prev_bytes = calloc((size_t)a->n_edges, sizeof(uint64_t));
+	long *prev_ticks = calloc((size_t)a->n_nodes, sizeof(long));
+	long hz = sysconf(_SC_CLK_TCK);
+	char tmp[4096];
+	snprintf(tmp, sizeof tmp, "%s.tmp", g_dot_path);
+
+	for (int i = 0; i < a->n_nodes; i++)
+		prev_ticks[i] = a->pids[i] > 0 ? proc_cpu_ticks(a->pids[i]) : -1;
+	struct timespec prev, now;
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+
+	while (!g_terminating) {
+		struct timespec ts = {g_dot_secs, 0};
+		nanosleep(&ts, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double dt = (double)(now.tv_sec - prev.tv_sec) +
+			    (now.tv_nsec - prev.tv_nsec) / 1e9;
+		prev = now;
+
+		FILE *f = fopen(tmp, "w");
+		if (!f)
+			continue;
+		fprintf(f, "digraph G {\n    rankdir=LR;\n");
+		for (int i = 0; i < a->n_nodes; i++) {
+			long t = a->pids[i] > 0 ? proc_cpu_ticks(a->pids[i]) : -1;
+			fprintf(f, "    n%d [label=", i);
+			dot_quote(f, node_name(&a->nodes[i]));
+			if (t >= 0 && prev_ticks[i] >= 0)
+				fprintf(f, " + \"\\nCPU %.1f%%\"",
+					100.0 * (double)(t - prev_ticks[i]) /
+					    ((double)hz * dt));
+			fprintf(f, "];\n");
+			prev_ticks[i] = t;
+		}
+		for (int i = 0; i < a->n_edges; i++) {
+			EdgeStat *es = &g_edge_stats[i];
+			uint64_t lines = stat_get(&es->lines);
+			uint64_t out = stat_get(&es->bytes_out);
+			uint64_t in = stat_get(&es->bytes_in);
+			double lps = (double)(lines - prev_lines[i]) / dt;
+			double bps = (double)(out - prev_bytes[i]) / dt;
+			prev_lines[i] = lines;
+			prev_bytes[i] = out;
+			fprintf(f,
+				"    n%d -> n%d [label=\"%.1f l/s\\n%.0f B/s\\n"
+				"q %llu B\", penwidth=%.1f];\n",
+				a->edges[i].from, a->edges[i].to, lps, bps,
+				(unsigned long long)(out > in ? out - in : 0),
+				1.0 + log10(1.0 + lps));
+		}
+		fprintf(f, "}\n");
+		fclose(f);
+		rename(tmp, g_dot_path);
+	}
+	free(prev_lines);
+	free(prev_bytes);
+	free(prev_ticks);
+	free(a);
+	return NULL;
+}
+
+/* Control socket: TAP/UNTAP/TAPS/EDGES commands, one per line */
+static const char *g_ctl_path;
+static Node *g_ctl_nodes;
+static Edge *g_ctl_edges;
+static int g_ctl_n_edges, g_next_tap = 1;
+
+static void reply(Conn *c, const char *fmt, ...)
+{
+	char buf[LINE_BUF];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		conn_write(c, buf, (size_t)n < sizeof buf ? (size_t)n
+							   : sizeof buf - 1);
+}
+
+static void conn_release(Conn *c)
+{
+	pthread_mutex_lock(&c->mu);
+	int refs = --c->refs;
+	pthread_mutex_unlock(&c->mu);
+	if (refs == 0) {
+		close(c->fd);
+		pthread_mutex_destroy(&c->mu);
+		pthread_cond_destroy(&c->cv);
+		free(c);
+	}
+}
+
+static void *thr_conn_writer(void *arg)
+{
+	Conn *c = arg;
+	pthread_mutex_lock(&c->mu);
+	for (;;) {
+		while (c->len == 0 && !c->closed)
+			pthread_cond_wait(&c->cv, &c->mu);
+		if (c->len == 0)
+			break;
+		size_t k = CONN_RING - c->head;
+		if (k > c->len)
+			k = c->len;
+		pthread_mutex_unlock(&c->mu);
+		ssize_t w = write(c->fd, c->ring + c->head, k);
+		pthread_mutex_lock(&c->mu);
+		if (w <= 0) {
+			c->closed = 1;
+			c->len = 0;
+		} else {
+			c->head = (c->head + (size_t)w) % CONN_RING;
+			c->len -= (size_t)w;
+		}
+		pthread_cond_broadcast(&c->cv);
+	}
+	pthread_mutex_unlock(&c->mu);
+	conn_release(c);
+	return NULL;
+}
+
+static void free_tap(Tap *t)
+{
+	if (t->has_re)
+		regfree(&t->re);
+	free(t->partial);
+	free(t);
+}
+
+/* Unlink matching taps; id < 0 removes every tap of conn */
+static Tap *unlink_taps(Conn *c, int id)
+{
+	Tap *removed = NULL;
+	for (int e = 0; e < g_ctl_n_edges; e++) {
+		pthread_mutex_lock(&g_taps[e].mu);
+		Tap **pp = &g_taps[e].head;
+		while (*pp) {
+			Tap *t = *pp;
+			if (t->conn == c && (id < 0 || t->id == id)) {
+				__atomic_store_n(pp, t->next, __ATOMIC_RELEASE);
+				t->next = removed;
+				removed = t;
+			} else
+				pp = &t->next;
+		}
+		pthread_mutex_unlock(&g_taps[e].mu);
+	}
+	return removed;
+}
+
+static int find_edge(const char *from, const char *to)
+{
+	for (int i = 0; i < g_ctl_n_edges; i++)
+		if (strcmp(g_ctl_nodes[g_ctl_edges[i].from].cmd, from) == 0 &&
+		    strcmp(g_ctl_nodes[g_ctl_edges[i].to].cmd, to) == 0)
+			return i;
+	return -1;
+}
+
+/* TAP <edge> [PREFIX <text>] [RATE <lines/s>] [REGEX <ere to end>] */
+static void cmd_tap(Conn *c, char *args)
+{
+	int edge = -1;
+	char *p = trim(args);
+	if (isdigit((unsigned char)*p)) {
+		edge = (int)strtol(p, &p, 10);
+	} else if (*p == '"') {
+		char *from = ++p, *q = strchr(p, '"');
+		char *arrow = q ? strstr(q, "->") : NULL;
+		char *to = arrow ? strchr(arrow, '"') : NULL;
+		char *end = to ? strchr(to + 1, '"') : NULL;
+		if (end) {
+			*q = *end = '\0';
+			edge = find_edge(from, to + 1);
+			p = end + 1;
+		}
+	}
+	if (edge < 0 || edge >= g_ctl_n_edges) {
+		reply(c, "ERROR no such edge\n");
+		return;
+	}
+
+	Tap *t = calloc(1, sizeof *t);
+	t->edge = edge;
+	t->conn = c;
+	for (char *tok; (tok = strtok(p, " \t")); p = NULL) {
+		if (strcmp(tok, "PREFIX") == 0 && (tok = strtok(NULL, " \t")))
+			snprintf(t->prefix, sizeof t->prefix, "%s", tok);
+		else if (strcmp(tok, "RATE") == 0 &&
+			 (tok = strtok(NULL, " \t")))
+			t->tokens = t->rate = atof(tok);
+		else if (strcmp(tok, "REGEX") == 0 &&
+			 (tok = strtok(NULL, ""))) {
+			if (regcomp(&t->re, trim(tok),
+				    REG_EXTENDED | REG_NOSUB) != 0) {
+				reply(c, "ERROR bad regex\n");
+				free_tap(t);
+				return;
+			}
+			t->has_re = 1;
+			break;
+		} else {
+			reply(c, "ERROR bad TAP option: %s\n", tok);
+			free_tap(t);
+			return;
+		}
+	}
+	t->partial = malloc(LINE_BUF);
+	clock_gettime(CLOCK_MONOTONIC, &t->last);
+
+	t->id = __atomic_fetch_add(&g_next_tap, 1, __ATOMIC_RELAXED);
+	TapList *l = &g_taps[edge];
+	pthread_mutex_lock(&l->mu);
+	t->next = l->head;
+	__atomic_store_n(&l->head, t, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&l->mu);
+	reply(c, "OK TAP %d\n", t->id);
+}
+
+static void report_untap(Conn *c, Tap *t)
+{
+	reply(c, "OK UNTAP %d lines=%llu rate=%llu full=%llu\n", t->id,
+	      (unsigned long long)t->lines, (unsigned long long)t->drop_rate,
+	      (unsigned long long)t->drop_full);
+}
+
+/* Reply with a snapshot taken under the edge locks, not while holding
+ * them: reply() waits for room in the ring, and a relay feeding the
+ * edge must not wait on this observer. */
+static void cmd_taps(Conn *c)
+{
+	typedef struct {
+		int id, edge;
+		uint64_t lines, drop_rate, drop_full;
+	} TapInfo;
+	TapInfo *info = NULL;
+	size_t n = 0, cap = 0;
+	for (int e = 0; e < g_ctl_n_edges; e++) {
+		pthread_mutex_lock(&g_taps[e].mu);
+		for (Tap *t = g_taps[e].head; t; t = t->next) {
+			if (t->conn != c)
+				continue;
+			if (n == cap) {
+				cap = cap ? cap * 2 : 8;
+				TapInfo *p = realloc(info, cap * sizeof *info);
+				if (!p)
+					die("realloc(taps)");
+				info = p;
+			}
+			info[n++] = (TapInfo){t->id, e, t->lines, t->drop_rate,
+					      t->drop_full};
+		}
+		pthread_mutex_unlock(&g_taps[e].mu);
+	}
+	for (size_t i = 0; i < n; i++)
+		reply(c, "TAP_INFO %d edge=%d lines=%llu rate=%llu full=%llu\n",
+		      info[i].id, info[i].edge,
+		      (unsigned long long)info[i].lines,
+		      (unsigned long long)info[i].drop_rate,
+		      (unsigned long long)info[i].drop_full);
+	free(info);
+	reply(c, "OK TAPS\n");
+}
+
+static void handle_control(Conn *c, char *line)
+{
+	char *cmd = trim(line);
+	if (strcmp(cmd, "EDGES") == 0) {
+		for (int i = 0; i < g_ctl_n_edges; i++)
+			reply(c, "EDGE %d \"%s\" -> \"%s\"\n", i,
+			      g_ctl_nodes[g_ctl_edges[i].from].cmd,
+			      g_ctl_nodes[g_ctl_edges[i].to].cmd);
+		reply(c, "OK EDGES\n");
+	} else if (strncmp(cmd, "TAP ", 4) == 0) {
+		cmd_tap(c, cmd + 4);
+	} else if (strcmp(cmd, "TAPS") == 0) {
+		cmd_taps(c);
+	} else if (strncmp(cmd, "UNTAP ", 6) == 0) {
+		Tap *t = unlink_taps(c, atoi(cmd + 6));
+		if (!t)
+			reply(c, "ERROR no such tap\n");
+		for (Tap *next; t; t = next) {
+			next = t->next;
+			report_untap(c, t);
+			free_tap(t);
+		}
+	} else if (*cmd)
+		reply(c, "ERROR unknown command\n");
+}
+
+static void *thr_conn_reader(void *arg)
+{
+	Conn *c = arg;
+	FILE *f = fdopen(dup(c->fd), "r");
+	char line[LINE_BUF];
+	while (f && fgets(line, sizeof line, f))
+		handle_control(c, line);
+	if (f)
+		fclose(f);
+	for (Tap *t = unlink_taps(c, -1), *next; t; t = next) {
+		next = t->next;
+		free_tap(t);
+	}
+	pthread_mutex_lock(&c->mu);
+	c->closed = 1;
+	pthread_cond_broadcast(&c->cv);
+	pthread_mutex_unlock(&c->mu);
+	conn_release(c);
+	return NULL;
+}
+
+static void *thr_control(void *arg)
+{
+	int lfd = (int)(intptr_t)arg;
+	for (;;) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		set_cloexec(fd);
+		Conn *c = calloc(1, sizeof *c);
+		c->fd = fd;
+		c->refs = 2;
+		pthread_mutex_init(&c->mu, NULL);
+		pthread_cond_init(&c->cv, NULL);
+		pthread_t th;
+		pthread_create(&th, NULL, thr_conn_writer, c);
+		pthread_detach(th);
+		pthread_create(&th, NULL, thr_conn_reader, c);
+		pthread_detach(th);
+	}
+	close(lfd);
+	return NULL;
+}
+
+static void unlink_ctl(void)
+{
+	unlink(g_ctl_path);
+}
+
+static void start_control(Node *nodes, Edge *edges, int n_edges)
+{
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(g_ctl_path) >= sizeof addr.sun_path)
+		die("control socket path too long");
+	strcpy(addr.sun_path, g_ctl_path);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+		die("socket(control)");
+	set_cloexec(lfd);
+	unlink(g_ctl_path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+	    listen(lfd, 8) != 0)
+		die("cannot listen on control socket");
+	atexit(unlink_ctl);
+
+	g_ctl_nodes = nodes;
+	g_ctl_edges = edges;
+	g_ctl_n_edges = n_edges;
+	g_taps = calloc((size_t)n_edges, sizeof *g_taps);
+	for (int i = 0; i < n_edges; i++)
+		pthread_mutex_init(&g_taps[i].mu, NULL);
+	pthread_t th;
+	pthread_create(&th, NULL, thr_control, (void *)(intptr_t)lfd);
+	pthread_detach(th);
+}
+
 static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 {
 	IntList *node_out = calloc((size_t)n_nodes, sizeof(IntList));
@@ -498,6 +1365,12 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		il_push(&node_in[edges[i].to], i);
 	}
 
+	pid_t *node_pid = calloc((size_t)n_nodes, sizeof(pid_t));
+	if (g_dot_path)
+		g_edge_stats = calloc((size_t)n_edges, sizeof(EdgeStat));
+	if (g_ctl_path)
+		start_control(nodes, edges, n_edges);
+
 	int *pipe_rd = malloc((size_t)n_edges * sizeof(int));
 	int *pipe_wr = malloc((size_t)n_edges * sizeof(int));
 	for (int i = 0; i < n_edges; i++) {
@@ -506,10 +1379,12 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 			die("pipe()");
 		pipe_rd[i] = fds[0];
 		pipe_wr[i] = fds[1];
+		set_cloexec(fds[0]);
+		set_cloexec(fds[1]);
 	}
 
 	pthread_t *threads =
-	    malloc((size_t)(n_nodes * 6 + 2) * sizeof(pthread_t));
+	    malloc((size_t)(n_nodes * 3 + n_edges) * sizeof(pthread_t));
 	int n_threads = 0;
 #define SPAWN(fn, arg) pthread_create(&threads[n_threads++], NULL, fn, arg)
 
@@ -522,12 +1397,17 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		int relay[2];
 		if (pipe(relay))
 			die("pipe(stdin relay)");
+		set_cloexec(relay[0]);
+		set_cloexec(relay[1]);
 		FanoutArg *fa = malloc(sizeof *fa);
 		fa->src_rd = relay[0];
 		fa->n_dst = outs->n;
 		fa->dst_wrs = malloc((size_t)outs->n * sizeof(int));
-		for (int j = 0; j < outs->n; j++)
+		fa->dst_edges = malloc((size_t)outs->n * sizeof(int));
+		for (int j = 0; j < outs->n; j++) {
 			fa->dst_wrs[j] = pipe_wr[outs->data[j]];
+			fa->dst_edges[j] = outs->data[j];
+		}
 		SPAWN(thr_fanout, fa);
 		SPAWN(thr_stdin_pump, (void *)(intptr_t)relay[1]);
 	}
@@ -540,6 +1420,7 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		for (int j = 0; j < ins->n; j++) {
 			StdoutArg *a = malloc(sizeof *a);
 			a->src_rd = pipe_rd[ins->data[j]];
+			a->edge = ins->data[j];
 			if (nodes[ni].kind == NT_STDOUT_IMM)
 				SPAWN(thr_stdout_imm, a);
 			else
@@ -551,10 +1432,11 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		if (nodes[ni].kind != NT_PROG)
 			continue;
 		IntList *outs = &node_out[ni], *ins = &node_in[ni];
-		char cmd_copy[512];
-		snprintf(cmd_copy, sizeof cmd_copy, "%s", nodes[ni].cmd);
-		char *argv_arr[MAX_ARGV];
-		char *argv_buf = parse_argv(cmd_copy, argv_arr, MAX_ARGV);
+		/* Two spare slots in front for the stdbuf wrapper */
+		int max_argv = (int)(strlen(nodes[ni].cmd) / 2) + 2;
+		char **wrap = malloc((size_t)(max_argv + 2) * sizeof(char *));
+		char **argv_arr = wrap + 2;
+		char *argv_buf = parse_argv(nodes[ni].cmd, argv_arr, max_argv);
 		if (argv_arr[0] == NULL) {
 			free(argv_buf);
 			die("empty command");
@@ -567,19 +1449,24 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 				die("pipe(stdin)");
 			cin_rd = fds[0];
 			cin_wr = fds[1];
+			set_cloexec(cin_wr);
 		}
 		if (outs->n > 0) {
-			int master, slave;
-			if (openpty(&master, &slave, NULL, NULL, NULL) == 0) {
-				cout_rd = master;
-				cout_wr = slave;
-			} else {
-				int fds[2];
-				if (pipe(fds))
-					die("pipe(stdout)");
-				cout_rd = fds[0];
-				cout_wr = fds[1];
-			}
+			int fds[2];
+			Transport tr = nodes[ni].out;
+			if (tr == TR_PTY &&
+			    openpty(&fds[0], &fds[1], NULL, NULL, NULL) != 0)
+				tr = TR_PIPE; /* no PTY available, fall back */
+			if (tr == TR_SOCKETPAIR) {
+				if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+					die("socketpair(stdout)");
+				shutdown(fds[0], SHUT_WR);
+				shutdown(fds[1], SHUT_RD);
+			} else if (tr == TR_PIPE && pipe(fds))
+				die("pipe(stdout)");
+			cout_rd = fds[0];
+			cout_wr = fds[1];
+			set_cloexec(cout_rd);
 		}
 
 		pid_t pid = fork();
@@ -608,9 +1495,16 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 				close(cout_rd);
 			if (cout_wr >= 0)
 				close(cout_wr);
-			for (int i = 0; i < n_edges; i++) {
-				close(pipe_rd[i]);
-				close(pipe_wr[i]);
+			/* Edge pipes are close-on-exec */
+			if (nodes[ni].out != TR_PTY && outs->n > 0) {
+				/* No PTY to force line buffering: ask stdio */
+				wrap[0] = "stdbuf";
+				wrap[1] = "-oL";
+				setenv("RUN_TRANSPORT",
+				       nodes[ni].out == TR_PIPE ? "pipe"
+								: "socketpair",
+				       1);
+				execvp(wrap[0], wrap);
 			}
 			execvp(argv_arr[0], argv_arr);
 			_exit(127);
@@ -620,14 +1514,18 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		if (cout_wr >= 0)
 			close(cout_wr);
 		register_child(pid);
+		node_pid[ni] = pid;
 
 		if (ins->n > 0) {
 			FaninArg *fa = malloc(sizeof *fa);
 			fa->n_src = ins->n;
 			fa->dst_wr = cin_wr;
 			fa->src_rds = malloc((size_t)ins->n * sizeof(int));
-			for (int j = 0; j < ins->n; j++)
+			fa->src_edges = malloc((size_t)ins->n * sizeof(int));
+			for (int j = 0; j < ins->n; j++) {
 				fa->src_rds[j] = pipe_rd[ins->data[j]];
+				fa->src_edges[j] = ins->data[j];
+			}
 			SPAWN(thr_fanin, fa);
 		}
 		if (outs->n > 0) {
@@ -635,8 +1533,11 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 			fa->src_rd = cout_rd;
 			fa->n_dst = outs->n;
 			fa->dst_wrs = malloc((size_t)outs->n * sizeof(int));
-			for (int j = 0; j < outs->n; j++)
+			fa->dst_edges = malloc((size_t)outs->n * sizeof(int));
+			for (int j = 0; j < outs->n; j++) {
 				fa->dst_wrs[j] = pipe_wr[outs->data[j]];
+				fa->dst_edges[j] = outs->data[j];
+			}
 			SPAWN(thr_fanout, fa);
 		} else if (cout_rd >= 0)
 			close(cout_rd);
@@ -646,8 +1547,16 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 		snprintf(wa->cmd, sizeof wa->cmd, "%s", argv_arr[0]);
 		SPAWN(thr_wait, wa);
 		free(argv_buf);
+		free(wrap);
 	}
 #undef SPAWN
+	if (g_dot_path) {
+		SnapArg *sa = malloc(sizeof *sa);
+		*sa = (SnapArg){nodes, n_nodes, edges, n_edges, node_pid};
+		pthread_t snap;
+		pthread_create(&snap, NULL, thr_snapshot, sa);
+		pthread_detach(snap);
+	}
 	for (int i = 0; i < n_threads; i++)
 		pthread_join(threads[i], NULL);
 	free(threads);
@@ -659,31 +1568,217 @@ static void run(Node *nodes, int n_nodes, Edge *edges, int n_edges)
 	free(node_in);
 	free(pipe_rd);
 	free(pipe_wr);
+	if (!g_dot_path)
+		free(node_pid); /* otherwise still read by the snapshot thread */
 }
 
-int main(int argc, char *argv[])
+/* Export the warp.so settings so that every child shares one clock origin */
+static void setup_warp(const char *self, const char *spec)
 {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <graph.dot>\n", argv[0]);
-		return 1;
+	char *end;
+	double speed = strtod(spec, &end);
+	if (speed <= 0.0 || (*end && *end != '@'))
+		die("-w expects <speed>[@<epoch>]");
+
+	char lib[4096];
+	const char *env_lib = getenv("WARP_LIB");
+	if (env_lib)
+		snprintf(lib, sizeof lib, "%s", env_lib);
+	else {
+		char *dir = realpath(self, NULL);
+		if (!dir)
+			die("cannot locate run executable for warp.so");
+		char *slash = strrchr(dir, '/');
+		*slash = '\0';
+		snprintf(lib, sizeof lib, "%s/warp.so", dir);
+		free(dir);
 	}
-	FILE *f = fopen(argv[1], "r");
-	if (!f)
-		die("fopen");
-	fseek(f, 0, SEEK_END);
-	long sz = ftell(f);
+	if (access(lib, R_OK) != 0)
+		die("warp.so not found (set WARP_LIB)");
+
+	struct timespec rt, mt;
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	char val[4096 + 64];
+	snprintf(val, sizeof val, "%g", speed);
+	setenv("WARP_SPEED", val, 1);
+	snprintf(val, sizeof val, "%lld",
+		 *end ? atoll(end + 1) : (long long)rt.tv_sec);
+	setenv("WARP_EPOCH", val, 1);
+	snprintf(val, sizeof val, "%lld",
+		 (long long)rt.tv_sec * 1000000000LL + rt.tv_nsec);
+	setenv("WARP_REAL0", val, 1);
+	snprintf(val, sizeof val, "%lld",
+		 (long long)mt.tv_sec * 1000000000LL + mt.tv_nsec);
+	setenv("WARP_MONO0", val, 1);
+
+	const char *pre = getenv("LD_PRELOAD");
+	if (pre && *pre)
+		snprintf(val, sizeof val, "%s:%s", lib, pre);
+	else
+		snprintf(val, sizeof val, "%s", lib);
+	setenv("LD_PRELOAD", val, 1);
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void copy_out(FILE *f)
+{
+	char buf[LINE_BUF];
+	size_t n;
 	rewind(f);
-	char *src = malloc((size_t)sz + 1);
-	if (fread(src, 1, (size_t)sz, f) != (size_t)sz)
-		die("fread");
-	src[sz] = '\0';
+	while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fflush(stdout);
 	fclose(f);
-	static Node nodes[MAX_NODES];
-	static Edge edges[MAX_EDGES];
-	int n_nodes = 0, n_edges = 0;
-	parse_graph(src, nodes, &n_nodes, edges, &n_edges);
-	free(src);
-	if (n_edges > 0)
-		run(nodes, n_nodes, edges, n_edges);
-	return 0;
+}
+
+typedef struct {
+	pid_t pid;
+	FILE *out;
+	int done, failed;
+} Shard;
+
+/* Run one instance of the graph per input file, at most jobs at a time */
+static int run_batch(Node *nodes, int n_nodes, Edge *edges, int n_edges,
+		     char **inputs, int n_inputs, int jobs)
+{
+	int has_stdin = 0;
+	for (int i = 0; i < n_nodes; i++)
+		has_stdin |= nodes[i].kind == NT_STDIN;
+	if (!has_stdin)
+		die("batch mode needs a STDIN node");
+
+	Shard *sh = calloc((size_t)n_inputs, sizeof *sh);
+	int next_start = 0, next_emit = 0, running = 0, failed = 0;
+	double t0 = now_s();
+	fflush(stdout);
+
+	while (next_emit < n_inputs) {
+		while (running < jobs && next_start < n_inputs) {
+			Shard *s = &sh[next_start];
+			int in = open(inputs[next_start], O_RDONLY);
+			if (in < 0) {
+				fprintf(stderr,
+					"\x1b[31mError:\x1b[0m open('%s'): %s\n",
+					inputs[next_start], strerror(errno));
+				s->done = s->failed = 1;
+				next_start++;
+				continue;
+			}
+			if (!(s->out = tmpfile()))
+				die("tmpfile()");
+			s->pid = fork();
+			if (s->pid < 0)
+				die("fork()");
+			if (s->pid == 0) {
+				dup2(in, STDIN_FILENO);
+				dup2(fileno(s->out), STDOUT_FILENO);
+				close(in);
+				g_drain = 1;
+				run(nodes, n_nodes, edges, n_edges);
+				fflush(stdout);
+				_exit(0);
+			}
+			close(in);
+			running++;
+			next_start++;
+		}
+
+		while (next_emit < n_inputs && sh[next_emit].done) {
+			if (sh[next_emit].out)
+				copy_out(sh[next_emit].out);
+			failed += sh[next_emit].failed;
+			next_emit++;
+		}
+		if (running == 0)
+			continue;
+
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0)
+			die("wait()");
+		for (int i = next_emit; i < next_start; i++) {
+			if (sh[i].pid != pid)
+				continue;
+			sh[i].done = 1;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				sh[i].failed = 1;
+				fprintf(stderr,
+					"\x1b[31mError:\x1b[0m batch input "
+					"'%s' failed\n",
+					inputs[i]);
+			}
+			running--;
+		}
+	}
+
+	double dt = now_s() - t0;
+	fprintf(stderr,
+		"batch: %d sessions in %.2f s (%.1f sessions/s, %d jobs)\n",
+		n_inputs, dt, dt > 0 ? n_inputs / dt : 0.0, jobs);
+	free(sh);
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, jobs = (int)sysconf(_SC_NPROCESSORS_ONLN), parse_only = 0;
+	while ((opt = getopt(argc, argv, "nw:d:c:j:")) != -1) {
+		if (opt == 'n')
+			parse_only = 1;
+		else if (opt == 'c')
+			g_ctl_path = optarg;
+		else if (opt == 'w')
+			setup_warp(argv[0], optarg);
+		else if (opt == 'd') {
+			char *colon = strrchr(optarg, ':');
+			if (colon) {
+				*colon = '\0';
+				g_dot_secs = atoi(colon + 1);
+			}
+			g_dot_path = optarg;
+			if (g_dot_secs < 1)
+				die("-d interval must be at least 1 s");
+		}
+		else if (opt == 'j')
+			jobs = atoi(optarg);
+		else
+			optind = argc + 1;
+	}
+	if (optind >= argc || jobs < 1) {
+		fprintf(stderr,
+			"Usage: %s [-n] [-w <speed>[@<epoch>]] [-d <path>[:<secs>]] "
+			"[-c <socket>] [-j <jobs>] <graph.dot> [<input>...]\n",
+			argv[0]);
+		return 1;
+	}
+	Graph g = {0};
+	double t0 = now_s();
+	parse_file(&g, argv[optind], 0);
+	if (parse_only) {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(stderr,
+			"parsed %d nodes, %d edges in %.1f ms, max RSS %ld KB\n",
+			g.n_nodes, g.n_edges, (now_s() - t0) * 1e3,
+			ru.ru_maxrss);
+		free_graph(&g);
+		return 0;
+	}
+	if (optind + 1 < argc && (g_dot_path || g_ctl_path))
+		die("-d and -c are not supported in batch mode");
+	int rc = 0;
+	if (optind + 1 < argc)
+		rc = run_batch(g.nodes, g.n_nodes, g.edges, g.n_edges,
+			       &argv[optind + 1], argc - optind - 1, jobs);
+	else if (g.n_edges > 0)
+		run(g.nodes, g.n_nodes, g.edges, g.n_edges);
+	free_graph(&g);
+	return rc;
 }
@@ -8,11 +8,56 @@
  * Implements a dual-oscillator subtractive synth with per-voice
  * ADSR envelopes and low-pass filtering.
  *
+ * Voices are kept as a structure of arrays with the sounding ones
+ * packed at the front, and rendered BLOCK frames at a time by a kernel
+ * that works on VEC voices at once (SSE, AVX or NEON through compiler
+ * vector extensions, plain C elsewhere), so the cost of the audio
+ * callback grows with the number of sounding voices only.  See
+ * bench/synth.c for its measurement.
+ *
+ * Envelopes run at control rate.  Each segment is a map of the level,
+ * mul * level + add (a line, or an exponential approach), computed per
+ * sample and composed over a block whenever its params change; the
+ * callback steps every voice's envelope once per block and the kernel
+ * interpolates linearly between the block ends.
+ *
+ * Only the audio thread touches the voices and parameters.  The main
+ * thread parses stdin into commands and passes them through a wait-free
+ * single-producer/single-consumer ring; the callback applies all queued
+ * commands before it renders, so every parameter change takes effect
+ * at a block boundary and no block sees a half-updated voice.  If the
+ * ring is full, the main thread waits for the callback to drain it.
+ *
+ * Each MIDI note sounds on at most one voice: striking a note that is
+ * still sounding, even in release, attacks its voice again from where
+ * the envelope stands.  When all MAX_POLYPHONY voices are busy, a new
+ * note takes over the quietest voice in release, or failing that the
+ * oldest one; the stolen voice fades out over STEAL_TIME before the new
+ * note starts on it, so the takeover does not click.
+ *
+ * USAGE
+ *   synth                     Play stdin on the default audio device.
+ *   synth --render <out.wav>  Render stdin to a 32-bit float stereo WAV
+ *                             file, as fast as possible, without an
+ *                             audio device, then report the realtime
+ *                             factor.  The voices and the callback are
+ *                             the same as for playing, and the output
+ *                             depends on the input only.  With "-" as
+ *                             the file, the WAV is built in memory and
+ *                             written to stdout at the end.
+ *
  * INPUT (stdin)
  *   NOTE_ON <pitch>     Trigger a note.
  *   NOTE_OFF <pitch>    Release a note (triggers ADSR release).
  *   SET <param> <val>   Adjust synth parameters.
  *
+ *   With --render, a line applies at the time given by an "AT <ms>"
+ *   prefix, counted from the start of the file, or by a TIME:<ms> field
+ *   as in the logs of midi.c, counted from the first such field.  Lines
+ *   with neither apply at the time of the line before, and lines whose
+ *   time has passed apply at once.  Past the last line, the file
+ *   continues until all voices are silent, at most RENDER_TAIL seconds.
+ *
  * COMMANDS (stdin)
  *   SET ATTACK <val>       Envelope attack time (seconds)
  *   SET DECAY <val>        Envelope decay time (seconds)
@@ -27,102 +72,769 @@
  *   SET OSC1_CUTOFF <val>  Oscillator 1 LPF alpha (0.0 to 1.0)
  *   SET OSC2_CUTOFF <val>  Oscillator 2 LPF alpha (0.0 to 1.0)
  *   SET MASTER_GAIN <val>  Global output volume
+ *   SET ENV_SHAPE <val>    Envelope segments: 0 linear, 1 exponential
+ *
+ * OUTPUT (stdout, every STATUS_PERIOD seconds while playing)
+ *   STATUS SYNTH load=<pct> p99=<us> xruns=<n>
+ *       load is the share of the period spent in the audio callback and
+ *       p99 the 99th percentile of its execution time, rounded up to
+ *       HIST_US, both over the last period; the callback times itself
+ *       into a histogram with relaxed atomics.  xruns counts, since the
+ *       start, underruns logged by the backend, interruptions and
+ *       reroutes notified by miniaudio, and callbacks that started after
+ *       the audio of the ones before can have run out of the device
+ *       buffer (not checked on the null backend, which has no device).
+ *
+ * OUTPUT (stderr, at exit)
+ *   synth: rendered <s> s in <s> s, realtime factor <x>  (--render only)
+ *   synth: notes stolen=<n> dropped=<n> cmds dropped=<n>
+ *       Notes that took over a busy voice, notes that found none (all
+ *       voices already being stolen), and commands lost to a full ring.
  */
 
 #define MINIAUDIO_IMPLEMENTATION
 #include <math.h>
 #include <miniaudio.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define SAMPLE_RATE 48000
 #define BUFFER_SIZE 64
+#ifndef MAX_POLYPHONY
 #define MAX_POLYPHONY 16
+#endif
 #define HEADROOM 4.0f
+#define VEC 8	 /* voices rendered together by the kernel */
+#define BLOCK 64 /* frames rendered at a time */
+#define MAX_VOICES ((MAX_POLYPHONY + VEC - 1) / VEC * VEC)
+#define N_NOTES 128	    /* MIDI note numbers */
+#define STEAL_TIME 0.003f   /* fast release of a stolen voice, seconds */
+#define ENV_EXP_RATIO 0.01f /* exponential segments aim this far past */
+#define RENDER_TAIL 10	    /* longest ring-out after --render input, s */
+#define HIST_N 256	    /* buckets of callback execution time */
+#define HIST_US 10	    /* width of one bucket, microseconds */
+#define XRUN_DRIFT 1e-3	    /* device clock error allowed by xrun check */
+#define STATUS_PERIOD 1	    /* seconds between STATUS lines */
+#define CMD_RING_SZ 256	    /* must be a power of two */
+#define CMD_WAIT_NS 1000000 /* retry interval when the ring is full */
+#define CMD_WAIT_MAX 1000   /* retries before a command is dropped */
+
+#if defined(__GNUC__)
+#define ALIGNED __attribute__((aligned(VEC * sizeof(float))))
+#else
+#define ALIGNED
+#endif
 
 typedef enum {
 	ENV_IDLE,
 	ENV_ATTACK,
 	ENV_DECAY,
 	ENV_SUSTAIN,
-	ENV_RELEASE
+	ENV_RELEASE,
+	ENV_STEAL,   /* fast release before starting another note */
+	ENV_RESTART, /* stolen and silent, starts its next note */
+	N_ENV_STATES
 } EnvState;
 
+typedef enum { ENV_LINEAR, ENV_EXPONENTIAL } EnvShape;
+
+typedef enum {
+	PARAM_ATTACK,
+	PARAM_DECAY,
+	PARAM_SUSTAIN,
+	PARAM_RELEASE,
+	PARAM_OSC1_GAIN,
+	PARAM_OSC2_GAIN,
+	PARAM_OSC1_OCT,
+	PARAM_OSC2_OCT,
+	PARAM_OSC1_DETUNE,
+	PARAM_OSC2_DETUNE,
+	PARAM_OSC1_CUTOFF,
+	PARAM_OSC2_CUTOFF,
+	PARAM_MASTER_GAIN,
+	PARAM_ENV_SHAPE,
+	N_PARAMS
+} ParamId;
+
+static const char *const PARAM_NAMES[N_PARAMS] = {
+    "ATTACK",	   "DECAY",	  "SUSTAIN",	 "RELEASE",
+    "OSC1_GAIN",   "OSC2_GAIN",	  "OSC1_OCT",	 "OSC2_OCT",
+    "OSC1_DETUNE", "OSC2_DETUNE", "OSC1_CUTOFF", "OSC2_CUTOFF",
+    "MASTER_GAIN", "ENV_SHAPE"};
+
+typedef enum { CMD_NOTE_ON, CMD_NOTE_OFF, CMD_SET } CmdType;
+
+/* Command from the main thread to the audio thread */
+typedef struct {
+	CmdType type;
+	int arg;      /* MIDI note, or ParamId for CMD_SET */
+	float val;    /* parameter value, CMD_SET only */
+	int64_t t_ns; /* when it was queued, CLOCK_MONOTONIC */
+} Cmd;
+
 typedef struct {
 	float osc1_gain, osc2_gain;
 	float osc1_cutoff, osc2_cutoff;
 	float osc1_detune, osc2_detune;
 	int osc1_oct, osc2_oct;
 	float attack, decay, sustain, release;
+	EnvShape env_shape;
 	float master_gain;
 } Params;
 
+/* Voice state as a structure of arrays, so the render kernel can load
+   VEC voices at once.  The n sounding voices occupy slots 0..n-1; when
+   one falls silent, the last one moves into its slot.  slot[] maps each
+   MIDI note to the voice playing it, so a note is found without a
+   search and is never played by two voices at once. */
 typedef struct {
-	float freq;
-	float target_f1, target_f2;
-	double phase1, phase2;
-	float lpf1, lpf2;
-	EnvState state;
-	float env_vol;
-	bool active;
-} Voice;
+	float phase1[MAX_VOICES] ALIGNED;
+	float phase2[MAX_VOICES] ALIGNED;
+	float inc1[MAX_VOICES] ALIGNED; /* phase step per sample */
+	float inc2[MAX_VOICES] ALIGNED;
+	float rinc1[MAX_VOICES] ALIGNED; /* 1 / inc, for the PolyBLEP */
+	float rinc2[MAX_VOICES] ALIGNED;
+	float lpf1[MAX_VOICES] ALIGNED;
+	float lpf2[MAX_VOICES] ALIGNED;
+	float env_vol[MAX_VOICES];
+	float freq[MAX_VOICES];
+	EnvState state[MAX_VOICES];
+	int note[MAX_VOICES]; /* MIDI note, or the next one if stolen; -1 */
+	unsigned long age[MAX_VOICES]; /* value of started when struck */
+	unsigned short slot[N_NOTES];  /* voice index + 1, or 0 if none */
+	unsigned long started;
+	int n;
+} Voices;
 
 typedef struct {
-	Voice voices[MAX_POLYPHONY];
+	/* Audio thread only */
+	Voices v;
 	Params p;
+
+	/* Envelope of each voice over the block being rendered: the level
+	   before its first frame, and the step per frame */
+	float env0[MAX_VOICES] ALIGNED;
+	float denv[MAX_VOICES] ALIGNED;
+
+	/* Each envelope segment maps the level as mul * level + add; per
+	   sample, and composed over a BLOCK.  Set by set_env_rates() */
+	double env_c[N_ENV_STATES], env_d[N_ENV_STATES];
+	float env_mul[N_ENV_STATES], env_add[N_ENV_STATES];
+
+	unsigned long notes_stolen; /* voices taken over by a new note */
+	unsigned long notes_dropped; /* notes with no voice to steal */
+
+	/* Command ring: the main thread advances cmd_head, the callback
+	   cmd_tail; both are free-running, the slot is index % size */
+	Cmd cmd[CMD_RING_SZ];
+	unsigned int cmd_head;
+	unsigned int cmd_tail;
+	unsigned long cmd_dropped; /* main thread only */
+
+	/* Time from queueing to applying commands, in frames; audio
+	   thread only */
+	unsigned long cmd_applied;
+	double cmd_lat_sum;
+	float cmd_lat_max;
+
+	/* Callback health: counted by the audio thread and read by the
+	   status thread, with relaxed atomics */
+	unsigned long cb_hist[HIST_N]; /* execution times, HIST_US each */
+	uint64_t cb_busy_ns;	       /* total execution time */
+	unsigned long xruns;
+	int xrun_reported; /* by the backend since the last callback */
+	int64_t cb_buf_ns; /* device buffer; 0 disables the xrun check */
+	int64_t cb_end_ns; /* when the audio delivered so far runs out */
+
+	/* Status thread */
+	pthread_mutex_t status_mu;
+	pthread_cond_t status_cv;
+	bool status_stop;
 } Synth;
 
+int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Set the phase steps of voice i from its frequency and the params */
+void set_voice_freq(Synth *synth, int i)
+{
+	float f = synth->v.freq[i] / SAMPLE_RATE;
+	synth->v.inc1[i] =
+	    f * powf(2.0f, synth->p.osc1_oct) * synth->p.osc1_detune;
+	synth->v.inc2[i] =
+	    f * powf(2.0f, synth->p.osc2_oct) * synth->p.osc2_detune;
+	synth->v.rinc1[i] = 1.0f / synth->v.inc1[i];
+	synth->v.rinc2[i] = 1.0f / synth->v.inc2[i];
+}
+
 /* Helper to update voice target frequencies when params change */
 void update_voice_frequencies(Synth *synth)
 {
-	for (int i = 0; i < MAX_POLYPHONY; i++) {
-		if (synth->voices[i].active) {
-			float f = synth->voices[i].freq;
-			synth->voices[i].target_f1 = f *
-			    powf(2.0f, synth->p.osc1_oct) *
-			    synth->p.osc1_detune;
-			synth->voices[i].target_f2 = f *
-			    powf(2.0f, synth->p.osc2_oct) *
-			    synth->p.osc2_detune;
+	for (int i = 0; i < synth->v.n; i++)
+		set_voice_freq(synth, i);
+}
+
+/* Map of envelope segment s over n samples: the per-sample map applied
+   n times */
+void env_map(const Synth *synth, EnvState s, int n, float *mul, float *add)
+{
+	double c = synth->env_c[s], d = synth->env_d[s];
+	double cn = pow(c, n);
+	*mul = (float)cn;
+	*add = (float)(c == 1.0 ? d * n : d * (1.0 - cn) / (1.0 - c));
+}
+
+/* Per-sample map of the segment from level a to b in the given time:
+   a straight line, or an exponential approach to a target ENV_EXP_RATIO
+   beyond b, which crosses b after the same time */
+static void set_segment(Synth *synth, EnvState s, float a, float b,
+			float time)
+{
+	double n = fmax((double)time * SAMPLE_RATE, 1.0);
+	if (synth->p.env_shape == ENV_EXPONENTIAL) {
+		double r = b > a ? ENV_EXP_RATIO : -ENV_EXP_RATIO;
+		double c = pow(ENV_EXP_RATIO / (fabs(b - a) + ENV_EXP_RATIO),
+			       1.0 / n);
+		synth->env_c[s] = c;
+		synth->env_d[s] = (b + r) * (1.0 - c);
+	} else {
+		synth->env_c[s] = 1.0;
+		synth->env_d[s] = (b - a) / n;
+	}
+}
+
+/* Recompute the envelope segments after a change of their params */
+void set_env_rates(Synth *synth)
+{
+	const Params *p = &synth->p;
+	for (int s = 0; s < N_ENV_STATES; s++) {
+		synth->env_c[s] = 1.0;
+		synth->env_d[s] = 0.0;
+	}
+	set_segment(synth, ENV_ATTACK, 0.0f, 1.0f, p->attack);
+	set_segment(synth, ENV_DECAY, 1.0f, p->sustain, p->decay);
+	set_segment(synth, ENV_RELEASE, p->sustain, 0.0f, p->release);
+	synth->env_d[ENV_STEAL] = -1.0 / (STEAL_TIME * SAMPLE_RATE);
+	for (int s = 0; s < N_ENV_STATES; s++)
+		env_map(synth, (EnvState)s, BLOCK, &synth->env_mul[s],
+			&synth->env_add[s]);
+}
+
+float midi_to_freq(int note)
+{
+	return 440.0f * powf(2.0f, (note - 69) / 12.0f);
+}
+
+/* Start voice i on a MIDI note, from silence */
+void start_voice(Synth *synth, int i, int note)
+{
+	Voices *v = &synth->v;
+	v->note[i] = note;
+	v->slot[note] = (unsigned short)(i + 1);
+	v->age[i] = v->started++;
+	v->freq[i] = midi_to_freq(note);
+	set_voice_freq(synth, i);
+	v->phase1[i] = v->phase2[i] = 0.0f;
+	v->lpf1[i] = v->lpf2[i] = 0.0f;
+	v->state[i] = ENV_ATTACK;
+	v->env_vol[i] = 0.0f;
+}
+
+/* Voice to give to a new note when all are busy: the quietest one in
+   release, else the oldest; -1 if all are being stolen already */
+int steal_voice(const Voices *v)
+{
+	int best = -1;
+	for (int i = 0; i < v->n; i++) {
+		if (v->state[i] == ENV_STEAL || v->state[i] == ENV_RESTART)
+			continue;
+		if (best < 0) {
+			best = i;
+			continue;
+		}
+		bool rel = v->state[i] == ENV_RELEASE;
+		if (rel != (v->state[best] == ENV_RELEASE)) {
+			if (rel)
+				best = i;
+		} else if (rel ? v->env_vol[i] < v->env_vol[best]
+			       : v->age[i] < v->age[best]) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+void note_on(Synth *synth, int note)
+{
+	Voices *v = &synth->v;
+	if (note < 0 || note >= N_NOTES)
+		return;
+
+	/* Re-struck: attack again from the present level */
+	int i = v->slot[note] - 1;
+	if (i >= 0) {
+		if (v->state[i] != ENV_STEAL)
+			v->state[i] = ENV_ATTACK;
+		v->age[i] = v->started++;
+		return;
+	}
+
+	if (v->n < MAX_POLYPHONY) {
+		start_voice(synth, v->n++, note);
+		return;
+	}
+
+	/* Fade the stolen voice out quickly, then start the note on it */
+	i = steal_voice(v);
+	if (i < 0) {
+		synth->notes_dropped++;
+		return;
+	}
+	v->slot[v->note[i]] = 0;
+	v->note[i] = note;
+	v->slot[note] = (unsigned short)(i + 1);
+	v->state[i] = ENV_STEAL;
+	synth->notes_stolen++;
+}
+
+void note_off(Synth *synth, int note)
+{
+	Voices *v = &synth->v;
+	if (note < 0 || note >= N_NOTES || v->slot[note] == 0)
+		return;
+
+	int i = v->slot[note] - 1;
+	if (v->state[i] == ENV_STEAL) {
+		/* Released before it started: let the old note fade out */
+		v->note[i] = -1;
+		v->slot[note] = 0;
+	} else {
+		v->state[i] = ENV_RELEASE;
+	}
+}
+
+void apply_set(Synth *synth, ParamId param, float val)
+{
+	Params *p = &synth->p;
+
+	switch (param) {
+	case PARAM_ATTACK:
+		p->attack = val;
+		set_env_rates(synth);
+		break;
+	case PARAM_DECAY:
+		p->decay = val;
+		set_env_rates(synth);
+		break;
+	case PARAM_SUSTAIN:
+		p->sustain = val;
+		set_env_rates(synth);
+		break;
+	case PARAM_RELEASE:
+		p->release = val;
+		set_env_rates(synth);
+		break;
+	case PARAM_OSC1_GAIN:
+		p->osc1_gain = val;
+		break;
+	case PARAM_OSC2_GAIN:
+		p->osc2_gain = val;
+		break;
+	case PARAM_OSC1_OCT:
+		p->osc1_oct = (int)val;
+		update_voice_frequencies(synth);
+		break;
+	case PARAM_OSC2_OCT:
+		p->osc2_oct = (int)val;
+		update_voice_frequencies(synth);
+		break;
+	case PARAM_OSC1_DETUNE:
+		p->osc1_detune = val;
+		update_voice_frequencies(synth);
+		break;
+	case PARAM_OSC2_DETUNE:
+		p->osc2_detune = val;
+		update_voice_frequencies(synth);
+		break;
+	case PARAM_OSC1_CUTOFF:
+		p->osc1_cutoff = val;
+		break;
+	case PARAM_OSC2_CUTOFF:
+		p->osc2_cutoff = val;
+		break;
+	case PARAM_MASTER_GAIN:
+		p->master_gain = val;
+		break;
+	case PARAM_ENV_SHAPE:
+		p->env_shape = val >= 0.5f ? ENV_EXPONENTIAL : ENV_LINEAR;
+		set_env_rates(synth);
+		break;
+	default:
+		break;
+	}
+}
+
+void apply_cmd(Synth *synth, const Cmd *c)
+{
+	if (c->type == CMD_NOTE_ON)
+		note_on(synth, c->arg);
+	else if (c->type == CMD_NOTE_OFF)
+		note_off(synth, c->arg);
+	else
+		apply_set(synth, (ParamId)c->arg, c->val);
+}
+
+/* Queue a command for the audio thread; returns -1 if the ring stayed
+   full for CMD_WAIT_MAX retries and the command was dropped */
+int push_cmd(Synth *synth, CmdType type, int arg, float val)
+{
+	unsigned int head = synth->cmd_head;
+	struct timespec wait = {0, CMD_WAIT_NS};
+
+	for (int i = 0;
+	     head - __atomic_load_n(&synth->cmd_tail, __ATOMIC_ACQUIRE) ==
+	     CMD_RING_SZ;
+	     i++) {
+		if (i == CMD_WAIT_MAX) {
+			synth->cmd_dropped++;
+			return -1;
 		}
+		nanosleep(&wait, NULL);
 	}
+	Cmd *c = &synth->cmd[head % CMD_RING_SZ];
+	c->type = type;
+	c->arg = arg;
+	c->val = val;
+	c->t_ns = now_ns();
+	__atomic_store_n(&synth->cmd_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
 }
 
-float update_env(Voice *v, Params *p)
+/* Apply every queued command; called by the audio thread */
+void drain_cmds(Synth *synth)
 {
-	float a_step = 1.0f / (p->attack * SAMPLE_RATE);
-	float d_step = (1.0f - p->sustain) / (p->decay * SAMPLE_RATE);
-	float r_step = p->sustain / (p->release * SAMPLE_RATE);
+	unsigned int tail = synth->cmd_tail;
+	unsigned int head =
+	    __atomic_load_n(&synth->cmd_head, __ATOMIC_ACQUIRE);
+	if (tail == head)
+		return;
+
+	int64_t now = now_ns();
+	for (; tail != head; tail++) {
+		const Cmd *c = &synth->cmd[tail % CMD_RING_SZ];
+		apply_cmd(synth, c);
 
-	switch (v->state) {
+		float lat = (float)(now - c->t_ns) * (SAMPLE_RATE / 1e9f);
+		synth->cmd_lat_sum += lat;
+		if (lat > synth->cmd_lat_max)
+			synth->cmd_lat_max = lat;
+		synth->cmd_applied++;
+	}
+	__atomic_store_n(&synth->cmd_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Remove the voices whose release has ended */
+void compact_voices(Voices *v)
+{
+	int i = 0;
+	while (i < v->n) {
+		if (v->state[i] != ENV_IDLE) {
+			i++;
+			continue;
+		}
+		if (v->note[i] >= 0 && v->slot[v->note[i]] == i + 1)
+			v->slot[v->note[i]] = 0;
+		int j = --v->n;
+		if (j == i)
+			break;
+		v->phase1[i] = v->phase1[j];
+		v->phase2[i] = v->phase2[j];
+		v->inc1[i] = v->inc1[j];
+		v->inc2[i] = v->inc2[j];
+		v->rinc1[i] = v->rinc1[j];
+		v->rinc2[i] = v->rinc2[j];
+		v->lpf1[i] = v->lpf1[j];
+		v->lpf2[i] = v->lpf2[j];
+		v->env_vol[i] = v->env_vol[j];
+		v->freq[i] = v->freq[j];
+		v->state[i] = v->state[j];
+		v->note[i] = v->note[j];
+		v->age[i] = v->age[j];
+		if (v->note[i] >= 0)
+			v->slot[v->note[i]] = (unsigned short)(i + 1);
+		v->state[j] = ENV_IDLE;
+	}
+}
+
+/* Advance the envelope of voice i over one block, whose segment maps
+   are mul and add; returns the level at the end of the block */
+float update_env(Voices *v, int i, const float *mul, const float *add,
+		 float sustain)
+{
+	EnvState s = v->state[i];
+	float e = mul[s] * v->env_vol[i] + add[s];
+
+	switch (s) {
 	case ENV_ATTACK:
-		v->env_vol += a_step;
-		if (v->env_vol >= 1.0f) {
-			v->env_vol = 1.0f;
-			v->state = ENV_DECAY;
+		if (e >= 1.0f) {
+			e = 1.0f;
+			v->state[i] = ENV_DECAY;
 		}
 		break;
 	case ENV_DECAY:
-		v->env_vol -= d_step;
-		if (v->env_vol <= p->sustain) {
-			v->env_vol = p->sustain;
-			v->state = ENV_SUSTAIN;
+		if (e <= sustain) {
+			e = sustain;
+			v->state[i] = ENV_SUSTAIN;
 		}
 		break;
 	case ENV_RELEASE:
-		v->env_vol -= r_step;
-		if (v->env_vol <= 0.0f) {
-			v->env_vol = 0.0f;
-			v->state = ENV_IDLE;
-			v->active = false;
+		if (e <= 0.0f) {
+			e = 0.0f;
+			v->state[i] = ENV_IDLE;
+		}
+		break;
+	case ENV_STEAL:
+		if (e <= 0.0f) {
+			e = 0.0f;
+			v->state[i] = v->note[i] < 0 ? ENV_IDLE : ENV_RESTART;
 		}
 		break;
 	default:
 		break;
 	}
-	return v->env_vol;
+	v->env_vol[i] = e;
+	return e;
+}
+
+/*
+ * Oscillators: band-limited squares by PolyBLEP.  The naive square
+ * jumps between +1 and -1 at phases 0 and 0.5; a jump that falls
+ * between two samples aliases.  Within one phase step dt of each jump,
+ * PolyBLEP adds the difference between the jump and a two-sample
+ * polynomial ramp (the integral of a triangular band-limited impulse),
+ * which removes most of the aliasing at the cost of a few multiplies.
+ * Both corrections are computed for every sample and masked, so the
+ * code has no branches and vectorises.
+ */
+
+/* Correction for a unit upward jump at phase 0, for phase t, step dt
+   and r = 1 / dt */
+static inline float blep(float t, float dt, float r)
+{
+	if (t < dt) {
+		float x = t * r;
+		return x * (2.0f - x) - 1.0f;
+	}
+	if (t > 1.0f - dt) {
+		float x = (t - 1.0f) * r;
+		return x * (x + 2.0f) + 1.0f;
+	}
+	return 0.0f;
+}
+
+/* Square wave of amplitude gain, +gain for phase t < 0.5 */
+static inline float square(float t, float dt, float r, float gain)
+{
+	float t2 = t + 0.5f;
+	if (t2 >= 1.0f)
+		t2 -= 1.0f;
+	return (t < 0.5f ? gain : -gain) +
+	       gain * (blep(t, dt, r) - blep(t2, dt, r));
+}
+
+/*
+ * Render kernel: add n frames of voices [0, lanes) into acc, where
+ * acc[f][k] collects the voices k, k + VEC, k + 2 * VEC, ... and the
+ * envelope of voice i at frame f is env0[i] + (f + 1) * denv[i] (0
+ * past the sounding voices).  With GCC or Clang, each oscillator,
+ * filter and envelope operation is done on VEC voices at once with
+ * vector extensions, which compile to SSE, AVX or NEON as the target
+ * allows; on x86-64 Linux, an AVX2 variant is also built and picked at
+ * load time.
+ */
+#if defined(__GNUC__)
+typedef float vf __attribute__((vector_size(VEC * sizeof(float))));
+typedef int vi __attribute__((vector_size(VEC * sizeof(int))));
+
+/* VEC lanes of blep() */
+#define V_BLEP(t, dt, r)                                                  \
+	({                                                                \
+		vf x0_ = (t) * (r), x1_ = ((t)-1.0f) * (r);               \
+		(vf)(((vi)((t) < (dt)) & (vi)(x0_ * (2.0f - x0_) - 1.0f)) | \
+		     ((vi)((t) > 1.0f - (dt)) &                           \
+		      (vi)(x1_ * (x1_ + 2.0f) + 1.0f)));                   \
+	})
+
+/* The clone resolver runs before ThreadSanitizer is initialised */
+#if defined(__x86_64__) && defined(__linux__) && !defined(__SANITIZE_THREAD__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void render_voices(Voices *v, const Params *p, int lanes, int n,
+			  const float *env0, const float *denv,
+			  float (*acc)[VEC])
+{
+	const vf zero = {0};
+	const vf one = zero + 1.0f, half = zero + 0.5f;
+	const vf g1 = zero + p->osc1_gain, g2 = zero + p->osc2_gain;
+	const vf c1 = zero + p->osc1_cutoff, c2 = zero + p->osc2_cutoff;
+
+	for (int g = 0; g < lanes; g += VEC) {
+		vf ph1 = *(vf *)(v->phase1 + g), ph2 = *(vf *)(v->phase2 + g);
+		vf i1 = *(vf *)(v->inc1 + g), i2 = *(vf *)(v->inc2 + g);
+		vf r1 = *(vf *)(v->rinc1 + g), r2 = *(vf *)(v->rinc2 + g);
+		vf l1 = *(vf *)(v->lpf1 + g), l2 = *(vf *)(v->lpf2 + g);
+		vf e = *(const vf *)(env0 + g), de = *(const vf *)(denv + g);
+		for (int f = 0; f < n; f++) {
+			ph1 += i1;
+			ph1 -= (vf)((vi)(ph1 > one) & (vi)one);
+			vf t1 = ph1 + half;
+			t1 -= (vf)((vi)(t1 >= one) & (vi)one);
+			vi m1 = ph1 < half;
+			vf s1 = (vf)((m1 & (vi)g1) | (~m1 & (vi)-g1)) +
+				g1 * (V_BLEP(ph1, i1, r1) - V_BLEP(t1, i1, r1));
+			l1 += c1 * (s1 - l1);
+
+			ph2 += i2;
+			ph2 -= (vf)((vi)(ph2 > one) & (vi)one);
+			vf t2 = ph2 + half;
+			t2 -= (vf)((vi)(t2 >= one) & (vi)one);
+			vi m2 = ph2 < half;
+			vf s2 = (vf)((m2 & (vi)g2) | (~m2 & (vi)-g2)) +
+				g2 * (V_BLEP(ph2, i2, r2) - V_BLEP(t2, i2, r2));
+			l2 += c2 * (s2 - l2);
+
+			e += de;
+			*(vf *)acc[f] += (l1 + l2) * e;
+		}
+		*(vf *)(v->phase1 + g) = ph1;
+		*(vf *)(v->phase2 + g) = ph2;
+		*(vf *)(v->lpf1 + g) = l1;
+		*(vf *)(v->lpf2 + g) = l2;
+	}
+}
+#else
+static void render_voices(Voices *v, const Params *p, int lanes, int n,
+			  const float *env0, const float *denv,
+			  float (*acc)[VEC])
+{
+	for (int i = 0; i < lanes; i++) {
+		float e = env0[i];
+		for (int f = 0; f < n; f++) {
+			v->phase1[i] += v->inc1[i];
+			if (v->phase1[i] > 1.0f)
+				v->phase1[i] -= 1.0f;
+			float s1 = square(v->phase1[i], v->inc1[i],
+					  v->rinc1[i], p->osc1_gain);
+			v->lpf1[i] += p->osc1_cutoff * (s1 - v->lpf1[i]);
+
+			v->phase2[i] += v->inc2[i];
+			if (v->phase2[i] > 1.0f)
+				v->phase2[i] -= 1.0f;
+			float s2 = square(v->phase2[i], v->inc2[i],
+					  v->rinc2[i], p->osc2_gain);
+			v->lpf2[i] += p->osc2_cutoff * (s2 - v->lpf2[i]);
+
+			e += denv[i];
+			acc[f][i % VEC] += (v->lpf1[i] + v->lpf2[i]) * e;
+		}
+	}
+}
+#endif
+
+/* Render n <= BLOCK frames of all sounding voices into mono */
+void render_block(Synth *synth, float *mono, int n)
+{
+	Voices *v = &synth->v;
+	int lanes = (v->n + VEC - 1) / VEC * VEC;
+	float acc[BLOCK][VEC] ALIGNED;
+
+	/* Envelopes run at control rate: each voice steps its state
+	   machine once per block, and the kernel interpolates linearly */
+	float mul[N_ENV_STATES], add[N_ENV_STATES];
+	if (n == BLOCK) {
+		memcpy(mul, synth->env_mul, sizeof(mul));
+		memcpy(add, synth->env_add, sizeof(add));
+	} else {
+		for (int s = 0; s < N_ENV_STATES; s++)
+			env_map(synth, (EnvState)s, n, &mul[s], &add[s]);
+	}
+	for (int i = 0; i < v->n; i++) {
+		float e0 = v->env_vol[i];
+		float e1 = update_env(v, i, mul, add, synth->p.sustain);
+		synth->env0[i] = e0;
+		synth->denv[i] = (e1 - e0) / (float)n;
+	}
+	for (int i = v->n; i < lanes; i++)
+		synth->env0[i] = synth->denv[i] = 0.0f;
+
+	memset(acc, 0, sizeof(acc));
+	render_voices(v, &synth->p, lanes, n, synth->env0, synth->denv, acc);
+	for (int i = 0; i < v->n; i++)
+		if (v->state[i] == ENV_RESTART)
+			start_voice(synth, i, v->note[i]);
+	compact_voices(v);
+
+	float gain = synth->p.master_gain / HEADROOM;
+	for (int f = 0; f < n; f++) {
+		float mixed = 0.0f;
+		for (int k = 0; k < VEC; k++)
+			mixed += acc[f][k];
+		mono[f] = mixed * gain;
+	}
+}
+
+/* Apply the queued commands and render frameCount stereo frames */
+static void fill_output(Synth *synth, float *out, ma_uint32 frameCount)
+{
+	drain_cmds(synth);
+	if (synth->p.master_gain == 0.0f) {
+		memset(out, 0, frameCount * 2 * sizeof(float));
+		return;
+	}
+
+	float mono[BLOCK];
+	for (ma_uint32 done = 0; done < frameCount;) {
+		ma_uint32 n = frameCount - done < BLOCK ? frameCount - done
+							: BLOCK;
+		render_block(synth, mono, (int)n);
+		for (ma_uint32 f = 0; f < n; f++) {
+			out[(done + f) * 2] = mono[f];
+			out[(done + f) * 2 + 1] = mono[f];
+		}
+		done += n;
+	}
+}
+
+/* The audio delivered so far runs out at cb_end_ns, or sooner if the
+   device buffer cannot hold it all; a callback that starts later than
+   that has let the device run dry, unless the backend has reported the
+   underrun already.  XRUN_DRIFT keeps a device clock that runs slower
+   than CLOCK_MONOTONIC from looking like a slow drain. */
+static void check_xrun(Synth *synth, int64_t t0, ma_uint32 frameCount)
+{
+	int reported = __atomic_exchange_n(&synth->xrun_reported, 0,
+					   __ATOMIC_RELAXED);
+	if (synth->cb_buf_ns == 0)
+		return;
+
+	int64_t end = synth->cb_end_ns;
+	if (end != 0 && t0 > end && !reported)
+		__atomic_fetch_add(&synth->xruns, 1, __ATOMIC_RELAXED);
+	if (end < t0)
+		end = t0;
+	end += (int64_t)((1.0 + XRUN_DRIFT) * 1e9 * frameCount / SAMPLE_RATE);
+	if (end > t0 + synth->cb_buf_ns)
+		end = t0 + synth->cb_buf_ns;
+	synth->cb_end_ns = end;
 }
 
 void data_callback(ma_device *pDevice, void *pOutput, const void *pInput,
@@ -130,52 +842,102 @@ void data_callback(ma_device *pDevice, void *pOutput, const void *pInput,
 {
 	(void)pInput;
 	Synth *synth = (Synth *)pDevice->pUserData;
-	float *out = (float *)pOutput;
+	int64_t t0 = now_ns();
 
-	if (synth->p.master_gain == 0.0f) {
-		memset(pOutput, 0, frameCount * 2 * sizeof(float));
-		return;
+	check_xrun(synth, t0, frameCount);
+	fill_output(synth, (float *)pOutput, frameCount);
+
+	int64_t dt = now_ns() - t0;
+	int64_t b = dt / (HIST_US * 1000);
+	__atomic_fetch_add(&synth->cb_hist[b < HIST_N ? b : HIST_N - 1], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&synth->cb_busy_ns, (uint64_t)dt, __ATOMIC_RELAXED);
+}
+
+/* Interruptions and reroutes break the stream like an underrun */
+static void on_notification(const ma_device_notification *n)
+{
+	Synth *synth = (Synth *)n->pDevice->pUserData;
+	if (n->type == ma_device_notification_type_interruption_began ||
+	    n->type == ma_device_notification_type_rerouted)
+		__atomic_fetch_add(&synth->xruns, 1, __ATOMIC_RELAXED);
+}
+
+/* miniaudio has no underrun notification, but its backends log them
+   (ALSA as "EPIPE (write)") */
+static void on_log(void *user, ma_uint32 level, const char *msg)
+{
+	Synth *synth = (Synth *)user;
+	(void)level;
+	if (strstr(msg, "EPIPE") || strstr(msg, "nderrun")) {
+		__atomic_fetch_add(&synth->xruns, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&synth->xrun_reported, 1, __ATOMIC_RELAXED);
 	}
+}
 
-	for (ma_uint32 i = 0; i < frameCount; i++) {
-		float mixed = 0;
-		for (int v = 0; v < MAX_POLYPHONY; v++) {
-			if (synth->voices[v].active) {
-				float env =
-				    update_env(&synth->voices[v], &synth->p);
-
-				synth->voices[v].phase1 +=
-				    synth->voices[v].target_f1 / SAMPLE_RATE;
-				if (synth->voices[v].phase1 > 1.0)
-					synth->voices[v].phase1 -= 1.0;
-				float s1 = (synth->voices[v].phase1 < 0.5)
-				    ? synth->p.osc1_gain
-				    : -synth->p.osc1_gain;
-				synth->voices[v].lpf1 += synth->p.osc1_cutoff *
-				    (s1 - synth->voices[v].lpf1);
-
-				synth->voices[v].phase2 +=
-				    synth->voices[v].target_f2 / SAMPLE_RATE;
-				if (synth->voices[v].phase2 > 1.0)
-					synth->voices[v].phase2 -= 1.0;
-				float s2 = (synth->voices[v].phase2 < 0.5)
-				    ? synth->p.osc2_gain
-				    : -synth->p.osc2_gain;
-				synth->voices[v].lpf2 += synth->p.osc2_cutoff *
-				    (s2 - synth->voices[v].lpf2);
-
-				mixed += (synth->voices[v].lpf1 +
-					  synth->voices[v].lpf2) *
-				    env;
-			}
-		}
-		float sample = (mixed / HEADROOM) * synth->p.master_gain;
-		out[i * 2] = sample;
-		out[i * 2 + 1] = sample;
+/* Print the callback load and p99 time over the last period, from the
+   histogram counts since the previous call, kept in prev */
+static void report_status(Synth *synth, unsigned long *prev,
+			  uint64_t *prev_busy, int64_t *prev_t)
+{
+	unsigned long d[HIST_N], n = 0;
+	for (int i = 0; i < HIST_N; i++) {
+		unsigned long c =
+		    __atomic_load_n(&synth->cb_hist[i], __ATOMIC_RELAXED);
+		d[i] = c - prev[i];
+		prev[i] = c;
+		n += d[i];
+	}
+	int p99 = 0;
+	for (unsigned long sum = 0; p99 < HIST_N && n > 0; p99++) {
+		sum += d[p99];
+		if (sum * 100 >= n * 99)
+			break;
 	}
+
+	uint64_t busy = __atomic_load_n(&synth->cb_busy_ns, __ATOMIC_RELAXED);
+	int64_t t = now_ns();
+	double load = 100.0 * (double)(busy - *prev_busy) /
+		      (double)(t - *prev_t);
+	*prev_busy = busy;
+	*prev_t = t;
+
+	printf("STATUS SYNTH load=%.1f p99=%d xruns=%lu\n", load,
+	       n > 0 ? (p99 + 1) * HIST_US : 0,
+	       __atomic_load_n(&synth->xruns, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
+
+static void *thr_status(void *arg)
+{
+	Synth *synth = (Synth *)arg;
+	unsigned long prev[HIST_N] = {0};
+	uint64_t prev_busy = 0;
+	int64_t prev_t = now_ns();
+
+	int64_t next = prev_t;
+
+	pthread_mutex_lock(&synth->status_mu);
+	while (!synth->status_stop) {
+		next += (int64_t)STATUS_PERIOD * 1000000000;
+		struct timespec ts = {(time_t)(next / 1000000000),
+				      (long)(next % 1000000000)};
+		while (!synth->status_stop &&
+		       pthread_cond_timedwait(&synth->status_cv,
+					      &synth->status_mu, &ts) == 0)
+			;
+		if (synth->status_stop)
+			break;
+		pthread_mutex_unlock(&synth->status_mu);
+		report_status(synth, prev, &prev_busy, &prev_t);
+		pthread_mutex_lock(&synth->status_mu);
+	}
+	pthread_mutex_unlock(&synth->status_mu);
+	return NULL;
 }
 
-float lily_to_freq(const char *s)
+/* MIDI note of a LilyPond pitch such as "fis'", or -1 */
+int lily_to_midi(const char *s)
 {
 	static const struct {
 		const char *n;
@@ -193,7 +955,7 @@ float lily_to_freq(const char *s)
 		}
 	}
 	if (semi < 0)
-		return 0.0f;
+		return -1;
 	int oct = 3;
 	while (*s == '\'') {
 		oct++;
@@ -203,109 +965,256 @@ float lily_to_freq(const char *s)
 		oct--;
 		s++;
 	}
-	return 440.0f * powf(2.0f, ((oct + 1) * 12 + semi - 69.0f) / 12.0f);
+	int note = (oct + 1) * 12 + semi;
+	return note >= 0 && note < N_NOTES ? note : -1;
 }
 
-int main(void)
+/* Parameter named by a SET command, or -1; VOLUME is MASTER_GAIN */
+int find_param(const char *name)
 {
-	Synth synth = {.p = {.osc1_gain = 0.8f,
-			     .osc2_gain = 0.5f,
-			     .osc1_cutoff = 0.15f,
-			     .osc2_cutoff = 0.08f,
-			     .osc1_detune = 1.0f,
-			     .osc2_detune = 1.004f,
-			     .osc1_oct = 0,
-			     .osc2_oct = -1,
-			     .attack = 0.01f,
-			     .decay = 0.1f,
-			     .sustain = 0.7f,
-			     .release = 0.05f,
-			     .master_gain = 0.0f}};
+	if (strcmp(name, "VOLUME") == 0)
+		return PARAM_MASTER_GAIN;
+	for (int i = 0; i < N_PARAMS; i++)
+		if (strcmp(name, PARAM_NAMES[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* Command in a line of the stdin protocol; returns -1 if none */
+int parse_cmd(const char *line, Cmd *c)
+{
+	char cmd[32], arg1[32], arg2[32];
+	int count = sscanf(line, "%31s %31s %31s", cmd, arg1, arg2);
+	if (count < 2)
+		return -1;
+
+	c->val = 0.0f;
+	if (strcmp(cmd, "NOTE_ON") == 0) {
+		c->type = CMD_NOTE_ON;
+		c->arg = lily_to_midi(arg1);
+	} else if (strcmp(cmd, "NOTE_OFF") == 0) {
+		c->type = CMD_NOTE_OFF;
+		c->arg = lily_to_midi(arg1);
+	} else if (strcmp(cmd, "SET") == 0 && count == 3) {
+		c->type = CMD_SET;
+		c->arg = find_param(arg1);
+		c->val = (float)atof(arg2);
+	} else {
+		return -1;
+	}
+	return c->arg < 0 ? -1 : 0;
+}
+
+/* Time of a --render input line in ms, skipping an "AT <ms>" prefix.
+   AT counts from the start of the render, TIME:<ms> from the first
+   TIME field; a line with neither keeps the time of the one before. */
+static double line_time(const char **line, double prev, double *time0)
+{
+	double t;
+	int len;
+	if (sscanf(*line, " AT %lf%n", &t, &len) == 1) {
+		*line += len;
+		return t;
+	}
+	const char *p = strstr(*line, "TIME:");
+	if (!p)
+		return prev;
+	t = strtod(p + 5, NULL);
+	if (isnan(*time0))
+		*time0 = t;
+	return t - *time0;
+}
+
+/* Render through data_callback into enc until frame end */
+static void render_until(ma_device *dev, ma_encoder *enc, int64_t *frames,
+			 int64_t end)
+{
+	float buf[BLOCK * 2];
+	while (*frames < end) {
+		ma_uint32 n = end - *frames < BLOCK ? (ma_uint32)(end - *frames)
+						    : BLOCK;
+		data_callback(dev, buf, NULL, n);
+		ma_encoder_write_pcm_frames(enc, buf, n, NULL);
+		*frames += n;
+	}
+}
 
+/* In-memory WAV file for --render -: the encoder seeks back to fill in
+   the header, which a pipe on stdout would not allow */
+typedef struct {
+	unsigned char *data;
+	size_t len, cap, pos;
+} MemFile;
+
+static ma_result mem_write(ma_encoder *enc, const void *buf, size_t n,
+			   size_t *written)
+{
+	MemFile *m = (MemFile *)enc->pUserData;
+	if (m->pos + n > m->cap) {
+		size_t cap = m->cap ? m->cap : 65536;
+		while (cap < m->pos + n)
+			cap *= 2;
+		unsigned char *p = realloc(m->data, cap);
+		if (!p)
+			return MA_OUT_OF_MEMORY;
+		m->data = p;
+		m->cap = cap;
+	}
+	memcpy(m->data + m->pos, buf, n);
+	m->pos += n;
+	if (m->pos > m->len)
+		m->len = m->pos;
+	*written = n;
+	return MA_SUCCESS;
+}
+
+static ma_result mem_seek(ma_encoder *enc, ma_int64 offset,
+			  ma_seek_origin origin)
+{
+	MemFile *m = (MemFile *)enc->pUserData;
+	ma_int64 pos = offset;
+	if (origin == ma_seek_origin_current)
+		pos += (ma_int64)m->pos;
+	else if (origin == ma_seek_origin_end)
+		pos += (ma_int64)m->len;
+	if (pos < 0 || pos > (ma_int64)m->len)
+		return MA_INVALID_ARGS;
+	m->pos = (size_t)pos;
+	return MA_SUCCESS;
+}
+
+/* Render the timed commands of in to a WAV file, or to stdout if path
+   is "-", as fast as possible */
+int render(Synth *synth, FILE *in, const char *path)
+{
+	static ma_device dev;
+	ma_encoder enc;
+	ma_encoder_config cfg = ma_encoder_config_init(
+	    ma_encoding_format_wav, ma_format_f32, 2, SAMPLE_RATE);
+	MemFile mem = {0};
+	int to_stdout = strcmp(path, "-") == 0;
+	if ((to_stdout ? ma_encoder_init(mem_write, mem_seek, &mem, &cfg,
+					 &enc)
+		       : ma_encoder_init_file(path, &cfg, &enc)) !=
+	    MA_SUCCESS) {
+		fprintf(stderr, "synth: cannot write %s\n", path);
+		return 1;
+	}
+	dev.pUserData = synth;
+
+	int64_t t0 = now_ns(), frames = 0;
+	double t_ms = 0.0, time0 = NAN;
+	char line[256];
+	while (fgets(line, sizeof(line), in)) {
+		const char *s = line;
+		Cmd c;
+		t_ms = line_time(&s, t_ms, &time0);
+		if (parse_cmd(s, &c) < 0)
+			continue;
+		render_until(&dev, &enc, &frames,
+			     llround(t_ms * SAMPLE_RATE / 1000.0));
+		apply_cmd(synth, &c);
+	}
+
+	/* Let the last notes ring out */
+	int64_t end = frames + RENDER_TAIL * SAMPLE_RATE;
+	while (synth->v.n > 0 && synth->p.master_gain != 0.0f && frames < end)
+		render_until(&dev, &enc, &frames, frames + BLOCK);
+	ma_encoder_uninit(&enc);
+	if (to_stdout) {
+		int ok = fwrite(mem.data, 1, mem.len, stdout) == mem.len &&
+			 fflush(stdout) == 0;
+		free(mem.data);
+		if (!ok) {
+			fprintf(stderr, "synth: cannot write %s\n", path);
+			return 1;
+		}
+	}
+
+	double audio = (double)frames / SAMPLE_RATE;
+	double secs = (double)(now_ns() - t0) / 1e9;
+	fprintf(stderr,
+		"synth: rendered %.2f s in %.3f s, realtime factor %.1f\n",
+		audio, secs, audio / secs);
+	return 0;
+}
+
+/* Play the commands of in on the default audio device as they come */
+int play(Synth *synth, FILE *in)
+{
 	ma_device_config cfg = ma_device_config_init(ma_device_type_playback);
 	cfg.playback.format = ma_format_f32;
 	cfg.playback.channels = 2;
 	cfg.sampleRate = SAMPLE_RATE;
 	cfg.periodSizeInFrames = BUFFER_SIZE;
 	cfg.dataCallback = data_callback;
-	cfg.pUserData = &synth;
+	cfg.notificationCallback = on_notification;
+	cfg.pUserData = synth;
 
 	ma_device dev;
 	if (ma_device_init(NULL, &cfg, &dev) != MA_SUCCESS)
 		return 1;
+	ma_log_register_callback(ma_device_get_log(&dev),
+				 ma_log_callback_init(on_log, synth));
+	if (dev.pContext->backend != ma_backend_null)
+		synth->cb_buf_ns = (int64_t)dev.playback.internalPeriods *
+				   dev.playback.internalPeriodSizeInFrames *
+				   1000000000 / dev.playback.internalSampleRate;
+
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&synth->status_cv, &ca);
+	pthread_condattr_destroy(&ca);
+	pthread_mutex_init(&synth->status_mu, NULL);
+	pthread_t status;
+	pthread_create(&status, NULL, thr_status, synth);
 	ma_device_start(&dev);
 
 	char line[256];
-	while (fgets(line, sizeof(line), stdin)) {
-		char cmd[32], arg1[32], arg2[32];
-		int count = sscanf(line, "%31s %31s %31s", cmd, arg1, arg2);
-		if (count < 2)
-			continue;
-
-		if (strcmp(cmd, "NOTE_ON") == 0) {
-			float f = lily_to_freq(arg1);
-			for (int i = 0; i < MAX_POLYPHONY; i++) {
-				if (synth.voices[i].state == ENV_IDLE) {
-					synth.voices[i].freq = f;
-					synth.voices[i].target_f1 = f *
-					    powf(2.0f, synth.p.osc1_oct) *
-					    synth.p.osc1_detune;
-					synth.voices[i].target_f2 = f *
-					    powf(2.0f, synth.p.osc2_oct) *
-					    synth.p.osc2_detune;
-					synth.voices[i].state = ENV_ATTACK;
-					synth.voices[i].active = true;
-					synth.voices[i].env_vol = 0.0f;
-					break;
-				}
-			}
-		} else if (strcmp(cmd, "NOTE_OFF") == 0) {
-			float f = lily_to_freq(arg1);
-			for (int i = 0; i < MAX_POLYPHONY; i++) {
-				if (synth.voices[i].active &&
-				    fabs(synth.voices[i].freq - f) < 0.1)
-					synth.voices[i].state = ENV_RELEASE;
-			}
-		} else if (strcmp(cmd, "SET") == 0 && count == 3) {
-			float val = atof(arg2);
-			bool freq_changed = false;
-
-			if (strcmp(arg1, "ATTACK") == 0)
-				synth.p.attack = val;
-			else if (strcmp(arg1, "DECAY") == 0)
-				synth.p.decay = val;
-			else if (strcmp(arg1, "SUSTAIN") == 0)
-				synth.p.sustain = val;
-			else if (strcmp(arg1, "RELEASE") == 0)
-				synth.p.release = val;
-			else if (strcmp(arg1, "OSC1_GAIN") == 0)
-				synth.p.osc1_gain = val;
-			else if (strcmp(arg1, "OSC2_GAIN") == 0)
-				synth.p.osc2_gain = val;
-			else if (strcmp(arg1, "OSC1_OCT") == 0) {
-				synth.p.osc1_oct = (int)val;
-				freq_changed = true;
-			} else if (strcmp(arg1, "OSC2_OCT") == 0) {
-				synth.p.osc2_oct = (int)val;
-				freq_changed = true;
-			} else if (strcmp(arg1, "OSC1_DETUNE") == 0) {
-				synth.p.osc1_detune = val;
-				freq_changed = true;
-			} else if (strcmp(arg1, "OSC2_DETUNE") == 0) {
-				synth.p.osc2_detune = val;
-				freq_changed = true;
-			} else if (strcmp(arg1, "OSC1_CUTOFF") == 0)
-				synth.p.osc1_cutoff = val;
-			else if (strcmp(arg1, "OSC2_CUTOFF") == 0)
-				synth.p.osc2_cutoff = val;
-			else if (strcmp(arg1, "MASTER_GAIN") == 0 ||
-				 strcmp(arg1, "VOLUME") == 0)
-				synth.p.master_gain = val;
-
-			if (freq_changed)
-				update_voice_frequencies(&synth);
-		}
+	while (fgets(line, sizeof(line), in)) {
+		Cmd c;
+		if (parse_cmd(line, &c) == 0)
+			push_cmd(synth, c.type, c.arg, c.val);
 	}
 	ma_device_uninit(&dev);
+
+	pthread_mutex_lock(&synth->status_mu);
+	synth->status_stop = true;
+	pthread_cond_signal(&synth->status_cv);
+	pthread_mutex_unlock(&synth->status_mu);
+	pthread_join(status, NULL);
 	return 0;
 }
+
+int main(int argc, char *argv[])
+{
+	Synth synth = {.p = {.osc1_gain = 0.8f,
+			     .osc2_gain = 0.5f,
+			     .osc1_cutoff = 0.15f,
+			     .osc2_cutoff = 0.08f,
+			     .osc1_detune = 1.0f,
+			     .osc2_detune = 1.004f,
+			     .osc1_oct = 0,
+			     .osc2_oct = -1,
+			     .attack = 0.01f,
+			     .decay = 0.1f,
+			     .sustain = 0.7f,
+			     .release = 0.05f,
+			     .master_gain = 0.0f}};
+	set_env_rates(&synth);
+
+	int ret;
+	if (argc == 3 && strcmp(argv[1], "--render") == 0) {
+		ret = render(&synth, stdin, argv[2]);
+	} else if (argc == 1) {
+		ret = play(&synth, stdin);
+	} else {
+		fprintf(stderr, "Usage: %s [--render <out.wav>|-]\n", argv[0]);
+		return 1;
+	}
+	fprintf(stderr,
+		"synth: notes stolen=%lu dropped=%lu cmds dropped=%lu\n",
+		synth.notes_stolen, synth.notes_dropped, synth.cmd_dropped);
+	return ret;
+}
@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: MIT
+// warp.c --- LD_PRELOAD shim that runs a process on an accelerated clock
+// Copyright (c) 2026 Jakob Kastelic
+
+/* DESCRIPTION
+ *     warp.so is preloaded into every child of run.c when the graph is
+ *     started with -w. It replaces the libc time functions so that wall
+ *     and monotonic time advance <speed> times faster than real time, and
+ *     sleeps finish <speed> times sooner. All processes of a graph share
+ *     the same origin, so their virtual clocks agree with each other.
+ *
+ *     Virtual time is computed as
+ *         v = v0 + (r - r0) * speed
+ *     where r is the real clock reading, r0 the real clock at the origin,
+ *     and v0 the virtual clock at the origin: WARP_EPOCH for
+ *     CLOCK_REALTIME, or r0 itself for CLOCK_MONOTONIC.
+ *
+ * INTERCEPTED
+ *     clock_gettime, time, gettimeofday       (REALTIME and MONOTONIC)
+ *     nanosleep, clock_nanosleep, usleep, sleep
+ *     Other clocks (e.g. CPU time) and timeouts of poll/select pass
+ *     through unchanged.
+ *
+ * ENVIRONMENT (set by run.c)
+ *     WARP_SPEED   Speed factor, e.g. 100.
+ *     WARP_EPOCH   Virtual Unix time at the origin, in seconds.
+ *     WARP_REAL0   CLOCK_REALTIME at the origin, in nanoseconds.
+ *     WARP_MONO0   CLOCK_MONOTONIC at the origin, in nanoseconds.
+ *
+ * BUILD
+ *     cc -shared -fPIC -O2 -o warp.so warp.c -ldl
+ */
+
+#define _GNU_SOURCE /* RTLD_NEXT */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS 1000000000LL
+
+static int (*real_clock_gettime)(clockid_t, struct timespec *);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*real_clock_nanosleep)(clockid_t, int, const struct timespec *,
+				   struct timespec *);
+
+static double speed = 1.0;
+static int64_t real0, mono0, epoch0;
+
+static int64_t ts_to_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * NS + ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns)
+{
+	struct timespec ts = {(time_t)(ns / NS), (long)(ns % NS)};
+	if (ts.tv_nsec < 0) {
+		ts.tv_nsec += NS;
+		ts.tv_sec--;
+	}
+	return ts;
+}
+
+static int64_t env_i64(const char *name, int64_t def)
+{
+	const char *v = getenv(name);
+	return v ? strtoll(v, NULL, 10) : def;
+}
+
+/* Runs as a constructor, or earlier from the first intercepted call if
+   another library's constructor reads the clock or sleeps before ours */
+__attribute__((constructor)) static void warp_init(void)
+{
+	if (real_clock_gettime)
+		return;
+	real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+	real_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+	real_clock_gettime = dlsym(RTLD_NEXT, "clock_gettime");
+
+	struct timespec ts;
+	real_clock_gettime(CLOCK_REALTIME, &ts);
+	real0 = env_i64("WARP_REAL0", ts_to_ns(&ts));
+	real_clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono0 = env_i64("WARP_MONO0", ts_to_ns(&ts));
+	epoch0 = env_i64("WARP_EPOCH", real0 / NS) * NS;
+
+	const char *s = getenv("WARP_SPEED");
+	if (s && strtod(s, NULL) > 0.0)
+		speed = strtod(s, NULL);
+}
+
+static int warped(clockid_t clk)
+{
+	return clk == CLOCK_REALTIME || clk == CLOCK_MONOTONIC;
+}
+
+/* Origin of clk as (real, virtual) pair */
+static void origin(clockid_t clk, int64_t *r0, int64_t *v0)
+{
+	*r0 = clk == CLOCK_REALTIME ? real0 : mono0;
+	*v0 = clk == CLOCK_REALTIME ? epoch0 : mono0;
+}
+
+static int64_t to_virtual(clockid_t clk, int64_t r)
+{
+	int64_t r0, v0;
+	origin(clk, &r0, &v0);
+	return v0 + (int64_t)((double)(r - r0) * speed);
+}
+
+static int64_t to_real(clockid_t clk, int64_t v)
+{
+	int64_t r0, v0;
+	origin(clk, &r0, &v0);
+	return r0 + (int64_t)((double)(v - v0) / speed);
+}
+
+int clock_gettime(clockid_t clk, struct timespec *tp)
+{
+	if (!real_clock_gettime)
+		warp_init();
+	int ret = real_clock_gettime(clk, tp);
+	if (ret == 0 && warped(clk))
+		*tp = ns_to_ts(to_virtual(clk, ts_to_ns(tp)));
+	return ret;
+}
+
+time_t time(time_t *tloc)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (tloc)
+		*tloc = ts.tv_sec;
+	return ts.tv_sec;
+}
+
+/* glibc declares tv nonnull, which would let the compiler drop the NULL
+   check the kernel's gettimeofday has; define the body under another name */
+static int warp_gettimeofday(struct timeval *tv, void *tz)
+{
+	(void)tz;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (tv) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+	}
+	return 0;
+}
+int gettimeofday(struct timeval *tv, void *tz)
+	__attribute__((alias("warp_gettimeofday")));
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	if (!real_clock_gettime)
+		warp_init();
+	if (req->tv_nsec < 0 || req->tv_nsec >= NS) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct timespec r = ns_to_ts((int64_t)(ts_to_ns(req) / speed));
+	int ret = real_nanosleep(&r, rem);
+	if (ret < 0 && rem)
+		*rem = ns_to_ts((int64_t)(ts_to_ns(rem) * speed));
+	return ret;
+}
+
+int clock_nanosleep(clockid_t clk, int flags, const struct timespec *req,
+		    struct timespec *rem)
+{
+	if (!real_clock_gettime)
+		warp_init();
+	if (!warped(clk))
+		return real_clock_nanosleep(clk, flags, req, rem);
+	if (req->tv_nsec < 0 || req->tv_nsec >= NS)
+		return EINVAL;
+	struct timespec r;
+	if (flags & TIMER_ABSTIME)
+		r = ns_to_ts(to_real(clk, ts_to_ns(req)));
+	else
+		r = ns_to_ts((int64_t)(ts_to_ns(req) / speed));
+	int ret = real_clock_nanosleep(clk, flags, &r, rem);
+	if (ret == EINTR && rem && !(flags & TIMER_ABSTIME))
+		*rem = ns_to_ts((int64_t)(ts_to_ns(rem) * speed));
+	return ret;
+}
+
+int usleep(useconds_t usec)
+{
+	struct timespec ts = ns_to_ts((int64_t)usec * 1000);
+	return nanosleep(&ts, NULL);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+	struct timespec ts = {(time_t)seconds, 0}, rem = {0, 0};
+	if (nanosleep(&ts, &rem) < 0)
+		return (unsigned int)rem.tv_sec + (rem.tv_nsec > 0);
+	return 0;
+}